@@ -0,0 +1,451 @@
+#include "audioengine.h"
+#include "traceevents.h"
+
+#include <string.h>
+
+AudioResampler::AudioResampler()
+{
+    context = NULL;
+    outRate = 0;
+    outChannels = 0;
+    outFormat = AV_SAMPLE_FMT_S16;
+    inLayout = 0;
+    inRate = 0;
+    inFormat = -1;
+    cacheHits = NULL;
+    cacheMisses = NULL;
+}
+
+AudioResampler::~AudioResampler()
+{
+    swr_free(&context);
+}
+
+void AudioResampler::setOutput(int rate, int channels, AVSampleFormat format)
+{
+    outRate = rate;
+    outChannels = channels;
+    outFormat = format;
+    swr_free(&context);
+}
+
+void AudioResampler::setStats(StatsRegistry* stats)
+{
+    cacheHits = stats->addCounter("resample.cache_hits");
+    cacheMisses = stats->addCounter("resample.cache_misses");
+}
+
+int AudioResampler::convert(const AVFrame* frame, Uint8* out, int outFrames)
+{
+    TRACE_SCOPE("resample");
+    Sint64 layout = frame->channel_layout ? frame->channel_layout : av_get_default_channel_layout(frame->channels);
+
+    // the players used to set up a new context for every frame, which also threw away the filter history
+    if (!context || layout != inLayout || frame->sample_rate != inRate || frame->format != inFormat) {
+        statsAdd(cacheMisses, 1);
+        swr_free(&context);
+        context = swr_alloc_set_opts(NULL, av_get_default_channel_layout(outChannels), outFormat, outRate,
+            layout, (AVSampleFormat)frame->format, frame->sample_rate, 0, NULL);
+        if (!context || swr_init(context) < 0) {
+            swr_free(&context);
+            return -1;
+        }
+        inLayout = layout;
+        inRate = frame->sample_rate;
+        inFormat = frame->format;
+    } else {
+        statsAdd(cacheHits, 1);
+    }
+    return swr_convert(context, &out, outFrames, (const uint8_t**)frame->data, frame->nb_samples);
+}
+
+int AudioResampler::getRate() const
+{
+    return outRate;
+}
+
+int AudioResampler::getChannels() const
+{
+    return outChannels;
+}
+
+int AudioResampler::getFrameBytes() const
+{
+    return outChannels * av_get_bytes_per_sample(outFormat);
+}
+
+AudioDecoder::AudioDecoder()
+{
+    format = NULL;
+    codec = NULL;
+    frame = NULL;
+    stream = -1;
+    SDL_zero(tag);
+    packets = NULL;
+    bytes = NULL;
+    busyUs = NULL;
+    errors = NULL;
+}
+
+AudioDecoder::~AudioDecoder()
+{
+    close();
+}
+
+bool AudioDecoder::open(const char* path)
+{
+    AVCodec* decoder;
+
+    close();
+    if (avformat_open_input(&format, path, NULL, NULL) != 0)
+        return false;
+    if (avformat_find_stream_info(format, NULL) < 0)
+        return false;
+    av_dump_format(format, 0, path, 0);
+
+    for (unsigned i = 0; i < format->nb_streams; i++) {
+        if (format->streams[i]->codec->codec_type == AVMEDIA_TYPE_AUDIO && stream < 0)
+            stream = i;
+    }
+    if (stream < 0)
+        return false;
+
+    codec = format->streams[stream]->codec;
+    decoder = avcodec_find_decoder(codec->codec_id);
+    if (!decoder) {
+        fprintf(stderr, "Unsupported codec!\n");
+        return false;
+    }
+    if (avcodec_open2(codec, decoder, NULL) < 0)
+        return false;
+    frame = av_frame_alloc();
+    return frame != NULL;
+}
+
+void AudioDecoder::close()
+{
+    av_frame_free(&frame);
+    if (codec)
+        avcodec_close(codec);
+    codec = NULL;
+    if (format)
+        avformat_close_input(&format);
+    stream = -1;
+}
+
+void AudioDecoder::setOutput(int rate, int channels, AVSampleFormat format)
+{
+    resampler.setOutput(rate, channels, format);
+}
+
+void AudioDecoder::setStats(StatsRegistry* stats)
+{
+    packets = stats->addCounter("decode.packets");
+    bytes = stats->addCounter("decode.bytes");
+    busyUs = stats->addCounter("decode.busy_us");
+    errors = stats->addCounter("decode.errors");
+    resampler.setStats(stats);
+}
+
+bool AudioDecoder::readPacket(AVPacket* packet)
+{
+    TRACE_SCOPE("demux");
+    while (av_read_frame(format, packet) >= 0) {
+        if (packet->stream_index == stream) {
+            SDL_zero(tag);
+            tag.demuxTicks = SDL_GetPerformanceCounter();
+            return true;
+        }
+        av_free_packet(packet);
+    }
+    return false;
+}
+
+int AudioDecoder::decode(const AVPacket* packet, Uint8* buffer, int size)
+{
+    TRACE_SCOPE("decode");
+    AVPacket pending = *packet;
+    int frameBytes = resampler.getFrameBytes();
+    int written = 0;
+    Uint64 start = SDL_GetPerformanceCounter();
+
+    // a packet can hold several frames, each call consumes part of it
+    while (pending.size > 0) {
+        int gotFrame = 0;
+        int used = avcodec_decode_audio4(codec, frame, &gotFrame, &pending);
+        if (used < 0) {
+            statsAdd(errors, 1);
+            return -1;
+        }
+        if (used == 0 && !gotFrame)
+            break;
+        pending.data += used;
+        pending.size -= used;
+        if (!gotFrame)
+            continue;
+
+        if (frame->channels == 0 && frame->channel_layout > 0)
+            frame->channels = av_get_channel_layout_nb_channels(frame->channel_layout);
+        int converted = resampler.convert(frame, buffer + written, (size - written) / frameBytes);
+        if (converted < 0) {
+            statsAdd(errors, 1);
+            return -1;
+        }
+        written += converted * frameBytes;
+    }
+    tag.decodeTicks = SDL_GetPerformanceCounter();
+    statsAdd(packets, 1);
+    statsAdd(bytes, written);
+    statsAdd(busyUs, (tag.decodeTicks - start) * 1000000 / SDL_GetPerformanceFrequency());
+    return written;
+}
+
+void AudioDecoder::flush()
+{
+    avcodec_flush_buffers(codec);
+}
+
+int AudioDecoder::getSampleRate() const
+{
+    return codec->sample_rate;
+}
+
+int AudioDecoder::getChannels() const
+{
+    return codec->channels;
+}
+
+int AudioDecoder::getFrameSize() const
+{
+    return codec->frame_size;
+}
+
+const AudioResampler& AudioDecoder::getResampler() const
+{
+    return resampler;
+}
+
+const latencyTag& AudioDecoder::getLatencyTag() const
+{
+    return tag;
+}
+
+SampleQueue::SampleQueue()
+{
+    mutex = SDL_CreateMutex();
+    cond = SDL_CreateCond();
+    head = 0;
+    count = 0;
+    finished = false;
+    drained = false;
+    samplesPut = 0;
+    depth = NULL;
+    samplesIn = NULL;
+}
+
+SampleQueue::~SampleQueue()
+{
+    SDL_DestroyCond(cond);
+    SDL_DestroyMutex(mutex);
+}
+
+void SampleQueue::setStats(StatsRegistry* stats)
+{
+    depth = stats->addCounter("queue.buffers");
+    samplesIn = stats->addCounter("queue.samples_put");
+}
+
+void SampleQueue::put(const Sint16* samples, int sampleCount, const latencyTag* tag)
+{
+    TRACE_SCOPE("queue put");
+    std::vector<Sint16> buffer;
+    size_t tail;
+
+    SDL_LockMutex(mutex);
+    if (count == slots.size()) {
+        // full, the ring doubles here rather than ever in get
+        std::vector<Buffer> grown(slots.empty() ? 16 : slots.size() * 2);
+        for (size_t i = 0; i < count; i++) {
+            Buffer& from = slots[(head + i) % slots.size()];
+            grown[i].samples.swap(from.samples);
+            grown[i].tag = from.tag;
+        }
+        slots.swap(grown);
+        head = 0;
+    }
+    // get only moves head past queued slots, so the tail slot stays put while the lock is dropped
+    tail = (head + count) % slots.size();
+    buffer.swap(slots[tail].samples);
+    SDL_UnlockMutex(mutex);
+
+    // copied outside the lock into the slot's old storage, the callback only ever waits on the swap
+    buffer.assign(samples, samples + sampleCount);
+
+    SDL_LockMutex(mutex);
+    Buffer& back = slots[tail];
+    back.samples.swap(buffer);
+    if (tag)
+        back.tag = *tag;
+    else
+        SDL_zero(back.tag);
+    back.tag.queueTicks = SDL_GetPerformanceCounter();
+    count++;
+    samplesPut += sampleCount;
+    traceCounter("queued buffers", count);
+    statsSet(depth, count);
+    statsAdd(samplesIn, sampleCount);
+    SDL_CondSignal(cond);
+    SDL_UnlockMutex(mutex);
+}
+
+int SampleQueue::get(Uint8* buf, int size, bool* underrun, latencyTag* tag)
+{
+    TRACE_SCOPE("queue get");
+    int len;
+
+    *underrun = false;
+    SDL_LockMutex(mutex);
+    if (count == 0 && !finished) {
+        *underrun = true;
+        while (count == 0 && !finished)
+            SDL_CondWait(cond, mutex);
+    }
+    if (count == 0) {
+        drained = true;
+        SDL_UnlockMutex(mutex);
+        return 0;
+    }
+
+    Buffer& front = slots[head];
+    len = SDL_min((int)(front.samples.size() * sizeof(Sint16)), size);
+    memcpy(buf, front.samples.data(), len);
+    if (tag) {
+        *tag = front.tag;
+        tag->dequeueTicks = SDL_GetPerformanceCounter();
+    }
+    // the slot keeps its storage for put, nothing is allocated or freed on the audio thread
+    head = (head + 1) % slots.size();
+    count--;
+    traceCounter("queued buffers", count);
+    statsSet(depth, count);
+    SDL_UnlockMutex(mutex);
+
+    return len;
+}
+
+void SampleQueue::finish()
+{
+    SDL_LockMutex(mutex);
+    finished = true;
+    SDL_CondSignal(cond);
+    SDL_UnlockMutex(mutex);
+}
+
+bool SampleQueue::isDrained()
+{
+    SDL_LockMutex(mutex);
+    bool done = drained;
+    SDL_UnlockMutex(mutex);
+    return done;
+}
+
+Uint64 SampleQueue::getSamplesPut()
+{
+    SDL_LockMutex(mutex);
+    Uint64 samples = samplesPut;
+    SDL_UnlockMutex(mutex);
+    return samples;
+}
+
+int SampleQueue::getQueued()
+{
+    SDL_LockMutex(mutex);
+    int queued = count;
+    SDL_UnlockMutex(mutex);
+    return queued;
+}
+
+AudioMixer::AudioMixer(SampleQueue* samples, SDL_AudioFormat streamFormat)
+{
+    queue = samples;
+    format = streamFormat;
+    volume = SDL_MIX_MAXVOLUME;
+    profiler = NULL;
+    latency = NULL;
+    SDL_zero(tag);
+    bytesOut = NULL;
+    underruns = NULL;
+    buffer = new Uint8[AUDIO_ENGINE_BUFFER_SIZE];
+    bufferLength = 0;
+    bufferIndex = 0;
+}
+
+AudioMixer::~AudioMixer()
+{
+    delete[] buffer;
+}
+
+void AudioMixer::setVolume(int mixVolume)
+{
+    volume = SDL_max(0, SDL_min(mixVolume, SDL_MIX_MAXVOLUME));
+}
+
+void AudioMixer::setProfiler(callbackProfiler* callbackProfiler)
+{
+    profiler = callbackProfiler;
+}
+
+void AudioMixer::setLatencyProfiler(latencyProfiler* latencyProfiler)
+{
+    latency = latencyProfiler;
+}
+
+void AudioMixer::setStats(StatsRegistry* stats)
+{
+    bytesOut = stats->addCounter("mixer.bytes");
+    underruns = stats->addCounter("mixer.underruns");
+}
+
+void AudioMixer::mix(Uint8* stream, int len)
+{
+    traceSetThreadName("audio callback");
+    TRACE_SCOPE("callback");
+
+    SDL_memset(stream, 0, len);
+    statsAdd(bytesOut, len);
+    while (len > 0) {
+        if (bufferIndex >= bufferLength) {
+            bool underrun;
+            bufferLength = queue->get(buffer, AUDIO_ENGINE_BUFFER_SIZE, &underrun, &tag);
+            bufferIndex = 0;
+            if (underrun) {
+                if (profiler)
+                    callbackProfilerUnderrun(profiler);
+                statsAdd(underruns, 1);
+            }
+            // the stream has ended, the rest stays silent
+            if (bufferLength <= 0) {
+                bufferLength = 0;
+                return;
+            }
+        }
+        int len1 = SDL_min(bufferLength - bufferIndex, len);
+
+        // mixing into silence at full volume is a plain copy
+        if (volume == SDL_MIX_MAXVOLUME)
+            memcpy(stream, buffer + bufferIndex, len1);
+        else
+            SDL_MixAudioFormat(stream, buffer + bufferIndex, format, len1, volume);
+
+        len -= len1;
+        stream += len1;
+        bufferIndex += len1;
+        if (bufferIndex >= bufferLength && latency)
+            latencyProfilerRecord(latency, &tag, SDL_GetPerformanceCounter());
+    }
+}
+
+void AudioMixer::callback(void* userdata, Uint8* stream, int len)
+{
+    ((AudioMixer*)userdata)->mix(stream, len);
+}
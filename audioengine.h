@@ -0,0 +1,185 @@
+#ifndef AUDIOENGINE_H
+#define AUDIOENGINE_H
+
+/*
+ * The decode and playback pipeline shared by testaudio and testffaudio,
+ * built into libaudioengine.a by Makefile_audioengine.
+ *
+ *     AudioDecoder decoder;                      // demux, decode, resample
+ *     decoder.open(path);
+ *     decoder.setOutput(rate, channels, AV_SAMPLE_FMT_S16);
+ *
+ *     SampleQueue queue;                         // decoded buffers, oldest first
+ *     AudioMixer mixer(&queue, AUDIO_S16SYS);    // the audio callback side
+ *     want.callback = AudioMixer::callback;
+ *     want.userdata = &mixer;
+ *     sink->open(&want, &have);                  // audiosink.h
+ *
+ *     while (decoder.readPacket(&packet)) {
+ *         int bytes = decoder.decode(&packet, buffer, sizeof(buffer));
+ *         queue.put((Sint16*)buffer, bytes / 2, &decoder.getLatencyTag());
+ *     }
+ *     queue.finish();
+ *
+ * The decoder and the queue's put side run on one thread, the mixer on the
+ * audio thread. Every stage has a trace point for traceevents.h, and the
+ * tag passed to put carries the packet's timestamps on to the mixer's
+ * latencyProfiler. Given a StatsRegistry, each part registers its counters
+ * under its own prefix: decode., resample., queue. and mixer.
+ */
+
+#include <SDL.h>
+#include <vector>
+
+#include "audiosink.h"
+#include "callbackprofiler.h"
+#include "latencyprofiler.h"
+#include "statsregistry.h"
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libswresample/swresample.h>
+};
+
+// room for one packet's worth of decoded audio, as the players have always sized it
+#define AUDIO_ENGINE_BUFFER_SIZE ((192000 * 3) / 2)
+
+// converts decoded frames to one output format, keeping the context while the input stays the same
+class AudioResampler
+{
+private:
+    SwrContext* context;
+    int outRate;
+    int outChannels;
+    AVSampleFormat outFormat;
+    // what the context was set up for
+    Sint64 inLayout;
+    int inRate;
+    int inFormat;
+    StatsCounter* cacheHits;
+    StatsCounter* cacheMisses;
+public:
+    AudioResampler();
+    ~AudioResampler();
+    void setOutput(int rate, int channels, AVSampleFormat format);
+    // counts frames converted with the context already set up and ones that needed a new one
+    void setStats(StatsRegistry* stats);
+    // appends frame to out, which has room for outFrames; returns the frames written, -1 on error
+    int convert(const AVFrame* frame, Uint8* out, int outFrames);
+    int getRate() const;
+    int getChannels() const;
+    // bytes of one output frame, all channels
+    int getFrameBytes() const;
+};
+
+class AudioDecoder
+{
+private:
+    AVFormatContext* format;
+    AVCodecContext* codec;
+    AVFrame* frame;
+    int stream;
+    AudioResampler resampler;
+    latencyTag tag;
+    StatsCounter* packets;
+    StatsCounter* bytes;
+    StatsCounter* busyUs;
+    StatsCounter* errors;
+public:
+    AudioDecoder();
+    ~AudioDecoder();
+    // opens the first audio stream of path and dumps its format, false if it can't be decoded
+    bool open(const char* path);
+    void close();
+    void setOutput(int rate, int channels, AVSampleFormat format);
+    // packets and bytes decoded and the time it took, for throughput; the resampler's counters too
+    void setStats(StatsRegistry* stats);
+    // the next packet of the audio stream, false at the end of the file
+    bool readPacket(AVPacket* packet);
+    // decodes every frame in packet into buffer in the output format; returns the bytes written, -1 on error
+    int decode(const AVPacket* packet, Uint8* buffer, int size);
+    // starts decoding from a clean state, for when packets are fed again from the top
+    void flush();
+    int getSampleRate() const;
+    int getChannels() const;
+    int getFrameSize() const;
+    const AudioResampler& getResampler() const;
+    // when the last packet was demuxed and decoded, for SampleQueue::put
+    const latencyTag& getLatencyTag() const;
+};
+
+// decoded buffers handed from the decoding thread to the audio callback
+class SampleQueue
+{
+private:
+    SDL_mutex* mutex;
+    SDL_cond* cond;
+    struct Buffer
+    {
+        std::vector<Sint16> samples;
+        latencyTag tag;
+    };
+    // a ring of count buffers from head; only put grows it, and a played slot keeps its samples'
+    // storage for the next put, so get never allocates or frees and the queue stops allocating
+    // once it has warmed up
+    std::vector<Buffer> slots;
+    size_t head;
+    size_t count;
+    bool finished;
+    bool drained;
+    Uint64 samplesPut;
+    StatsCounter* depth;
+    StatsCounter* samplesIn;
+public:
+    SampleQueue();
+    ~SampleQueue();
+    // the buffers waiting and the samples put so far
+    void setStats(StatsRegistry* stats);
+    // tag, if given, is stamped with the time the samples went in
+    void put(const Sint16* samples, int count, const latencyTag* tag = NULL);
+    // copies the oldest buffer into buf, waiting while the queue is empty and not finished;
+    // returns the bytes copied, 0 once everything has been played. underrun is set when it had to wait,
+    // tag gets the buffer's tag stamped with the time it was taken
+    int get(Uint8* buf, int size, bool* underrun, latencyTag* tag = NULL);
+    // no more buffers are coming, wakes a get waiting for one
+    void finish();
+    // true once get has found the queue finished and empty
+    bool isDrained();
+    Uint64 getSamplesPut();
+    int getQueued();
+};
+
+// fills the audio callback's stream from the queue
+class AudioMixer
+{
+private:
+    SampleQueue* queue;
+    SDL_AudioFormat format;
+    int volume;
+    callbackProfiler* profiler;
+    latencyProfiler* latency;
+    latencyTag tag;
+    StatsCounter* bytesOut;
+    StatsCounter* underruns;
+    Uint8* buffer;
+    int bufferLength;
+    int bufferIndex;
+public:
+    AudioMixer(SampleQueue* samples, SDL_AudioFormat streamFormat);
+    ~AudioMixer();
+    // 0 to SDL_MIX_MAXVOLUME, full volume copies the samples as they are
+    void setVolume(int mixVolume);
+    // counts the queue running dry as underruns of this profiler
+    void setProfiler(callbackProfiler* callbackProfiler);
+    // records each buffer's tag once its last sample is written out
+    void setLatencyProfiler(latencyProfiler* latencyProfiler);
+    // the bytes handed to the callback's stream and the times the queue ran dry
+    void setStats(StatsRegistry* stats);
+    void mix(Uint8* stream, int len);
+    // an SDL_AudioCallback, userdata is the mixer
+    static void callback(void* userdata, Uint8* stream, int len);
+};
+
+#endif
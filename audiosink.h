@@ -0,0 +1,303 @@
+#ifndef AUDIOSINK_H
+#define AUDIOSINK_H
+
+/*
+ * Where the players' audio callbacks send their output.
+ *
+ *     AudioSink* sink = audioSinkCreate("null");   // "sdl", "null" or "wav:out.wav"
+ *     sink->open(&want, &have);
+ *     sink->pause(false);
+ *     ...
+ *     sink->close();
+ *     delete sink;
+ *
+ * The sdl sink is the audio device, pulled on the audio clock. The null and
+ * wav sinks pull from a thread of their own as fast as the callback returns,
+ * so whatever feeds the callback runs flat out; the wav sink also writes
+ * every buffer to a WAV file. The callback sees no difference between them,
+ * a profiler wrapped around it keeps working.
+ */
+
+#include <SDL.h>
+#include <stdio.h>
+#include <string.h>
+
+class AudioSink
+{
+protected:
+    SDL_AudioSpec spec;
+    SDL_atomic_t framesPulled;
+
+    // runs the program's callback for one buffer
+    void pull(Uint8* stream, int len)
+    {
+        spec.callback(spec.userdata, stream, len);
+        SDL_AtomicAdd(&framesPulled, len / (SDL_AUDIO_BITSIZE(spec.format) / 8 * spec.channels));
+    }
+public:
+    AudioSink()
+    {
+        SDL_zero(spec);
+        SDL_AtomicSet(&framesPulled, 0);
+    }
+    virtual ~AudioSink() {}
+
+    // takes the callback from want, fills have with the spec it will be pulled in
+    virtual bool open(const SDL_AudioSpec* want, SDL_AudioSpec* have) = 0;
+    virtual void pause(bool paused) = 0;
+    virtual void close() = 0;
+    // false when the sink pulls as fast as the callback returns
+    virtual bool isRealtime() const = 0;
+    virtual const char* getName() const = 0;
+
+    Uint32 getFramesPulled()
+    {
+        return SDL_AtomicGet(&framesPulled);
+    }
+};
+
+class SdlAudioSink : public AudioSink
+{
+private:
+    SDL_AudioDeviceID dev;
+
+    static void callback(void* userdata, Uint8* stream, int len)
+    {
+        ((SdlAudioSink*)userdata)->pull(stream, len);
+    }
+public:
+    SdlAudioSink()
+    {
+        dev = 0;
+    }
+    bool open(const SDL_AudioSpec* want, SDL_AudioSpec* have)
+    {
+        SDL_AudioSpec device = *want;
+        spec = *want;
+        device.callback = callback;
+        device.userdata = this;
+        dev = SDL_OpenAudioDevice(NULL, 0, &device, have, SDL_AUDIO_ALLOW_ANY_CHANGE);
+        if (dev == 0) {
+            SDL_LogError(SDL_LOG_CATEGORY_AUDIO, "Failed to open audio: %s", SDL_GetError());
+            return false;
+        }
+        spec.format = have->format;
+        spec.channels = have->channels;
+        spec.freq = have->freq;
+        spec.samples = have->samples;
+        spec.size = have->size;
+        have->callback = want->callback;
+        have->userdata = want->userdata;
+        return true;
+    }
+    void pause(bool paused)
+    {
+        SDL_PauseAudioDevice(dev, paused);
+    }
+    void close()
+    {
+        if (dev)
+            SDL_CloseAudioDevice(dev);
+        dev = 0;
+    }
+    bool isRealtime() const
+    {
+        return true;
+    }
+    const char* getName() const
+    {
+        return "sdl";
+    }
+};
+
+// pulls the callback from its own thread, back to back
+class PullAudioSink : public AudioSink
+{
+private:
+    SDL_Thread* thread;
+    SDL_atomic_t paused;
+    SDL_atomic_t quit;
+    // held around each pull, so pausing can wait out the one in flight
+    SDL_mutex* pulling;
+    Uint8* buffer;
+
+    static int pullThread(void* data)
+    {
+        PullAudioSink* sink = (PullAudioSink*)data;
+        while (!SDL_AtomicGet(&sink->quit)) {
+            SDL_LockMutex(sink->pulling);
+            if (SDL_AtomicGet(&sink->paused)) {
+                SDL_UnlockMutex(sink->pulling);
+                SDL_Delay(1);
+                continue;
+            }
+            sink->pull(sink->buffer, sink->spec.size);
+            sink->deliver(sink->buffer, sink->spec.size);
+            SDL_UnlockMutex(sink->pulling);
+        }
+        return 0;
+    }
+protected:
+    // what the sink does with each buffer once the callback filled it
+    virtual void deliver(const Uint8* stream, int len) = 0;
+    virtual bool start()
+    {
+        return true;
+    }
+    virtual void finish() {}
+public:
+    PullAudioSink()
+    {
+        thread = NULL;
+        buffer = NULL;
+        pulling = SDL_CreateMutex();
+        SDL_AtomicSet(&paused, 1);
+        SDL_AtomicSet(&quit, 0);
+    }
+    ~PullAudioSink()
+    {
+        SDL_DestroyMutex(pulling);
+    }
+    bool open(const SDL_AudioSpec* want, SDL_AudioSpec* have)
+    {
+        spec = *want;
+        spec.size = spec.samples * spec.channels * (SDL_AUDIO_BITSIZE(spec.format) / 8);
+        spec.silence = SDL_AUDIO_ISSIGNED(spec.format) ? 0 : 0x80;
+        *have = spec;
+        if (!start())
+            return false;
+        buffer = new Uint8[spec.size];
+        thread = SDL_CreateThread(pullThread, getName(), this);
+        if (!thread) {
+            // close() only finishes what a running thread pulled, undo start() here
+            SDL_LogError(SDL_LOG_CATEGORY_AUDIO, "Failed to start the %s sink: %s", getName(), SDL_GetError());
+            finish();
+            delete[] buffer;
+            buffer = NULL;
+            return false;
+        }
+        return true;
+    }
+    // like SDL_PauseAudioDevice, once pausing returns the callback is not running
+    void pause(bool pausing)
+    {
+        SDL_AtomicSet(&paused, pausing);
+        if (pausing) {
+            SDL_LockMutex(pulling);
+            SDL_UnlockMutex(pulling);
+        }
+    }
+    void close()
+    {
+        if (thread) {
+            SDL_AtomicSet(&quit, 1);
+            SDL_WaitThread(thread, NULL);
+            thread = NULL;
+            finish();
+        }
+        delete[] buffer;
+        buffer = NULL;
+    }
+    bool isRealtime() const
+    {
+        return false;
+    }
+};
+
+class NullAudioSink : public PullAudioSink
+{
+protected:
+    void deliver(const Uint8* stream, int len) {}
+public:
+    const char* getName() const
+    {
+        return "null";
+    }
+};
+
+class WavAudioSink : public PullAudioSink
+{
+private:
+    const char* path;
+    FILE* file;
+    Uint32 dataBytes;
+
+    static void put16(Uint8* p, Uint16 value)
+    {
+        p[0] = value & 0xFF;
+        p[1] = value >> 8;
+    }
+    static void put32(Uint8* p, Uint32 value)
+    {
+        put16(p, value & 0xFFFF);
+        put16(p + 2, value >> 16);
+    }
+    void writeHeader()
+    {
+        Uint8 header[44];
+        Uint16 sampleBytes = SDL_AUDIO_BITSIZE(spec.format) / 8;
+        memcpy(header, "RIFF", 4);
+        put32(header + 4, 36 + dataBytes);
+        memcpy(header + 8, "WAVEfmt ", 8);
+        put32(header + 16, 16);
+        put16(header + 20, SDL_AUDIO_ISFLOAT(spec.format) ? 3 : 1);
+        put16(header + 22, spec.channels);
+        put32(header + 24, spec.freq);
+        put32(header + 28, spec.freq * spec.channels * sampleBytes);
+        put16(header + 32, spec.channels * sampleBytes);
+        put16(header + 34, sampleBytes * 8);
+        memcpy(header + 36, "data", 4);
+        put32(header + 40, dataBytes);
+        fseek(file, 0, SEEK_SET);
+        fwrite(header, 1, sizeof(header), file);
+    }
+protected:
+    bool start()
+    {
+        file = fopen(path, "wb");
+        if (!file) {
+            SDL_LogError(SDL_LOG_CATEGORY_AUDIO, "Unable to write %s", path);
+            return false;
+        }
+        dataBytes = 0;
+        writeHeader();
+        return true;
+    }
+    void deliver(const Uint8* stream, int len)
+    {
+        // written as the callback produced it, the players' SYS formats are little endian on the hosts we run
+        fwrite(stream, 1, len, file);
+        dataBytes += len;
+    }
+    void finish()
+    {
+        writeHeader();
+        fclose(file);
+        file = NULL;
+    }
+public:
+    WavAudioSink(const char* wavPath)
+    {
+        path = wavPath;
+        file = NULL;
+        dataBytes = 0;
+    }
+    const char* getName() const
+    {
+        return "wav";
+    }
+};
+
+// "sdl", "null" or "wav:<path>", NULL for anything else
+inline AudioSink* audioSinkCreate(const char* name)
+{
+    if (!strcmp(name, "sdl"))
+        return new SdlAudioSink();
+    if (!strcmp(name, "null"))
+        return new NullAudioSink();
+    if (!strncmp(name, "wav:", 4) && name[4])
+        return new WavAudioSink(name + 4);
+    return NULL;
+}
+
+#endif
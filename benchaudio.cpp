@@ -0,0 +1,370 @@
+/*
+ * Microbenchmarks for the rendering and decoding kernels of the test players.
+ *
+ *     make -f Makefile_benchaudio bench > results.jsonl
+ *
+ * Each player is compiled in here inside its own namespace, so the kernels
+ * measured are exactly the ones the players run, globals and all; the
+ * decoder is libaudioengine's, its source built with each build's flags. Every
+ * kernel renders --seconds of audio in its player's block size, --runs
+ * times, and prints one JSON object per line:
+ *
+ *     {"kernel":"sm_mixer","build":"O3-native","compiler":"12.2.0","rate":44100,
+ *      "channels":2,"voices":4,"block_frames":1024,"frames":441344,"runs":5,
+ *      "ns_per_sample_min":2.1,"ns_per_sample_median":2.2,"realtime_factor":10796.4}
+ *
+ * The decode kernel runs once per input, the compressed file given and the
+ * bundled 808 WAVs, and its lines carry an "input" field naming the file.
+ * A sample here is one sample frame, all channels of it. realtime_factor is
+ * the seconds of audio rendered per second of wall time in the fastest run.
+ * Only the kernel calls are timed, setup between blocks is not.
+ */
+
+#include <SDL.h>
+
+/* every header the players pull in, so their includes inside the namespaces below are no-ops */
+#include <queue>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <cmath>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <assert.h>
+#include <time.h>
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+#include "audioengine.h"
+#include "callbackprofiler.h"
+#include "peakpyramid.h"
+#include "statsregistry.h"
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libswscale/swscale.h>
+#include <libavutil/dict.h>
+#include <libswresample/swresample.h>
+};
+
+namespace simplemixer {
+#include "simplemixer/simplemixer.cpp"
+}
+
+namespace testaudio2 {
+#include "testaudio2.cpp"
+}
+
+namespace testaudio3 {
+#include "testaudio3.cpp"
+}
+
+namespace testaudiobeep {
+#include "testaudiobeep.cpp"
+}
+
+namespace testffaudio {
+#include "testffaudio.cpp"
+}
+
+#if !defined(BENCH_BUILD)
+#define BENCH_BUILD "default"
+#endif
+
+#define BENCH_DEFAULT_SECONDS 10
+#define BENCH_DEFAULT_RUNS 5
+#define BENCH_DEFAULT_COMPRESSED "bench-sine.mp2"
+#define BENCH_BEEP_VOICES 8
+
+/* blocks in a row a kernel may render nothing, a decoder priming say, before the run is abandoned */
+#define BENCH_MAX_EMPTY_BLOCKS 64
+
+/* simplemixer's sounds, played by sm_mixer and decoded by the decode kernel */
+static const char *benchWavs[] = {
+    "simplemixer/808-bassdrum.wav",
+    "simplemixer/808-clap.wav",
+    "simplemixer/808-cowbell.wav",
+    "simplemixer/808-hihat.wav",
+};
+
+typedef struct {
+    const char *name;
+    /* the file a decode kernel reads, NULL for the synthesized ones */
+    const char *input;
+    int rate;
+    int channels;
+    int voices;
+    Uint32 blockFrames;
+    /* untimed, before every block */
+    void (*prepare)(void);
+    /* renders one block, returns the frames it produced */
+    Uint32 (*render)(void);
+} benchKernel;
+
+/* big enough for one block of any kernel, and for one decoded packet */
+static Uint8 benchBuffer[AUDIO_ENGINE_BUFFER_SIZE];
+
+/* sm_mixer: all four 808 voices kept playing */
+
+static void smPrepare(void) {
+    unsigned voice;
+    for (voice = 0; voice < SM_VOICES; voice++)
+        if (!simplemixer::voices[voice].data)
+            simplemixer::sm_play(voice, voice, 0.7, 0.6);
+}
+
+static Uint32 smRender(void) {
+    simplemixer::sm_mixer(NULL, benchBuffer, 1024 * 4);
+    return 1024;
+}
+
+/* testaudio2: the 441 Hz sine callback */
+
+static int sineSampleNr = 0;
+
+static Uint32 sineRender(void) {
+    testaudio2::audio_callback(&sineSampleNr, benchBuffer, 2048 * 2);
+    return 2048;
+}
+
+/* testaudio3: speak for the three test voices of one video frame */
+
+static testaudio3::voice speakVoices[3];
+static std::vector<float> speakWaveform;
+
+static void speakSetup(void) {
+    using namespace testaudio3;
+    int i;
+    samplesPerFrame = sampleRate / frameRate;
+    audioBuffer = (float*)benchBuffer;
+    audioMainLeftOff = 0;
+    speakWaveform.resize(getWaveformLength(0));
+    buildSineWave(&speakWaveform[0], speakWaveform.size());
+    for (i = 0; i < 3; i++) {
+        speakVoices[i].waveform = &speakWaveform[0];
+        speakVoices[i].waveformLength = speakWaveform.size();
+        speakVoices[i].volume = 1;
+        speakVoices[i].pan = i * 0.5;
+        speakVoices[i].phase = 0;
+    }
+    speakVoices[0].frequency = getFrequency(45);
+    speakVoices[1].frequency = getFrequency(49);
+    speakVoices[2].frequency = getFrequency(52);
+}
+
+static void speakPrepare(void) {
+    SDL_memset(benchBuffer, 0, sizeof(float) * testaudio3::samplesPerFrame);
+}
+
+static Uint32 speakRender(void) {
+    int i;
+    for (i = 0; i < 3; i++)
+        testaudio3::speak(&speakVoices[i]);
+    return testaudio3::samplesPerFrame / 2;
+}
+
+/* Beeper::generateSamples: one new beep per block, each eight blocks long */
+
+static testaudiobeep::Beeper *beeper = NULL;
+static double beepFrequency = 220;
+
+static void beepPrepare(void) {
+    beeper->beepAt(beepFrequency, 0, 2048 * BENCH_BEEP_VOICES);
+    beepFrequency = beepFrequency < 880 ? beepFrequency * 1.25 : 220;
+}
+
+static Uint32 beepRender(void) {
+    beeper->generateSamples((Sint16*)benchBuffer, 2048);
+    return 2048;
+}
+
+/* audio_decode_frame_private, now AudioDecoder::decode: packets demuxed up front, decoded round and round */
+
+static AudioDecoder decoder;
+static std::vector<AVPacket> decodePackets;
+static size_t decodeNext = 0;
+
+static void decodeTeardown(void) {
+    size_t i;
+    for (i = 0; i < decodePackets.size(); i++)
+        av_free_packet(&decodePackets[i]);
+    decodePackets.clear();
+    decodeNext = 0;
+    decoder.close();
+}
+
+static int decodeSetup(const char *path) {
+    AVPacket packet;
+
+    decodeTeardown();
+    if (!decoder.open(path))
+        return -1;
+    /* what testffaudio asks the device for */
+    decoder.setOutput(decoder.getSampleRate(), decoder.getChannels(), AV_SAMPLE_FMT_S16);
+    while (decoder.readPacket(&packet)) {
+        if (av_dup_packet(&packet) >= 0)
+            decodePackets.push_back(packet);
+        else
+            av_free_packet(&packet);
+    }
+    return decodePackets.empty() ? -1 : 0;
+}
+
+static void decodePrepare(void) {
+    if (decodeNext == decodePackets.size()) {
+        decodeNext = 0;
+        decoder.flush();
+    }
+}
+
+static Uint32 decodeRender(void) {
+    int bytes = decoder.decode(&decodePackets[decodeNext++], benchBuffer, sizeof(benchBuffer));
+    return bytes > 0 ? bytes / decoder.getResampler().getFrameBytes() : 0;
+}
+
+static int compareDoubles(const void *a, const void *b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+/* -1, and no JSON, when the kernel stops producing audio */
+static int runKernel(benchKernel *k, double seconds, int runs) {
+    Uint64 frequency = SDL_GetPerformanceFrequency();
+    Uint64 target = (Uint64)(seconds * k->rate);
+    Uint64 frames = 0;
+    std::vector<double> nsPerSample(runs);
+    int run;
+
+    for (run = 0; run < runs; run++) {
+        Uint64 ticks = 0;
+        int empty = 0;
+        frames = 0;
+        while (frames < target) {
+            if (k->prepare)
+                k->prepare();
+            Uint64 start = SDL_GetPerformanceCounter();
+            Uint32 rendered = k->render();
+            ticks += SDL_GetPerformanceCounter() - start;
+            frames += rendered;
+            empty = rendered ? 0 : empty + 1;
+            if (empty == BENCH_MAX_EMPTY_BLOCKS) {
+                fprintf(stderr, "%s%s%s rendered nothing for %d blocks, giving up\n",
+                    k->name, k->input ? " on " : "", k->input ? k->input : "", empty);
+                return -1;
+            }
+        }
+        nsPerSample[run] = ticks * 1e9 / frequency / frames;
+    }
+    qsort(&nsPerSample[0], runs, sizeof(double), compareDoubles);
+
+    printf("{\"kernel\":\"%s\",", k->name);
+    if (k->input)
+        printf("\"input\":\"%s\",", k->input);
+    printf("\"build\":\"%s\",\"compiler\":\"%s\",\"rate\":%d,\"channels\":%d,\"voices\":%d,"
+        "\"block_frames\":%u,\"frames\":%llu,\"runs\":%d,\"ns_per_sample_min\":%.4f,\"ns_per_sample_median\":%.4f,"
+        "\"realtime_factor\":%.1f}\n",
+        BENCH_BUILD, __VERSION__, k->rate, k->channels, k->voices, k->blockFrames,
+        (unsigned long long)frames, runs, nsPerSample[0], nsPerSample[runs / 2],
+        1e9 / k->rate / nsPerSample[0]);
+    fflush(stdout);
+    return 0;
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: benchaudio [--seconds s] [--runs n] [--kernel name] [compressed file]\n");
+}
+
+int main(int argc, char *argv[]) {
+    double seconds = BENCH_DEFAULT_SECONDS;
+    int runs = BENCH_DEFAULT_RUNS;
+    const char *only = NULL;
+    const char *compressed = BENCH_DEFAULT_COMPRESSED;
+    int failed = 0;
+    int i, j;
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--seconds") && i + 1 < argc)
+            seconds = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--runs") && i + 1 < argc)
+            runs = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--kernel") && i + 1 < argc)
+            only = argv[++i];
+        else if (argv[i][0] != '-')
+            compressed = argv[i];
+        else {
+            usage();
+            return 1;
+        }
+    }
+    if (seconds <= 0 || runs < 1) {
+        usage();
+        return 1;
+    }
+
+    /* no audio subsystem, nothing here opens a device or a window */
+    if (SDL_Init(0) < 0)
+        return 1;
+
+    SDL_memset(simplemixer::sounds, 0, sizeof(simplemixer::sounds));
+    SDL_memset(simplemixer::voices, 0, sizeof(simplemixer::voices));
+    if (simplemixer::sm_load(0, benchWavs[0]) | simplemixer::sm_load(1, benchWavs[1]) |
+        simplemixer::sm_load(2, benchWavs[2]) | simplemixer::sm_load(3, benchWavs[3])) {
+        fprintf(stderr, "Couldn't load the 808 sounds, run from the repository root\n");
+        return 1;
+    }
+    speakSetup();
+    beeper = new testaudiobeep::Beeper();
+    av_register_all();
+
+    benchKernel kernels[] = {
+        { "sm_mixer", NULL, 44100, 2, SM_VOICES, 1024, smPrepare, smRender },
+        { "speak", NULL, (int)testaudio3::sampleRate, 2, 3, testaudio3::samplesPerFrame / 2, speakPrepare, speakRender },
+        { "Beeper::generateSamples", NULL, testaudiobeep::FREQUENCY, 1, BENCH_BEEP_VOICES, 2048, beepPrepare, beepRender },
+        { "testaudio2::audio_callback", NULL, testaudio2::SAMPLE_RATE, 1, 1, 2048, NULL, sineRender },
+        /* named as before the engine moved into libaudioengine, so results compare across runs */
+        { "audio_decode_frame_private", NULL, 0, 0, 1, 0, decodePrepare, decodeRender },
+    };
+    /* the decode kernel runs once per input, the compressed file and then the WAVs */
+    const char *decodeInputs[] = { compressed, benchWavs[0], benchWavs[1], benchWavs[2], benchWavs[3] };
+    int decodeInputCount = sizeof(decodeInputs) / sizeof(decodeInputs[0]);
+    int kernelCount = sizeof(kernels) / sizeof(kernels[0]);
+
+    for (i = 0; i < kernelCount; i++) {
+        benchKernel *k = &kernels[i];
+        if (only && strcmp(only, k->name))
+            continue;
+        if (k->render != decodeRender) {
+            failed |= runKernel(k, seconds, runs);
+            continue;
+        }
+        for (j = 0; j < decodeInputCount; j++) {
+            if (decodeSetup(decodeInputs[j]) < 0) {
+                fprintf(stderr, "Skipping %s on %s, couldn't decode it%s\n", k->name, decodeInputs[j],
+                    j == 0 ? " (make -f Makefile_benchaudio " BENCH_DEFAULT_COMPRESSED ")" : "");
+                continue;
+            }
+            k->input = decodeInputs[j];
+            k->rate = decoder.getSampleRate();
+            k->channels = decoder.getChannels();
+            /* PCM has no fixed frame size, each packet is a block */
+            k->blockFrames = decoder.getFrameSize();
+            failed |= runKernel(k, seconds, runs);
+        }
+        decodeTeardown();
+    }
+
+    /* the beeper never opened a device, leave it be rather than print its empty profile */
+    SDL_Quit();
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,203 @@
+#ifndef CALLBACKPROFILER_H
+#define CALLBACKPROFILER_H
+
+/*
+ * Audio callback deadline profiler shared by the test players.
+ *
+ * Wrap the callback in the desired spec before opening the device, start the
+ * profiler with the obtained spec, then poll it from the main loop and dump
+ * it on exit:
+ *
+ *     callbackProfilerWrap(&profiler, "testaudio", &want);
+ *     dev = SDL_OpenAudioDevice(NULL, 0, &want, &have, ...);
+ *     callbackProfilerStart(&profiler, &have);
+ *     ...
+ *     callbackProfilerPoll(&profiler);
+ *     ...
+ *     callbackProfilerDump(&profiler);
+ *
+ * The callback side only does atomic adds into fixed histograms, never locks
+ * or allocates. Run time and the deviation of each callback's start from the
+ * buffer period are binned in percent of the period. CALLBACK_PROFILE_MS
+ * sets the summary interval, 0 turns the periodic summary off. The wrapped
+ * callback is also what rtcheck.h watches in an RTCHECK build.
+ */
+
+#include <SDL.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "rtcheck.h"
+
+/* 1% of the buffer period per bin, the last bin catches everything at 200% and up */
+#define CALLBACK_PROFILE_BINS 201
+
+/* run time at or above this share of the period is a near miss */
+#define CALLBACK_PROFILE_NEAR_MISS_PERCENT 80
+
+/* a callback starting this much later than one period after the last is late */
+#define CALLBACK_PROFILE_LATE_PERCENT 50
+
+#define CALLBACK_PROFILE_DEFAULT_MS 5000
+
+typedef struct {
+    const char *name;
+
+    /* the program's own callback */
+    SDL_AudioCallback callback;
+    void *userdata;
+
+    /* set once the device is open */
+    int freq;
+    Uint32 frames;
+    Uint64 periodTicks;
+    Uint64 frequency;
+
+    /* written by the callback only */
+    Uint64 lastStartTicks;
+
+    SDL_atomic_t callbacks;
+    SDL_atomic_t overruns;
+    SDL_atomic_t nearMisses;
+    SDL_atomic_t lateCallbacks;
+    SDL_atomic_t underruns;
+    SDL_atomic_t maxRunUs;
+    SDL_atomic_t maxJitterUs;
+    SDL_atomic_t runBins[CALLBACK_PROFILE_BINS];
+    SDL_atomic_t jitterBins[CALLBACK_PROFILE_BINS];
+
+    /* main thread only */
+    Uint32 reportMs;
+    Uint32 lastReportTicks;
+} callbackProfiler;
+
+static inline int callbackProfilerBin(Uint64 ticks, Uint64 periodTicks) {
+    Uint64 bin = ticks * 100 / periodTicks;
+    return bin >= CALLBACK_PROFILE_BINS ? CALLBACK_PROFILE_BINS - 1 : (int)bin;
+}
+
+static inline void callbackProfilerRaise(SDL_atomic_t *value, int candidate) {
+    int old;
+    do {
+        old = SDL_AtomicGet(value);
+        if (candidate <= old)
+            return;
+    } while (!SDL_AtomicCAS(value, old, candidate));
+}
+
+/* the callback SDL actually calls, times the program's callback around the deadline */
+static inline void callbackProfilerCallback(void *userdata, Uint8 *stream, int len) {
+    callbackProfiler *p = (callbackProfiler*)userdata;
+    Uint64 start = SDL_GetPerformanceCounter();
+
+    rtcheckEnter();
+    p->callback(p->userdata, stream, len);
+    rtcheckLeave();
+
+    /* not started yet, nothing to measure against */
+    if (p->periodTicks == 0)
+        return;
+
+    Uint64 run = SDL_GetPerformanceCounter() - start;
+    int runBin = callbackProfilerBin(run, p->periodTicks);
+    SDL_AtomicAdd(&p->runBins[runBin], 1);
+    callbackProfilerRaise(&p->maxRunUs, (int)(run * 1000000 / p->frequency));
+    if (run > p->periodTicks)
+        SDL_AtomicAdd(&p->overruns, 1);
+    else if (runBin >= CALLBACK_PROFILE_NEAR_MISS_PERCENT)
+        SDL_AtomicAdd(&p->nearMisses, 1);
+
+    /* how far this start was from one period after the last */
+    if (p->lastStartTicks) {
+        Uint64 interval = start - p->lastStartTicks;
+        Uint64 jitter = interval > p->periodTicks ? interval - p->periodTicks : p->periodTicks - interval;
+        SDL_AtomicAdd(&p->jitterBins[callbackProfilerBin(jitter, p->periodTicks)], 1);
+        callbackProfilerRaise(&p->maxJitterUs, (int)(jitter * 1000000 / p->frequency));
+        if (interval > p->periodTicks && callbackProfilerBin(jitter, p->periodTicks) >= CALLBACK_PROFILE_LATE_PERCENT)
+            SDL_AtomicAdd(&p->lateCallbacks, 1);
+    }
+    p->lastStartTicks = start;
+    SDL_AtomicAdd(&p->callbacks, 1);
+}
+
+/* swaps the profiler in as the spec's callback, call before opening the device */
+static inline void callbackProfilerWrap(callbackProfiler *p, const char *name, SDL_AudioSpec *spec) {
+    const char *reportMs = getenv("CALLBACK_PROFILE_MS");
+    SDL_memset(p, 0, sizeof(*p));
+    p->name = name;
+    p->callback = spec->callback;
+    p->userdata = spec->userdata;
+    p->reportMs = reportMs ? (Uint32)atoi(reportMs) : CALLBACK_PROFILE_DEFAULT_MS;
+    spec->callback = callbackProfilerCallback;
+    spec->userdata = p;
+    rtcheckInit();
+}
+
+/* takes the deadline from the spec the device was opened with, call before unpausing */
+static inline void callbackProfilerStart(callbackProfiler *p, const SDL_AudioSpec *obtained) {
+    p->freq = obtained->freq;
+    p->frames = obtained->samples;
+    p->frequency = SDL_GetPerformanceFrequency();
+    p->periodTicks = (Uint64)obtained->samples * p->frequency / obtained->freq;
+    p->lastReportTicks = SDL_GetTicks();
+}
+
+/* the program's callback ran out of audio to give */
+static inline void callbackProfilerUnderrun(callbackProfiler *p) {
+    SDL_AtomicAdd(&p->underruns, 1);
+}
+
+static inline double callbackProfilerPercentile(SDL_atomic_t *bins, double percentile) {
+    Uint64 total = 0;
+    Uint64 seen = 0;
+    int i;
+    for (i = 0; i < CALLBACK_PROFILE_BINS; i++)
+        total += SDL_AtomicGet(&bins[i]);
+    if (total == 0)
+        return 0;
+    for (i = 0; i < CALLBACK_PROFILE_BINS; i++) {
+        seen += SDL_AtomicGet(&bins[i]);
+        if (seen * 100.0 >= total * percentile)
+            break;
+    }
+    return i;
+}
+
+static inline void callbackProfilerDump(callbackProfiler *p) {
+    double periodMs;
+    double maxRunUs;
+    Uint32 floorFrames = 1;
+
+    if (p->periodTicks == 0)
+        return;
+    periodMs = p->periodTicks * 1000.0 / p->frequency;
+    maxRunUs = SDL_AtomicGet(&p->maxRunUs);
+
+    /* smallest power of two buffer the worst run seen would still fit in without a near miss */
+    while (floorFrames < 65536 && floorFrames * 1000000.0 / p->freq * CALLBACK_PROFILE_NEAR_MISS_PERCENT / 100 < maxRunUs)
+        floorFrames <<= 1;
+
+    printf(
+        "[%s] %d callbacks of %u frames, %.2f ms deadline\n"
+        "  run time  p50 %.0f%%  p99 %.0f%%  p99.9 %.0f%%  max %.0f us (%.1f%%)\n"
+        "  jitter    p50 %.0f%%  p99 %.0f%%  p99.9 %.0f%%  max %d us\n"
+        "  overruns %d  near misses %d  late %d  underruns %d  buffer floor ~%u frames\n",
+        p->name, SDL_AtomicGet(&p->callbacks), p->frames, periodMs,
+        callbackProfilerPercentile(p->runBins, 50), callbackProfilerPercentile(p->runBins, 99),
+        callbackProfilerPercentile(p->runBins, 99.9), maxRunUs, maxRunUs / 10 / periodMs,
+        callbackProfilerPercentile(p->jitterBins, 50), callbackProfilerPercentile(p->jitterBins, 99),
+        callbackProfilerPercentile(p->jitterBins, 99.9), SDL_AtomicGet(&p->maxJitterUs),
+        SDL_AtomicGet(&p->overruns), SDL_AtomicGet(&p->nearMisses),
+        SDL_AtomicGet(&p->lateCallbacks), SDL_AtomicGet(&p->underruns), floorFrames
+    );
+}
+
+/* prints the summary when the interval has passed, call from the main loop */
+static inline void callbackProfilerPoll(callbackProfiler *p) {
+    Uint32 now = SDL_GetTicks();
+    if (p->reportMs == 0 || p->periodTicks == 0 || now - p->lastReportTicks < p->reportMs)
+        return;
+    p->lastReportTicks = now;
+    callbackProfilerDump(p);
+}
+
+#endif
@@ -0,0 +1,215 @@
+#ifndef LATENCYPROFILER_H
+#define LATENCYPROFILER_H
+
+/*
+ * End-to-end latency of the decode pipeline, from av_read_frame handing over
+ * a packet to the last of its samples leaving the audio callback.
+ *
+ * Every decoded buffer carries a latencyTag through the engine: the decoder
+ * stamps demux and decode, the queue stamps put and get, and the mixer
+ * records the tag once the buffer has been copied out in full:
+ *
+ *     latencyProfilerInit(&latency, "testaudio");
+ *     mixer.setLatencyProfiler(&latency);
+ *     latencyProfilerStart(&latency, &have);
+ *     ...
+ *     samplesq.put(samples, count, &decoder.getLatencyTag());
+ *     ...
+ *     latencyProfilerPoll(&latency);
+ *     ...
+ *     latencyProfilerDump(&latency);
+ *
+ * Stages are decode (demux to decoded and resampled), enqueue (decoded to in
+ * the queue), queue (waiting for the callback) and callback (taken by the
+ * callback to its last sample written out), plus the total. Like
+ * callbackprofiler.h the recording side is atomic adds into fixed
+ * histograms, safe in the callback. Bins are eight per octave of
+ * microseconds, so a percentile is at most 1/8 above the true value.
+ * LATENCY_PROFILE_MS sets the summary interval, 0 turns it off.
+ * latencyProfilerSnapshot gives the same numbers to code that wants them.
+ */
+
+#include <SDL.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+
+#define LATENCY_PROFILE_SUBBINS 8
+
+/* 0 to 7 us one bin each, then eight per octave up to 2^33 us, over two hours */
+#define LATENCY_PROFILE_BINS (LATENCY_PROFILE_SUBBINS * 31)
+
+#define LATENCY_PROFILE_DEFAULT_MS 5000
+
+enum {
+    LATENCY_STAGE_DECODE,
+    LATENCY_STAGE_ENQUEUE,
+    LATENCY_STAGE_QUEUE,
+    LATENCY_STAGE_CALLBACK,
+    LATENCY_STAGE_TOTAL,
+    LATENCY_STAGES
+};
+
+static const char *const latencyStageNames[LATENCY_STAGES] = {
+    "decode", "enqueue", "queue", "callback", "total"
+};
+
+/* performance counter ticks of one buffer's way through the pipeline, 0 where not stamped */
+typedef struct {
+    /* av_read_frame returned its packet */
+    Uint64 demuxTicks;
+    /* decoded and resampled */
+    Uint64 decodeTicks;
+    /* in the queue */
+    Uint64 queueTicks;
+    /* taken off the queue by the callback */
+    Uint64 dequeueTicks;
+} latencyTag;
+
+typedef struct {
+    int count;
+    double p50Ms;
+    double p90Ms;
+    double p99Ms;
+    double p999Ms;
+    double maxMs;
+} latencyStageSnapshot;
+
+typedef struct {
+    latencyStageSnapshot stages[LATENCY_STAGES];
+    /* how long a sample can sit in the device buffer after the callback, 0 if not started */
+    double deviceMs;
+} latencySnapshot;
+
+typedef struct {
+    const char *name;
+    Uint64 frequency;
+
+    /* set once the device is open */
+    double deviceMs;
+
+    /* written by the callback only */
+    SDL_atomic_t counts[LATENCY_STAGES];
+    SDL_atomic_t maxUs[LATENCY_STAGES];
+    SDL_atomic_t bins[LATENCY_STAGES][LATENCY_PROFILE_BINS];
+
+    /* main thread only */
+    Uint32 reportMs;
+    Uint32 lastReportTicks;
+} latencyProfiler;
+
+static inline int latencyProfilerBin(Uint64 us) {
+    int msb;
+    if (us < LATENCY_PROFILE_SUBBINS)
+        return (int)us;
+    msb = 63 - __builtin_clzll(us);
+    /* msb 3 starts at bin 8, the three bits below the top one pick the sub-bin */
+    int bin = (msb - 2) * LATENCY_PROFILE_SUBBINS + (int)((us >> (msb - 3)) & (LATENCY_PROFILE_SUBBINS - 1));
+    return bin >= LATENCY_PROFILE_BINS ? LATENCY_PROFILE_BINS - 1 : bin;
+}
+
+/* the largest value that lands in bin */
+static inline double latencyProfilerBinUs(int bin) {
+    int msb, sub;
+    if (bin < LATENCY_PROFILE_SUBBINS)
+        return bin;
+    msb = bin / LATENCY_PROFILE_SUBBINS + 2;
+    sub = bin % LATENCY_PROFILE_SUBBINS;
+    return (double)(((Uint64)(LATENCY_PROFILE_SUBBINS + sub + 1) << (msb - 3)) - 1);
+}
+
+static inline void latencyProfilerInit(latencyProfiler *p, const char *name) {
+    const char *reportMs = getenv("LATENCY_PROFILE_MS");
+    SDL_memset(p, 0, sizeof(*p));
+    p->name = name;
+    p->frequency = SDL_GetPerformanceFrequency();
+    p->reportMs = reportMs ? (Uint32)atoi(reportMs) : LATENCY_PROFILE_DEFAULT_MS;
+    p->lastReportTicks = SDL_GetTicks();
+}
+
+/* takes the device buffer from the spec the device was opened with */
+static inline void latencyProfilerStart(latencyProfiler *p, const SDL_AudioSpec *obtained) {
+    p->deviceMs = obtained->freq ? obtained->samples * 1000.0 / obtained->freq : 0;
+}
+
+static inline void latencyProfilerAdd(latencyProfiler *p, int stage, Uint64 from, Uint64 to) {
+    Uint64 us;
+    int old;
+    if (!from || to < from)
+        return;
+    us = (to - from) * 1000000 / p->frequency;
+    SDL_AtomicAdd(&p->bins[stage][latencyProfilerBin(us)], 1);
+    SDL_AtomicAdd(&p->counts[stage], 1);
+    int capped = us > INT_MAX ? INT_MAX : (int)us;
+    do {
+        old = SDL_AtomicGet(&p->maxUs[stage]);
+        if (capped <= old)
+            break;
+    } while (!SDL_AtomicCAS(&p->maxUs[stage], old, capped));
+}
+
+/* the last sample of a tagged buffer left the callback at playedTicks, call from the callback */
+static inline void latencyProfilerRecord(latencyProfiler *p, const latencyTag *tag, Uint64 playedTicks) {
+    if (!tag->demuxTicks)
+        return;
+    latencyProfilerAdd(p, LATENCY_STAGE_DECODE, tag->demuxTicks, tag->decodeTicks);
+    latencyProfilerAdd(p, LATENCY_STAGE_ENQUEUE, tag->decodeTicks, tag->queueTicks);
+    latencyProfilerAdd(p, LATENCY_STAGE_QUEUE, tag->queueTicks, tag->dequeueTicks);
+    latencyProfilerAdd(p, LATENCY_STAGE_CALLBACK, tag->dequeueTicks, playedTicks);
+    latencyProfilerAdd(p, LATENCY_STAGE_TOTAL, tag->demuxTicks, playedTicks);
+}
+
+static inline double latencyProfilerPercentileMs(const SDL_atomic_t *bins, int count, double percentile) {
+    Uint64 seen = 0;
+    int i;
+    if (count == 0)
+        return 0;
+    for (i = 0; i < LATENCY_PROFILE_BINS - 1; i++) {
+        seen += SDL_AtomicGet((SDL_atomic_t*)&bins[i]);
+        if (seen * 100.0 >= count * percentile)
+            break;
+    }
+    return latencyProfilerBinUs(i) / 1000;
+}
+
+static inline void latencyProfilerSnapshot(latencyProfiler *p, latencySnapshot *snapshot) {
+    int stage;
+    for (stage = 0; stage < LATENCY_STAGES; stage++) {
+        latencyStageSnapshot *s = &snapshot->stages[stage];
+        s->count = SDL_AtomicGet(&p->counts[stage]);
+        s->maxMs = SDL_AtomicGet(&p->maxUs[stage]) / 1000.0;
+        /* the top of a bin can be past anything actually seen */
+        s->p50Ms = SDL_min(latencyProfilerPercentileMs(p->bins[stage], s->count, 50), s->maxMs);
+        s->p90Ms = SDL_min(latencyProfilerPercentileMs(p->bins[stage], s->count, 90), s->maxMs);
+        s->p99Ms = SDL_min(latencyProfilerPercentileMs(p->bins[stage], s->count, 99), s->maxMs);
+        s->p999Ms = SDL_min(latencyProfilerPercentileMs(p->bins[stage], s->count, 99.9), s->maxMs);
+    }
+    snapshot->deviceMs = p->deviceMs;
+}
+
+static inline void latencyProfilerDump(latencyProfiler *p) {
+    latencySnapshot snapshot;
+    int stage;
+
+    latencyProfilerSnapshot(p, &snapshot);
+    if (snapshot.stages[LATENCY_STAGE_TOTAL].count == 0)
+        return;
+    printf("[%s] latency of %d buffers, demux to the end of the callback, the device buffer adds up to %.2f ms\n",
+        p->name, snapshot.stages[LATENCY_STAGE_TOTAL].count, snapshot.deviceMs);
+    for (stage = 0; stage < LATENCY_STAGES; stage++) {
+        latencyStageSnapshot *s = &snapshot.stages[stage];
+        printf("  %-8s p50 %.3f  p90 %.3f  p99 %.3f  p99.9 %.3f  max %.3f ms\n",
+            latencyStageNames[stage], s->p50Ms, s->p90Ms, s->p99Ms, s->p999Ms, s->maxMs);
+    }
+}
+
+/* prints the summary when the interval has passed, call from the main loop */
+static inline void latencyProfilerPoll(latencyProfiler *p) {
+    Uint32 now = SDL_GetTicks();
+    if (p->reportMs == 0 || now - p->lastReportTicks < p->reportMs)
+        return;
+    p->lastReportTicks = now;
+    latencyProfilerDump(p);
+}
+
+#endif
@@ -0,0 +1,309 @@
+#ifndef OSCILLOSCOPE_H
+#define OSCILLOSCOPE_H
+
+/*
+ * Scrolling waveform of what the audio callback plays.
+ *
+ *     Oscilloscope scope;
+ *     scope.create(renderer, 640, 480, have.freq, have.channels);
+ *     ...
+ *     scope.write((Sint16*)stream, len / 2);    // in the callback, after filling stream
+ *     ...
+ *     scope.update();                           // once per video frame
+ *     scope.render(renderer, NULL);
+ *
+ * The callback copies its S16 output into a ring and publishes the new
+ * write position, nothing else. update reads whatever arrived since the
+ * last frame, reduces every column's worth of samples to a min and a max
+ * and rasterizes only those new columns into a streaming texture, both
+ * eight at a time with SSE2. The texture is a ring of columns too, render draws it in two
+ * pieces so the newest column lands on the right edge; nothing already on
+ * screen is drawn again.
+ */
+
+#include <SDL.h>
+#include <string.h>
+#include <atomic>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// samples, all channels, the callback can get ahead of update before old ones are dropped
+#define OSCILLOSCOPE_RING_SAMPLES (1 << 17)
+
+// how much audio the width of the texture shows
+#define OSCILLOSCOPE_SECONDS 2
+
+class Oscilloscope
+{
+private:
+    // written by the callback only
+    Sint16 ring[OSCILLOSCOPE_RING_SAMPLES];
+    std::atomic<Uint64> writePosition;
+
+    // main thread only
+    SDL_Texture* texture;
+    int width;
+    int height;
+    int samplesPerColumn;
+    Uint64 readPosition;
+    // the column being filled, across updates
+    Sint16 partialMin;
+    Sint16 partialMax;
+    int partialCount;
+    // every column's extent in rows, indexed like the texture
+    std::vector<Uint16> columnTop;
+    std::vector<Uint16> columnBottom;
+    Uint64 columns;
+    Uint32 foreground;
+    Uint32 background;
+    // update timing
+    Uint64 updates;
+    Uint64 updateTicks;
+    Uint64 maxUpdateTicks;
+
+    // rows of one texture rect, columns first to last from the ring of extents
+    void upload(int first, int count)
+    {
+        SDL_Rect rect = { first, 0, count, height };
+        void* pixels;
+        int pitch;
+        if (SDL_LockTexture(texture, &rect, &pixels, &pitch) < 0)
+            return;
+        rasterize((Uint32*)pixels, pitch, height, &columnTop[first], &columnBottom[first], count, foreground, background);
+        SDL_UnlockTexture(texture);
+    }
+
+    void finishColumn()
+    {
+        int index = (int)(columns % width);
+        // full scale maps to the top and bottom rows
+        columnTop[index] = (Uint16)((32767 - partialMax) * (height - 1) / 65535);
+        columnBottom[index] = (Uint16)((32767 - partialMin) * (height - 1) / 65535);
+        columns++;
+        partialMin = 32767;
+        partialMax = -32768;
+        partialCount = 0;
+    }
+
+    // folds samples into the columns, starting with the one left partial by the last call
+    void accumulate(const Sint16* samples, int count)
+    {
+        while (count > 0) {
+            int take = SDL_min(count, samplesPerColumn - partialCount);
+            Sint16 low, high;
+            reduce(samples, take, &low, &high);
+            partialMin = SDL_min(partialMin, low);
+            partialMax = SDL_max(partialMax, high);
+            partialCount += take;
+            samples += take;
+            count -= take;
+            if (partialCount == samplesPerColumn)
+                finishColumn();
+        }
+    }
+public:
+    Oscilloscope()
+    {
+        writePosition.store(0, std::memory_order_relaxed);
+        texture = NULL;
+        width = 0;
+        height = 0;
+        samplesPerColumn = 0;
+        readPosition = 0;
+        partialMin = 32767;
+        partialMax = -32768;
+        partialCount = 0;
+        columns = 0;
+        foreground = 0;
+        background = 0;
+        updates = 0;
+        updateTicks = 0;
+        maxUpdateTicks = 0;
+    }
+    ~Oscilloscope()
+    {
+        destroy();
+    }
+
+    // a width by height texture showing OSCILLOSCOPE_SECONDS of audio at rate with channels interleaved
+    bool create(SDL_Renderer* renderer, int textureWidth, int textureHeight, int rate, int channels)
+    {
+        destroy();
+        texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, textureWidth, textureHeight);
+        if (!texture)
+            return false;
+        width = textureWidth;
+        height = textureHeight;
+        samplesPerColumn = SDL_max(1, rate * OSCILLOSCOPE_SECONDS / width) * channels;
+        columnTop.assign(width, height / 2);
+        columnBottom.assign(width, height / 2);
+        // ARGB8888, white on the blue the window is cleared to
+        foreground = 0xFFFFFFFF;
+        background = 0xFF0000FF;
+
+        // start from a flat line and from whatever the callback writes next
+        columns = 0;
+        partialCount = 0;
+        partialMin = 32767;
+        partialMax = -32768;
+        readPosition = writePosition.load(std::memory_order_acquire);
+        upload(0, width);
+        return true;
+    }
+
+    void destroy()
+    {
+        if (texture)
+            SDL_DestroyTexture(texture);
+        texture = NULL;
+    }
+
+    // the callback's output, safe to call before create and without a window
+    void write(const Sint16* samples, int count)
+    {
+        Uint64 position = writePosition.load(std::memory_order_relaxed);
+        int offset = (int)(position % OSCILLOSCOPE_RING_SAMPLES);
+        int first = SDL_min(count, OSCILLOSCOPE_RING_SAMPLES - offset);
+        memcpy(&ring[offset], samples, first * sizeof(Sint16));
+        memcpy(ring, samples + first, (count - first) * sizeof(Sint16));
+        writePosition.store(position + count, std::memory_order_release);
+    }
+
+    // turns the samples written since the last update into columns and uploads just those
+    void update()
+    {
+        if (!texture)
+            return;
+        Uint64 start = SDL_GetPerformanceCounter();
+        Uint64 end = writePosition.load(std::memory_order_acquire);
+        Uint64 firstColumn = columns;
+
+        // fell more than half a ring behind, a stalled window say; the rest could be overwritten as we read
+        if (end - readPosition > OSCILLOSCOPE_RING_SAMPLES / 2) {
+            Uint64 skipTo = end - OSCILLOSCOPE_RING_SAMPLES / 2;
+            readPosition = skipTo - skipTo % samplesPerColumn;
+            partialCount = 0;
+            partialMin = 32767;
+            partialMax = -32768;
+        }
+        while (readPosition < end) {
+            int offset = (int)(readPosition % OSCILLOSCOPE_RING_SAMPLES);
+            int count = (int)SDL_min(end - readPosition, (Uint64)(OSCILLOSCOPE_RING_SAMPLES - offset));
+            accumulate(&ring[offset], count);
+            readPosition += count;
+        }
+
+        // new columns, at most a texture's worth, in up to two rects around the wrap
+        Uint64 fresh = SDL_min(columns - firstColumn, (Uint64)width);
+        int first = (int)((columns - fresh) % width);
+        int run = (int)SDL_min(fresh, (Uint64)(width - first));
+        if (run > 0)
+            upload(first, run);
+        if ((int)fresh > run)
+            upload(0, (int)fresh - run);
+
+        Uint64 ticks = SDL_GetPerformanceCounter() - start;
+        updates++;
+        updateTicks += ticks;
+        maxUpdateTicks = SDL_max(maxUpdateTicks, ticks);
+    }
+
+    // draws the columns oldest to newest across dst, the whole target when dst is NULL
+    void render(SDL_Renderer* renderer, const SDL_Rect* dst)
+    {
+        SDL_Rect full;
+        if (!texture)
+            return;
+        if (!dst) {
+            full.x = 0;
+            full.y = 0;
+            SDL_GetRendererOutputSize(renderer, &full.w, &full.h);
+            dst = &full;
+        }
+        int head = (int)(columns % width);
+        int split = (int)((Sint64)(width - head) * dst->w / width);
+        SDL_Rect olderSrc = { head, 0, width - head, height };
+        SDL_Rect olderDst = { dst->x, dst->y, split, dst->h };
+        SDL_Rect newerSrc = { 0, 0, head, height };
+        SDL_Rect newerDst = { dst->x + split, dst->y, dst->w - split, dst->h };
+        SDL_RenderCopy(renderer, texture, &olderSrc, &olderDst);
+        if (head > 0)
+            SDL_RenderCopy(renderer, texture, &newerSrc, &newerDst);
+    }
+
+    double getMeanUpdateUs() const
+    {
+        return updates ? updateTicks * 1000000.0 / SDL_GetPerformanceFrequency() / updates : 0;
+    }
+
+    double getMaxUpdateUs() const
+    {
+        return maxUpdateTicks * 1000000.0 / SDL_GetPerformanceFrequency();
+    }
+
+    // smallest and largest of count samples
+    static void reduce(const Sint16* samples, int count, Sint16* low, Sint16* high)
+    {
+        Sint16 minimum = 32767;
+        Sint16 maximum = -32768;
+        int i = 0;
+#if defined(__SSE2__)
+        if (count >= 8) {
+            __m128i lows = _mm_set1_epi16(32767);
+            __m128i highs = _mm_set1_epi16(-32768);
+            for (; i + 8 <= count; i += 8) {
+                __m128i v = _mm_loadu_si128((const __m128i*)&samples[i]);
+                lows = _mm_min_epi16(lows, v);
+                highs = _mm_max_epi16(highs, v);
+            }
+            // fold the eight lanes down to one
+            lows = _mm_min_epi16(lows, _mm_srli_si128(lows, 8));
+            lows = _mm_min_epi16(lows, _mm_srli_si128(lows, 4));
+            lows = _mm_min_epi16(lows, _mm_srli_si128(lows, 2));
+            highs = _mm_max_epi16(highs, _mm_srli_si128(highs, 8));
+            highs = _mm_max_epi16(highs, _mm_srli_si128(highs, 4));
+            highs = _mm_max_epi16(highs, _mm_srli_si128(highs, 2));
+            minimum = (Sint16)_mm_extract_epi16(lows, 0);
+            maximum = (Sint16)_mm_extract_epi16(highs, 0);
+        }
+#endif
+        for (; i < count; i++) {
+            minimum = SDL_min(minimum, samples[i]);
+            maximum = SDL_max(maximum, samples[i]);
+        }
+        *low = minimum;
+        *high = maximum;
+    }
+
+    // fills count columns of a height row rect, each foreground from its top to its bottom row
+    static void rasterize(Uint32* pixels, int pitch, int height, const Uint16* top, const Uint16* bottom, int count,
+        Uint32 foreground, Uint32 background)
+    {
+        // row by row so the writes are sequential
+        for (int y = 0; y < height; y++) {
+            Uint32* row = (Uint32*)((Uint8*)pixels + y * pitch);
+            int x = 0;
+#if defined(__SSE2__)
+            // eight columns at a time, rows fit in a signed 16 bit compare
+            __m128i rowIndex = _mm_set1_epi16((short)y);
+            __m128i back = _mm_set1_epi32((int)background);
+            __m128i flip = _mm_set1_epi32((int)(foreground ^ background));
+            for (; x + 8 <= count; x += 8) {
+                __m128i tops = _mm_loadu_si128((const __m128i*)&top[x]);
+                __m128i bottoms = _mm_loadu_si128((const __m128i*)&bottom[x]);
+                __m128i outside = _mm_or_si128(_mm_cmplt_epi16(rowIndex, tops), _mm_cmpgt_epi16(rowIndex, bottoms));
+                __m128i inside = _mm_andnot_si128(outside, _mm_set1_epi16(-1));
+                _mm_storeu_si128((__m128i*)&row[x], _mm_xor_si128(back, _mm_and_si128(flip, _mm_unpacklo_epi16(inside, inside))));
+                _mm_storeu_si128((__m128i*)&row[x + 4], _mm_xor_si128(back, _mm_and_si128(flip, _mm_unpackhi_epi16(inside, inside))));
+            }
+#endif
+            for (; x < count; x++)
+                row[x] = y >= top[x] && y <= bottom[x] ? foreground : background;
+        }
+    }
+};
+
+#endif
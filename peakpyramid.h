@@ -0,0 +1,333 @@
+#ifndef PEAKPYRAMID_H
+#define PEAKPYRAMID_H
+
+/*
+ * Whole-file waveform overview: min, max and RMS of the audio at every
+ * power-of-two zoom level, with a sidecar file so a file is only ever
+ * scanned once.
+ *
+ *     PeakPyramid overview;
+ *     if (!overview.load("song.mp3.peaks", "song.mp3", rate, channels)) {
+ *         overview.reset(rate, channels);
+ *         overview.add(samples, count);          // as the file decodes
+ *         ...
+ *         overview.finish();
+ *         overview.save("song.mp3.peaks", "song.mp3");
+ *     }
+ *     overview.query(startFrame, framesPerPixel, width, columns);
+ *
+ * Level 0 holds one entry per PEAK_PYRAMID_BASE_FRAMES frames, all channels
+ * folded together, and every level above halves the one below as entries
+ * complete, so the pyramid is done as soon as the last sample is added.
+ * query picks the coarsest level whose entries are no wider than a pixel,
+ * so drawing any zoom of any length of file reads a few entries per pixel. The sidecar
+ * remembers the size and modification time of the media it describes and
+ * is ignored once those change.
+ */
+
+#include <SDL.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+
+// frames per level 0 entry, the finest zoom the overview has
+#define PEAK_PYRAMID_BASE_FRAMES 512
+
+#define PEAK_PYRAMID_MAGIC "PKPY"
+#define PEAK_PYRAMID_VERSION 1
+
+// more levels than any sidecar needs, 2^64 frames take 56
+#define PEAK_PYRAMID_MAX_LEVELS 64
+
+struct PeakEntry
+{
+    Sint16 min;
+    Sint16 max;
+    Uint16 rms;
+};
+
+class PeakPyramid
+{
+private:
+    struct Header
+    {
+        char magic[4];
+        Uint32 version;
+        Uint32 rate;
+        Uint32 channels;
+        Uint32 baseFrames;
+        Uint32 levelCount;
+        Uint64 frames;
+        // the media the sidecar was made from
+        Uint64 sourceBytes;
+        Sint64 sourceModified;
+    };
+
+    int rate;
+    int channels;
+    Uint64 frames;
+    std::vector<std::vector<PeakEntry> > levels;
+    // the level 0 entry being filled, across adds
+    Sint16 partialMin;
+    Sint16 partialMax;
+    Uint64 partialSquares;
+    int partialSamples;
+
+    static bool describeSource(const char* path, Uint64* bytes, Sint64* modified)
+    {
+        struct stat info;
+        if (stat(path, &info) != 0)
+            return false;
+        *bytes = (Uint64)info.st_size;
+        *modified = (Sint64)info.st_mtime;
+        return true;
+    }
+
+    // entries per level of a finished pyramid of frames frames and the sidecar bytes that makes,
+    // false when it would take more than PEAK_PYRAMID_MAX_LEVELS levels
+    static bool shape(Uint64 frames, std::vector<Uint64>* entries, Uint64* sidecarBytes)
+    {
+        Uint64 count = frames / PEAK_PYRAMID_BASE_FRAMES + (frames % PEAK_PYRAMID_BASE_FRAMES != 0);
+        entries->clear();
+        *sidecarBytes = sizeof(Header);
+        while (count > 0 && entries->size() < PEAK_PYRAMID_MAX_LEVELS) {
+            entries->push_back(count);
+            *sidecarBytes += sizeof(Uint64) + count * sizeof(PeakEntry);
+            count = count > 1 ? (count + 1) / 2 : 0;
+        }
+        return count == 0;
+    }
+
+    static PeakEntry combine(const PeakEntry& a, const PeakEntry& b)
+    {
+        PeakEntry entry;
+        entry.min = SDL_min(a.min, b.min);
+        entry.max = SDL_max(a.max, b.max);
+        entry.rms = (Uint16)sqrt(((double)a.rms * a.rms + (double)b.rms * b.rms) / 2);
+        return entry;
+    }
+
+    // puts entry on level and carries every completed pair up
+    void push(size_t level, PeakEntry entry)
+    {
+        for (;;) {
+            if (levels.size() == level)
+                levels.push_back(std::vector<PeakEntry>());
+            std::vector<PeakEntry>& below = levels[level];
+            below.push_back(entry);
+            if (below.size() % 2)
+                return;
+            entry = combine(below[below.size() - 2], below.back());
+            level++;
+        }
+    }
+
+    void flushPartial()
+    {
+        PeakEntry entry;
+        if (partialSamples == 0)
+            return;
+        entry.min = partialMin;
+        entry.max = partialMax;
+        entry.rms = (Uint16)SDL_min(sqrt((double)partialSquares / partialSamples), 65535.0);
+        push(0, entry);
+        partialMin = 32767;
+        partialMax = -32768;
+        partialSquares = 0;
+        partialSamples = 0;
+    }
+public:
+    PeakPyramid()
+    {
+        reset(0, 0);
+    }
+
+    // empties the pyramid for audio at rate with channels interleaved
+    void reset(int sampleRate, int sampleChannels)
+    {
+        rate = sampleRate;
+        channels = sampleChannels;
+        frames = 0;
+        levels.clear();
+        partialMin = 32767;
+        partialMax = -32768;
+        partialSquares = 0;
+        partialSamples = 0;
+    }
+
+    // folds in the next count samples of the file, whole frames at a time
+    void add(const Sint16* samples, int count)
+    {
+        int entrySamples = PEAK_PYRAMID_BASE_FRAMES * channels;
+        frames += count / channels;
+        while (count > 0) {
+            int take = SDL_min(count, entrySamples - partialSamples);
+            Sint16 low = partialMin;
+            Sint16 high = partialMax;
+            Uint64 squares = 0;
+            for (int i = 0; i < take; i++) {
+                low = SDL_min(low, samples[i]);
+                high = SDL_max(high, samples[i]);
+                squares += (Sint32)samples[i] * samples[i];
+            }
+            partialMin = low;
+            partialMax = high;
+            partialSquares += squares;
+            partialSamples += take;
+            samples += take;
+            count -= take;
+            if (partialSamples == entrySamples)
+                flushPartial();
+        }
+    }
+
+    // the end of the file, completes the last entry of every level
+    void finish()
+    {
+        flushPartial();
+        // the tail of each level still owes a parent, up to a single top entry: an odd entry
+        // out is its own parent, a pair left by the tail of the level below combines
+        for (size_t level = 0; level < levels.size() && levels[level].size() > 1; level++) {
+            const std::vector<PeakEntry>& below = levels[level];
+            size_t parents = (below.size() + 1) / 2;
+            if (levels.size() == level + 1)
+                levels.push_back(std::vector<PeakEntry>());
+            if (levels[level + 1].size() < parents) {
+                PeakEntry parent = below.size() % 2 ? below.back() : combine(below[below.size() - 2], below.back());
+                levels[level + 1].push_back(parent);
+            }
+        }
+    }
+
+    // false when there is no sidecar or it was made from other media or for another format
+    bool load(const char* sidecar, const char* source, int sampleRate, int sampleChannels)
+    {
+        Header header;
+        Uint64 bytes;
+        Sint64 modified;
+        std::vector<Uint64> entries;
+        Uint64 sidecarBytes;
+        struct stat info;
+        FILE* file;
+        bool ok;
+
+        if (!describeSource(source, &bytes, &modified))
+            return false;
+        file = fopen(sidecar, "rb");
+        if (!file)
+            return false;
+        ok = fread(&header, sizeof(header), 1, file) == 1 &&
+            !memcmp(header.magic, PEAK_PYRAMID_MAGIC, 4) && header.version == PEAK_PYRAMID_VERSION &&
+            header.rate == (Uint32)sampleRate && header.channels == (Uint32)sampleChannels &&
+            header.baseFrames == PEAK_PYRAMID_BASE_FRAMES &&
+            header.sourceBytes == bytes && header.sourceModified == modified;
+        // the header's frames fix every level's size and so the file's, a damaged sidecar
+        // is rejected on those before anything is allocated
+        ok = ok && shape(header.frames, &entries, &sidecarBytes) && header.levelCount == entries.size() &&
+            fstat(fileno(file), &info) == 0 && (Uint64)info.st_size == sidecarBytes;
+        if (ok) {
+            reset(sampleRate, sampleChannels);
+            frames = header.frames;
+            levels.resize(header.levelCount);
+            for (Uint32 level = 0; ok && level < header.levelCount; level++) {
+                Uint64 count;
+                ok = fread(&count, sizeof(count), 1, file) == 1 && count == entries[level];
+                if (ok) {
+                    levels[level].resize(count);
+                    ok = count == 0 || fread(&levels[level][0], sizeof(PeakEntry), count, file) == count;
+                }
+            }
+            if (!ok)
+                reset(sampleRate, sampleChannels);
+        }
+        fclose(file);
+        return ok;
+    }
+
+    // writes the sidecar through a temporary file, so a reader never sees half of one
+    bool save(const char* sidecar, const char* source)
+    {
+        Header header;
+        std::string temporary = std::string(sidecar) + ".tmp";
+        FILE* file;
+        bool ok;
+
+        SDL_zero(header);
+        memcpy(header.magic, PEAK_PYRAMID_MAGIC, 4);
+        header.version = PEAK_PYRAMID_VERSION;
+        header.rate = rate;
+        header.channels = channels;
+        header.baseFrames = PEAK_PYRAMID_BASE_FRAMES;
+        header.levelCount = levels.size();
+        header.frames = frames;
+        if (!describeSource(source, &header.sourceBytes, &header.sourceModified))
+            return false;
+        file = fopen(temporary.c_str(), "wb");
+        if (!file)
+            return false;
+        ok = fwrite(&header, sizeof(header), 1, file) == 1;
+        for (size_t level = 0; ok && level < levels.size(); level++) {
+            Uint64 count = levels[level].size();
+            ok = fwrite(&count, sizeof(count), 1, file) == 1 &&
+                (count == 0 || fwrite(&levels[level][0], sizeof(PeakEntry), count, file) == count);
+        }
+        ok = fclose(file) == 0 && ok;
+        if (ok)
+            ok = rename(temporary.c_str(), sidecar) == 0;
+        if (!ok)
+            remove(temporary.c_str());
+        return ok;
+    }
+
+    // one entry per pixel for width pixels from startFrame; pixels past the end get min above max
+    void query(double startFrame, double framesPerPixel, int width, PeakEntry* columns) const
+    {
+        size_t level = 0;
+        // the coarsest level that still has an entry or more per pixel
+        while (level + 1 < levels.size() && (double)((Uint64)PEAK_PYRAMID_BASE_FRAMES << (level + 1)) <= framesPerPixel)
+            level++;
+        double entryFrames = (double)PEAK_PYRAMID_BASE_FRAMES * ((Uint64)1 << level);
+        const std::vector<PeakEntry>* entries = levels.empty() ? NULL : &levels[level];
+
+        for (int x = 0; x < width; x++) {
+            PeakEntry column = { 32767, -32768, 0 };
+            double from = startFrame + x * framesPerPixel;
+            if (entries && from >= 0 && from < frames) {
+                size_t first = (size_t)(from / entryFrames);
+                // every entry the pixel touches, at most three; zoomed in past level 0 that is the one it lies in
+                size_t last = (size_t)ceil((from + framesPerPixel) / entryFrames);
+                last = SDL_min(SDL_max(last, first + 1), entries->size());
+                if (first < last) {
+                    column = (*entries)[first];
+                    for (size_t i = first + 1; i < last; i++)
+                        column = combine(column, (*entries)[i]);
+                }
+            }
+            columns[x] = column;
+        }
+    }
+
+    Uint64 getFrames() const
+    {
+        return frames;
+    }
+
+    int getLevelCount() const
+    {
+        return (int)levels.size();
+    }
+
+    // entries across all levels, what a sidecar holds
+    Uint64 getEntryCount() const
+    {
+        Uint64 count = 0;
+        for (size_t level = 0; level < levels.size(); level++)
+            count += levels[level].size();
+        return count;
+    }
+};
+
+#endif
@@ -0,0 +1,259 @@
+#ifndef RTCHECK_H
+#define RTCHECK_H
+
+/*
+ * Real-time safety checker for the audio callbacks.
+ *
+ * Built with -DRTCHECK (make RTCHECK=1), the program's own definitions of
+ * malloc/free, the pthread mutex, condition and semaphore waits, sleeps and
+ * read/write/open take the place of libc's. While a thread is inside
+ * rtcheckEnter/rtcheckLeave, which callbackprofiler.h puts around every
+ * callback, each of those calls is counted and the first RTCHECK_MAX_REPORTS
+ * are logged to stderr with a backtrace. Without RTCHECK everything here is
+ * an empty inline.
+ *
+ * Include it from one translation unit only, the interposed functions are
+ * plain definitions. At exit the totals are printed and a run with any
+ * violation exits with RTCHECK_EXIT_STATUS. RTCHECK_SECONDS=n posts SDL_QUIT
+ * after n seconds so players can run unattended, e.g. under
+ * SDL_VIDEODRIVER=dummy SDL_AUDIODRIVER=dummy.
+ */
+
+#include <SDL.h>
+
+#if defined(RTCHECK)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RTCHECK_MAX_REPORTS 20
+#define RTCHECK_BACKTRACE_FRAMES 32
+#define RTCHECK_EXIT_STATUS 3
+
+enum RtcheckKind
+{
+    RTCHECK_ALLOC,
+    RTCHECK_FREE,
+    RTCHECK_LOCK,
+    RTCHECK_WAIT,
+    RTCHECK_SLEEP,
+    RTCHECK_IO,
+    RTCHECK_KINDS
+};
+
+static const char* rtcheckKindNames[RTCHECK_KINDS] = { "allocation", "free", "lock", "wait", "sleep", "I/O" };
+
+// set while this thread runs an audio callback, and while it is reporting so the report itself is not flagged
+static thread_local int rtcheckDepth = 0;
+static thread_local bool rtcheckReporting = false;
+
+static SDL_atomic_t rtcheckCounts[RTCHECK_KINDS];
+static SDL_atomic_t rtcheckReports;
+static SDL_atomic_t rtcheckStarted;
+
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* pointer, size_t size);
+extern "C" void __libc_free(void* pointer);
+
+static void rtcheckViolation(RtcheckKind kind, const char* call)
+{
+    if (rtcheckDepth == 0 || rtcheckReporting)
+        return;
+    rtcheckReporting = true;
+    SDL_AtomicAdd(&rtcheckCounts[kind], 1);
+
+    // backtrace_symbols_fd writes straight to the fd, nothing here allocates once backtrace is warmed up
+    if (SDL_AtomicAdd(&rtcheckReports, 1) < RTCHECK_MAX_REPORTS) {
+        void* frames[RTCHECK_BACKTRACE_FRAMES];
+        int depth = backtrace(frames, RTCHECK_BACKTRACE_FRAMES);
+        char line[128];
+        int length = snprintf(line, sizeof(line), "rtcheck: %s on the audio thread (%s)\n", rtcheckKindNames[kind], call);
+        ::write(2, line, length);
+        backtrace_symbols_fd(frames + 1, depth - 1, 2);
+    }
+    rtcheckReporting = false;
+}
+
+// the libc versions of the interposed functions, looked up on first use
+typedef int (*RtcheckMutexLock)(pthread_mutex_t*);
+typedef int (*RtcheckCondWait)(pthread_cond_t*, pthread_mutex_t*);
+typedef int (*RtcheckCondTimedWait)(pthread_cond_t*, pthread_mutex_t*, const struct timespec*);
+typedef int (*RtcheckSemWait)(sem_t*);
+typedef int (*RtcheckNanosleep)(const struct timespec*, struct timespec*);
+typedef int (*RtcheckUsleep)(useconds_t);
+typedef ssize_t (*RtcheckRead)(int, void*, size_t);
+typedef ssize_t (*RtcheckWrite)(int, const void*, size_t);
+typedef int (*RtcheckOpen)(const char*, int, ...);
+
+#define RTCHECK_NEXT(type, name) \
+    static type next = NULL; \
+    if (!next) \
+        next = (type)dlsym(RTLD_NEXT, name)
+
+extern "C"
+{
+void* malloc(size_t size) noexcept
+{
+    rtcheckViolation(RTCHECK_ALLOC, "malloc");
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) noexcept
+{
+    rtcheckViolation(RTCHECK_ALLOC, "calloc");
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* pointer, size_t size) noexcept
+{
+    rtcheckViolation(RTCHECK_ALLOC, "realloc");
+    return __libc_realloc(pointer, size);
+}
+
+void free(void* pointer) noexcept
+{
+    if (pointer)
+        rtcheckViolation(RTCHECK_FREE, "free");
+    __libc_free(pointer);
+}
+
+int pthread_mutex_lock(pthread_mutex_t* mutex) noexcept
+{
+    RTCHECK_NEXT(RtcheckMutexLock, "pthread_mutex_lock");
+    rtcheckViolation(RTCHECK_LOCK, "pthread_mutex_lock");
+    return next(mutex);
+}
+
+int pthread_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex)
+{
+    RTCHECK_NEXT(RtcheckCondWait, "pthread_cond_wait");
+    rtcheckViolation(RTCHECK_WAIT, "pthread_cond_wait");
+    return next(cond, mutex);
+}
+
+int pthread_cond_timedwait(pthread_cond_t* cond, pthread_mutex_t* mutex, const struct timespec* until)
+{
+    RTCHECK_NEXT(RtcheckCondTimedWait, "pthread_cond_timedwait");
+    rtcheckViolation(RTCHECK_WAIT, "pthread_cond_timedwait");
+    return next(cond, mutex, until);
+}
+
+int sem_wait(sem_t* sem)
+{
+    RTCHECK_NEXT(RtcheckSemWait, "sem_wait");
+    rtcheckViolation(RTCHECK_WAIT, "sem_wait");
+    return next(sem);
+}
+
+int nanosleep(const struct timespec* duration, struct timespec* remaining)
+{
+    RTCHECK_NEXT(RtcheckNanosleep, "nanosleep");
+    rtcheckViolation(RTCHECK_SLEEP, "nanosleep");
+    return next(duration, remaining);
+}
+
+int usleep(useconds_t us)
+{
+    RTCHECK_NEXT(RtcheckUsleep, "usleep");
+    rtcheckViolation(RTCHECK_SLEEP, "usleep");
+    return next(us);
+}
+
+ssize_t read(int fd, void* data, size_t length)
+{
+    RTCHECK_NEXT(RtcheckRead, "read");
+    rtcheckViolation(RTCHECK_IO, "read");
+    return next(fd, data, length);
+}
+
+ssize_t write(int fd, const void* data, size_t length)
+{
+    RTCHECK_NEXT(RtcheckWrite, "write");
+    rtcheckViolation(RTCHECK_IO, "write");
+    return next(fd, data, length);
+}
+
+int open(const char* path, int flags, ...)
+{
+    RTCHECK_NEXT(RtcheckOpen, "open");
+    mode_t mode = 0;
+    if (flags & O_CREAT) {
+        va_list args;
+        va_start(args, flags);
+        mode = va_arg(args, int);
+        va_end(args);
+    }
+    rtcheckViolation(RTCHECK_IO, "open");
+    return next(path, flags, mode);
+}
+}
+
+// prints the totals, any violation turns into a failing exit status
+static void rtcheckExit(void)
+{
+    int total = 0;
+    printf("rtcheck:");
+    for (int i = 0; i < RTCHECK_KINDS; i++) {
+        printf(" %s %d", rtcheckKindNames[i], SDL_AtomicGet(&rtcheckCounts[i]));
+        total += SDL_AtomicGet(&rtcheckCounts[i]);
+    }
+    printf("\n");
+    if (total > 0) {
+        fflush(NULL);
+        _exit(RTCHECK_EXIT_STATUS);
+    }
+}
+
+static Uint32 rtcheckQuit(Uint32 interval, void* unused)
+{
+    SDL_Event quit;
+    SDL_zero(quit);
+    quit.type = SDL_QUIT;
+    SDL_PushEvent(&quit);
+    return 0;
+}
+
+// sets up the exit report and the optional time limit, once per program
+static inline void rtcheckInit(void)
+{
+    const char* seconds = getenv("RTCHECK_SECONDS");
+    if (SDL_AtomicSet(&rtcheckStarted, 1))
+        return;
+
+    // warm up backtrace, its first call loads libgcc and allocates
+    void* frame;
+    backtrace(&frame, 1);
+
+    atexit(rtcheckExit);
+    if (seconds)
+        SDL_AddTimer(atoi(seconds) * 1000, rtcheckQuit, NULL);
+}
+
+static inline void rtcheckEnter(void)
+{
+    rtcheckDepth++;
+}
+
+static inline void rtcheckLeave(void)
+{
+    rtcheckDepth--;
+}
+
+#else
+
+static inline void rtcheckInit(void) {}
+static inline void rtcheckEnter(void) {}
+static inline void rtcheckLeave(void) {}
+
+#endif
+
+#endif
@@ -9,6 +9,9 @@
 #include <SDL.h>
 #include <stdio.h>
 
+#include "../callbackprofiler.h"
+#include "../statsregistry.h"
+
 #define	SM_SOUNDS	4
 #define	SM_VOICES	4
 
@@ -20,6 +23,12 @@ SDL_Renderer* gRenderer = NULL;
 
 SDL_AudioDeviceID dev;
 
+callbackProfiler profiler;
+
+StatsRegistry stats("simplemixer");
+StatsCounter *voices_started = NULL;
+StatsCounter *frames_mixed = NULL;
+
 struct SM_sound
 {
 	Uint8	*data;
@@ -59,6 +68,7 @@ void sm_play(unsigned voice, unsigned sound, float lvol, float rvol)
 
 	/* Start! */
 	voices[voice].data = (Sint16*)(sounds[sound].data);
+	statsAdd(voices_started, 1);
 }
 
 
@@ -72,6 +82,7 @@ static void sm_mixer(void *ud, Uint8 *stream, int len)
 
 	/* 2 channels, 2 bytes/sample = 4 bytes/frame */
         len /= 4;
+	statsAdd(frames_mixed, len);
 
 	/* For each voice... */
 	for(vi = 0; vi < SM_VOICES; ++vi)
@@ -96,6 +107,18 @@ static void sm_mixer(void *ud, Uint8 *stream, int len)
 }
 
 
+/* read by the stats export thread, a voice is playing while it has data */
+static Sint64 sm_active_voices(void *ud)
+{
+	int vi;
+	Sint64 active = 0;
+	for(vi = 0; vi < SM_VOICES; ++vi)
+		if(voices[vi].data)
+			++active;
+	return active;
+}
+
+
 int sm_open(void)
 {
 	SDL_AudioSpec as;
@@ -109,12 +132,22 @@ int sm_open(void)
 	as.channels = 2;
 	as.samples = 1024;
 	as.callback = sm_mixer;
+	callbackProfilerWrap(&profiler, "simplemixer", &as);
 	if((dev=SDL_OpenAudioDevice(NULL, 0, &as, &audiospec, SDL_AUDIO_ALLOW_ANY_CHANGE)) < 0)
 		return -3;
 
 	if(audiospec.format != AUDIO_S16SYS)
 		return -4;
 
+	callbackProfilerStart(&profiler, &audiospec);
+
+	/* STATS_EXPORT=unix:<path> or file:<path> publishes these as JSON */
+	voices_started = stats.addCounter("voices.started");
+	frames_mixed = stats.addCounter("mixer.frames");
+	stats.addSampled("voices.active", sm_active_voices, NULL);
+	stats.addCallbackProfiler("callback", &profiler);
+	stats.start(getenv("STATS_EXPORT"));
+
 	SDL_PauseAudioDevice(dev, 0);; // start playing sound
 	return 0;
 }
@@ -124,6 +157,8 @@ void sm_close(void)
 {
 	int i;
 	SDL_PauseAudioDevice(dev, 1);
+	stats.stop();
+	callbackProfilerDump(&profiler);
 	for(i = 0; i < SM_VOICES; ++i)
 		voices[i].data = NULL;
 	SDL_CloseAudioDevice(dev);
@@ -244,6 +279,8 @@ int main(int argc, char *argv[])
 
 		step = (step + 1) % 32;
 
+		callbackProfilerPoll(&profiler);
+
 		timer += 120;
 		while(((Sint32)SDL_GetTicks() - timer) < 0)
 			SDL_Delay(10);
@@ -0,0 +1,431 @@
+#ifndef STATSREGISTRY_H
+#define STATSREGISTRY_H
+
+/*
+ * Process stats for scraping, served as one JSON object per snapshot.
+ *
+ *     StatsRegistry stats("testaudio");
+ *     StatsCounter* frames = stats.addCounter("mixer.frames");
+ *     stats.addAtomic("dropped_blocks", &gDroppedBlocks);
+ *     stats.addCallbackProfiler("callback", &profiler);
+ *     stats.start(getenv("STATS_EXPORT"));   // NULL leaves the export off
+ *     ...
+ *     statsAdd(frames, n);                   // on any thread, the audio thread included
+ *     ...
+ *     stats.stop();
+ *
+ * STATS_EXPORT=unix:/tmp/testaudio.sock answers every connection to the
+ * socket with a snapshot and closes it, e.g. socat - UNIX-CONNECT:/tmp/testaudio.sock.
+ * STATS_EXPORT=file:/tmp/testaudio.json rewrites the file every
+ * STATS_EXPORT_MS, 1000 by default, through a rename so readers never see
+ * half a snapshot.
+ *
+ * Counters are the only thing the program itself writes: a relaxed atomic
+ * add or store, nothing else, so they are safe in the callback. Everything
+ * else (SDL atomics the program already keeps, sampled values, the
+ * profilers, memory use) is read by the export thread when it takes a
+ * snapshot. Register everything before start.
+ */
+
+#include <SDL.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <string>
+
+#include "callbackprofiler.h"
+#include "latencyprofiler.h"
+
+#if defined(__linux__)
+#include <errno.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#define STATS_MAX_ENTRIES 64
+#define STATS_MAX_PROFILERS 4
+#define STATS_EXPORT_DEFAULT_MS 1000
+
+// how often the export thread checks whether it should stop
+#define STATS_EXPORT_POLL_MS 100
+
+class StatsCounter
+{
+private:
+    std::atomic<Sint64> value;
+public:
+    StatsCounter()
+    {
+        value.store(0, std::memory_order_relaxed);
+    }
+    void add(Sint64 n)
+    {
+        value.fetch_add(n, std::memory_order_relaxed);
+    }
+    // for levels like a queue depth rather than running totals
+    void set(Sint64 n)
+    {
+        value.store(n, std::memory_order_relaxed);
+    }
+    Sint64 get() const
+    {
+        return value.load(std::memory_order_relaxed);
+    }
+};
+
+// components take an optional registry, these let them skip the check
+static inline void statsAdd(StatsCounter* counter, Sint64 n)
+{
+    if (counter)
+        counter->add(n);
+}
+
+static inline void statsSet(StatsCounter* counter, Sint64 n)
+{
+    if (counter)
+        counter->set(n);
+}
+
+class StatsRegistry
+{
+private:
+    enum Kind { COUNTER, ATOMIC, SAMPLED };
+
+    struct Entry
+    {
+        const char* name;
+        Kind kind;
+        StatsCounter counter;
+        SDL_atomic_t* atomic;
+        Sint64 (*sample)(void* userdata);
+        void* userdata;
+    };
+
+    const char* program;
+    Uint64 startTicks;
+    Entry entries[STATS_MAX_ENTRIES];
+    int entryCount;
+    const char* callbackNames[STATS_MAX_PROFILERS];
+    callbackProfiler* callbackProfilers[STATS_MAX_PROFILERS];
+    int callbackCount;
+    const char* latencyNames[STATS_MAX_PROFILERS];
+    latencyProfiler* latencyProfilers[STATS_MAX_PROFILERS];
+    int latencyCount;
+
+    // the export
+    std::string path;
+    bool toSocket;
+    Uint32 intervalMs;
+    int listenFd;
+    SDL_Thread* thread;
+    SDL_atomic_t stopping;
+
+    Entry* addEntry(const char* name, Kind kind)
+    {
+        if (entryCount == STATS_MAX_ENTRIES) {
+            fprintf(stderr, "stats: no room for %s, raise STATS_MAX_ENTRIES\n", name);
+            return NULL;
+        }
+        Entry* entry = &entries[entryCount++];
+        entry->name = name;
+        entry->kind = kind;
+        return entry;
+    }
+
+    static int getProcessId()
+    {
+#if defined(__linux__)
+        return (int)getpid();
+#else
+        return 0;
+#endif
+    }
+
+    static void append(std::string& out, const char* format, ...)
+    {
+        char text[256];
+        va_list args;
+        va_start(args, format);
+        vsnprintf(text, sizeof(text), format, args);
+        va_end(args);
+        out += text;
+    }
+
+    static void appendCallbackProfiler(std::string& out, callbackProfiler* p)
+    {
+        double periodUs = p->periodTicks ? p->periodTicks * 1000000.0 / p->frequency : 0;
+        append(out, "{\"callbacks\":%d,\"frames\":%u,\"period_us\":%.1f,\"run_p50_us\":%.1f,\"run_p99_us\":%.1f,"
+            "\"run_max_us\":%d,\"overruns\":%d,\"near_misses\":%d,\"late\":%d,\"underruns\":%d}",
+            SDL_AtomicGet(&p->callbacks), p->frames, periodUs,
+            callbackProfilerPercentile(p->runBins, 50) * periodUs / 100,
+            callbackProfilerPercentile(p->runBins, 99) * periodUs / 100,
+            SDL_AtomicGet(&p->maxRunUs), SDL_AtomicGet(&p->overruns), SDL_AtomicGet(&p->nearMisses),
+            SDL_AtomicGet(&p->lateCallbacks), SDL_AtomicGet(&p->underruns));
+    }
+
+    static void appendLatencyProfiler(std::string& out, latencyProfiler* p)
+    {
+        latencySnapshot snapshot;
+        latencyProfilerSnapshot(p, &snapshot);
+        append(out, "{\"device_ms\":%.3f", snapshot.deviceMs);
+        for (int stage = 0; stage < LATENCY_STAGES; stage++) {
+            latencyStageSnapshot* s = &snapshot.stages[stage];
+            append(out, ",\"%s\":{\"count\":%d,\"p50_ms\":%.3f,\"p90_ms\":%.3f,\"p99_ms\":%.3f,\"p999_ms\":%.3f,\"max_ms\":%.3f}",
+                latencyStageNames[stage], s->count, s->p50Ms, s->p90Ms, s->p99Ms, s->p999Ms, s->maxMs);
+        }
+        out += "}";
+    }
+
+    static void appendMemory(std::string& out)
+    {
+#if defined(__linux__)
+        long pages = 0;
+        long resident = 0;
+        struct rusage usage;
+        FILE* statm = fopen("/proc/self/statm", "r");
+        if (statm) {
+            if (fscanf(statm, "%ld %ld", &pages, &resident) != 2)
+                resident = 0;
+            fclose(statm);
+        }
+        getrusage(RUSAGE_SELF, &usage);
+        append(out, "{\"rss_bytes\":%lld,\"peak_rss_bytes\":%lld}",
+            (long long)resident * sysconf(_SC_PAGESIZE), (long long)usage.ru_maxrss * 1024);
+#else
+        out += "{}";
+#endif
+    }
+
+#if defined(__linux__)
+    // clears path for a socket; anything there but a socket is left alone and fails
+    static bool removeSocket(const std::string& socketPath)
+    {
+        struct stat info;
+        if (lstat(socketPath.c_str(), &info) < 0)
+            return errno == ENOENT;
+        if (!S_ISSOCK(info.st_mode)) {
+            fprintf(stderr, "stats: %s is not a socket, leaving it\n", socketPath.c_str());
+            return false;
+        }
+        return unlink(socketPath.c_str()) == 0;
+    }
+
+    bool writeFile(const std::string& text)
+    {
+        std::string temporary = path + ".tmp";
+        FILE* file = fopen(temporary.c_str(), "w");
+        if (!file)
+            return false;
+        bool written = fwrite(text.data(), 1, text.size(), file) == text.size();
+        written = fclose(file) == 0 && written;
+        return written && rename(temporary.c_str(), path.c_str()) == 0;
+    }
+
+    void serve()
+    {
+        Uint32 lastWriteTicks = 0;
+        while (!SDL_AtomicGet(&stopping)) {
+            if (!toSocket) {
+                if (lastWriteTicks == 0 || SDL_GetTicks() - lastWriteTicks >= intervalMs) {
+                    lastWriteTicks = SDL_GetTicks();
+                    if (!writeFile(snapshot() + "\n"))
+                        fprintf(stderr, "stats: couldn't write %s\n", path.c_str());
+                }
+                SDL_Delay(SDL_min(intervalMs, STATS_EXPORT_POLL_MS));
+                continue;
+            }
+
+            struct pollfd listening = { listenFd, POLLIN, 0 };
+            if (poll(&listening, 1, STATS_EXPORT_POLL_MS) <= 0)
+                continue;
+            int client = accept(listenFd, NULL, NULL);
+            if (client < 0)
+                continue;
+            std::string text = snapshot() + "\n";
+            size_t sent = 0;
+            while (sent < text.size()) {
+                ssize_t n = send(client, text.data() + sent, text.size() - sent, MSG_NOSIGNAL);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0)
+                    break;
+                sent += n;
+            }
+            ::close(client);
+        }
+    }
+
+    static int serveThread(void* data)
+    {
+        ((StatsRegistry*)data)->serve();
+        return 0;
+    }
+#endif
+public:
+    StatsRegistry(const char* programName)
+    {
+        program = programName;
+        startTicks = SDL_GetPerformanceCounter();
+        entryCount = 0;
+        callbackCount = 0;
+        latencyCount = 0;
+        toSocket = false;
+        intervalMs = STATS_EXPORT_DEFAULT_MS;
+        listenFd = -1;
+        thread = NULL;
+        SDL_AtomicSet(&stopping, 0);
+    }
+    ~StatsRegistry()
+    {
+        stop();
+    }
+
+    // a value the program updates through statsAdd and statsSet, NULL once the registry is full
+    StatsCounter* addCounter(const char* name)
+    {
+        Entry* entry = addEntry(name, COUNTER);
+        return entry ? &entry->counter : NULL;
+    }
+
+    // an SDL atomic the program already keeps, read at snapshot time
+    void addAtomic(const char* name, SDL_atomic_t* value)
+    {
+        Entry* entry = addEntry(name, ATOMIC);
+        if (entry)
+            entry->atomic = value;
+    }
+
+    // called on the export thread at snapshot time, so sample must be safe to call from there
+    void addSampled(const char* name, Sint64 (*sample)(void* userdata), void* userdata)
+    {
+        Entry* entry = addEntry(name, SAMPLED);
+        if (entry) {
+            entry->sample = sample;
+            entry->userdata = userdata;
+        }
+    }
+
+    void addCallbackProfiler(const char* name, callbackProfiler* profiler)
+    {
+        if (callbackCount < STATS_MAX_PROFILERS) {
+            callbackNames[callbackCount] = name;
+            callbackProfilers[callbackCount++] = profiler;
+        }
+    }
+
+    void addLatencyProfiler(const char* name, latencyProfiler* profiler)
+    {
+        if (latencyCount < STATS_MAX_PROFILERS) {
+            latencyNames[latencyCount] = name;
+            latencyProfilers[latencyCount++] = profiler;
+        }
+    }
+
+    // everything registered, as one line of JSON
+    std::string snapshot()
+    {
+        std::string out;
+        append(out, "{\"program\":\"%s\",\"pid\":%d,\"uptime_ms\":%.0f,\"stats\":{", program, getProcessId(),
+            (SDL_GetPerformanceCounter() - startTicks) * 1000.0 / SDL_GetPerformanceFrequency());
+        for (int i = 0; i < entryCount; i++) {
+            Entry* entry = &entries[i];
+            Sint64 value = 0;
+            if (entry->kind == COUNTER)
+                value = entry->counter.get();
+            else if (entry->kind == ATOMIC)
+                value = SDL_AtomicGet(entry->atomic);
+            else
+                value = entry->sample(entry->userdata);
+            append(out, "%s\"%s\":%lld", i ? "," : "", entry->name, (long long)value);
+        }
+        out += "}";
+        for (int i = 0; i < callbackCount; i++) {
+            append(out, ",\"%s\":", callbackNames[i]);
+            appendCallbackProfiler(out, callbackProfilers[i]);
+        }
+        for (int i = 0; i < latencyCount; i++) {
+            append(out, ",\"%s\":", latencyNames[i]);
+            appendLatencyProfiler(out, latencyProfilers[i]);
+        }
+        out += ",\"memory\":";
+        appendMemory(out);
+        out += "}";
+        return out;
+    }
+
+    // "unix:<socket path>" or "file:<json path>", NULL or "" leaves the export off
+    bool start(const char* target)
+    {
+        if (!target || !*target)
+            return true;
+#if defined(__linux__)
+        const char* interval = getenv("STATS_EXPORT_MS");
+        if (interval && atoi(interval) > 0)
+            intervalMs = (Uint32)atoi(interval);
+
+        if (!strncmp(target, "unix:", 5)) {
+            struct sockaddr_un address;
+            toSocket = true;
+            path = target + 5;
+            SDL_zero(address);
+            address.sun_family = AF_UNIX;
+            if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+                fprintf(stderr, "stats: bad socket path %s\n", target);
+                return false;
+            }
+            strcpy(address.sun_path, path.c_str());
+            // a socket left by an earlier run would make bind fail
+            if (!removeSocket(path))
+                return false;
+            listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (listenFd < 0 || bind(listenFd, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(listenFd, 4) < 0) {
+                fprintf(stderr, "stats: couldn't listen on %s: %s\n", path.c_str(), strerror(errno));
+                if (listenFd >= 0)
+                    ::close(listenFd);
+                listenFd = -1;
+                return false;
+            }
+        } else if (!strncmp(target, "file:", 5)) {
+            toSocket = false;
+            path = target + 5;
+        } else {
+            fprintf(stderr, "stats: STATS_EXPORT is unix:<path> or file:<path>, not %s\n", target);
+            return false;
+        }
+
+        SDL_AtomicSet(&stopping, 0);
+        thread = SDL_CreateThread(serveThread, "stats export", this);
+        return thread != NULL;
+#else
+        fprintf(stderr, "stats: no export on this platform\n");
+        return false;
+#endif
+    }
+
+    void stop()
+    {
+        if (!thread)
+            return;
+        SDL_AtomicSet(&stopping, 1);
+        SDL_WaitThread(thread, NULL);
+        thread = NULL;
+#if defined(__linux__)
+        // the file is left with the final numbers
+        if (!toSocket)
+            writeFile(snapshot() + "\n");
+        if (listenFd >= 0) {
+            ::close(listenFd);
+            removeSocket(path);
+        }
+        listenFd = -1;
+#endif
+    }
+};
+
+#endif
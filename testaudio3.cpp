@@ -1,9 +1,17 @@
 #include <SDL.h>
 
 #include <queue>
+#include <vector>
+#include <algorithm>
 #include <cmath>
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+#include "callbackprofiler.h"
 
 const double ChromaticRatio = 1.059463094359295264562;
 const double Tao = 6.283185307179586476925;
@@ -19,11 +27,59 @@ Uint32 audioBufferLength = 48000;
 float *audioBuffer;
 
 SDL_atomic_t audioCallbackLeftOff;
+SDL_atomic_t audioMainWritten;
 Sint32 audioMainLeftOff;
 Uint8 audioMainAccumulator;
 
+/* lead controller: all leads are in floats of audioBuffer */
+#define LEAD_HISTOGRAM_BINS 400
+#define LEAD_HISTOGRAM_BIN_MS 0.25
+#define LEAD_CLEAN_FRAMES_TO_SHRINK 120
+
+typedef struct {
+    double floatsPerMs;
+    double targetLead;
+    double safetyMargin;
+    double wakeJitterMs;
+    Uint32 cleanFrames;
+    Uint32 frames;
+    Uint32 collisions;
+    Sint32 minLead;
+    Sint32 maxLead;
+    Sint32 lastLead;
+    Uint32 leadHistogram[LEAD_HISTOGRAM_BINS];
+} leadController;
+
+typedef struct {
+    Uint32 frames;
+    Uint32 callbacks;
+    Uint32 collisions;
+    Uint32 underruns;
+    double leadMs;
+    double targetLeadMs;
+    double minLeadMs;
+    double maxLeadMs;
+    double leadP50Ms;
+    double leadP95Ms;
+    double leadP99Ms;
+    double callbackJitterMs;
+    double callbackJitterP99Ms;
+    double wakeJitterMs;
+} leadStats;
+
+leadController leadControl;
+
+/* written by the audio callback only */
+Uint64 callbackPeriodTicks;
+Uint64 callbackLastTicks;
+SDL_atomic_t callbackCount;
+SDL_atomic_t callbackUnderruns;
+SDL_atomic_t callbackJitterUs;
+SDL_atomic_t callbackJitterHistogram[LEAD_HISTOGRAM_BINS];
+
 SDL_AudioDeviceID AudioDevice;
 SDL_AudioSpec audioSpec;
+callbackProfiler profiler;
 
 SDL_Event event;
 SDL_bool running = SDL_TRUE;
@@ -37,23 +93,29 @@ typedef struct {
     double phase;
 } voice;
 
-void speak(voice *v) {
+/* adds floatCount interleaved stereo floats of v into out */
+void speakRange(voice *v, float *out, Uint32 floatCount) {
     float sample;
     Uint32 sourceIndex;
     double phaseIncrement = v->frequency/sampleRate;
     Uint32 i;
-    if (v->volume > practicallySilent) {
-        for (i = 0; (i + 1) < samplesPerFrame; i += 2) {
-            v->phase += phaseIncrement;
-            if (v->phase > 1)
-                v->phase -= 1;
+    for (i = 0; (i + 1) < floatCount; i += 2) {
+        v->phase += phaseIncrement;
+        if (v->phase >= 1)
+            v->phase -= 1;
 
-            sourceIndex = v->phase*v->waveformLength;
-            sample = v->waveform[sourceIndex]*v->volume;
+        sourceIndex = v->phase*v->waveformLength;
+        sample = v->waveform[sourceIndex]*v->volume;
 
-            audioBuffer[audioMainLeftOff+i] += sample*(1-v->pan);
-            audioBuffer[audioMainLeftOff+i+1] += sample*v->pan;
-        }
+        out[i] += sample*(1-v->pan);
+        out[i+1] += sample*v->pan;
+    }
+}
+
+void speak(voice *v) {
+    Uint32 i;
+    if (v->volume > practicallySilent) {
+        speakRange(v, &audioBuffer[audioMainLeftOff], samplesPerFrame);
     }
     else {
         for (i=0; i<samplesPerFrame; i+=1)
@@ -116,10 +178,171 @@ void logWavedata(float *floatStream, Uint32 floatStreamLength, Uint32 increment)
     printf("\n\n");
 }
 
+int histogramBin(double ms) {
+    int bin = ms / LEAD_HISTOGRAM_BIN_MS;
+    if (bin < 0)
+        bin = 0;
+    if (bin >= LEAD_HISTOGRAM_BINS)
+        bin = LEAD_HISTOGRAM_BINS - 1;
+    return bin;
+}
+
+double histogramPercentile(Uint32 *bins, double percentile) {
+    Uint64 total = 0;
+    Uint64 rank;
+    Uint64 seen = 0;
+    int i;
+    for (i = 0; i < LEAD_HISTOGRAM_BINS; i++)
+        total += bins[i];
+    if (total == 0)
+        return 0;
+    rank = total * percentile / 100;
+    for (i = 0; i < LEAD_HISTOGRAM_BINS; i++) {
+        seen += bins[i];
+        if (seen > rank)
+            break;
+    }
+    if (i == LEAD_HISTOGRAM_BINS)
+        i--;
+    return (i + 0.5) * LEAD_HISTOGRAM_BIN_MS;
+}
+
+void initLeadController(leadController *lc) {
+    SDL_memset(lc, 0, sizeof(*lc));
+    lc->floatsPerMs = sampleRate * audioSpec.channels / 1000.0;
+    lc->safetyMargin = samplesPerFrame;
+    lc->targetLead = floatStreamLength + samplesPerFrame + lc->safetyMargin;
+    lc->minLead = audioBufferLength;
+}
+
+/*
+ * Called once per rendered frame with the lead measured right after the
+ * write. Keeps the lead just above one callback buffer plus the jitter seen
+ * on both sides; the safety margin grows on every collision or underrun and
+ * decays again while frames stay clean. Returns how long to sleep in ms.
+ */
+double updateLeadController(leadController *lc, Sint32 lead) {
+    static Uint32 lastUnderruns = 0;
+    Uint32 underruns = SDL_AtomicGet(&callbackUnderruns);
+    double callbackJitterMs = SDL_AtomicGet(&callbackJitterUs) / 1000.0;
+    double maxTarget = audioBufferLength - 2 * samplesPerFrame;
+
+    lc->frames++;
+    lc->lastLead = lead;
+    if (lead < lc->minLead)
+        lc->minLead = lead;
+    if (lead > lc->maxLead)
+        lc->maxLead = lead;
+    lc->leadHistogram[histogramBin(lead / lc->floatsPerMs)]++;
+
+    if ((Uint32)lead < floatStreamLength || underruns != lastUnderruns) {
+        if ((Uint32)lead < floatStreamLength)
+            lc->collisions++;
+        lc->safetyMargin = lc->safetyMargin * 1.5 + samplesPerFrame / 2;
+        lc->cleanFrames = 0;
+    }
+    else if (++lc->cleanFrames >= LEAD_CLEAN_FRAMES_TO_SHRINK) {
+        lc->safetyMargin *= 0.9;
+        lc->cleanFrames = 0;
+    }
+    lastUnderruns = underruns;
+
+    lc->targetLead = floatStreamLength
+        + (callbackJitterMs + lc->wakeJitterMs) * lc->floatsPerMs
+        + lc->safetyMargin;
+    if (lc->targetLead > maxTarget) {
+        lc->targetLead = maxTarget;
+        lc->safetyMargin = maxTarget - floatStreamLength;
+    }
+
+    if (lead <= lc->targetLead)
+        return 0;
+    return (lead - lc->targetLead) / lc->floatsPerMs;
+}
+
+/* feeds back how late SDL_Delay woke us up, decaying peak */
+void updateWakeJitter(leadController *lc, double requestedMs, double sleptMs) {
+    double late = sleptMs - requestedMs;
+    if (late < 0)
+        late = 0;
+    lc->wakeJitterMs *= 0.99;
+    if (late > lc->wakeJitterMs)
+        lc->wakeJitterMs = late;
+}
+
+void getLeadStats(leadStats *stats) {
+    leadController *lc = &leadControl;
+    Uint32 jitterBins[LEAD_HISTOGRAM_BINS];
+    int i;
+    for (i = 0; i < LEAD_HISTOGRAM_BINS; i++)
+        jitterBins[i] = SDL_AtomicGet(&callbackJitterHistogram[i]);
+
+    stats->frames = lc->frames;
+    stats->callbacks = SDL_AtomicGet(&callbackCount);
+    stats->collisions = lc->collisions;
+    stats->underruns = SDL_AtomicGet(&callbackUnderruns);
+    stats->leadMs = lc->lastLead / lc->floatsPerMs;
+    stats->targetLeadMs = lc->targetLead / lc->floatsPerMs;
+    stats->minLeadMs = lc->frames ? lc->minLead / lc->floatsPerMs : 0;
+    stats->maxLeadMs = lc->maxLead / lc->floatsPerMs;
+    stats->leadP50Ms = histogramPercentile(lc->leadHistogram, 50);
+    stats->leadP95Ms = histogramPercentile(lc->leadHistogram, 95);
+    stats->leadP99Ms = histogramPercentile(lc->leadHistogram, 99);
+    stats->callbackJitterMs = SDL_AtomicGet(&callbackJitterUs) / 1000.0;
+    stats->callbackJitterP99Ms = histogramPercentile(jitterBins, 99);
+    stats->wakeJitterMs = lc->wakeJitterMs;
+}
+
+void logLeadStats(leadStats *stats) {
+    printf(
+        " frames__________%u\n"
+        " callbacks_______%u\n"
+        " collisions______%u\n"
+        " underruns_______%u\n"
+        " lead____________%.2f ms (target %.2f)\n"
+        " lead min/max____%.2f / %.2f ms\n"
+        " lead p50/95/99__%.2f / %.2f / %.2f ms\n"
+        " cb jitter_______%.3f ms (p99 %.2f)\n"
+        " wake jitter_____%.3f ms\n\n",
+        stats->frames,
+        stats->callbacks,
+        stats->collisions,
+        stats->underruns,
+        stats->leadMs, stats->targetLeadMs,
+        stats->minLeadMs, stats->maxLeadMs,
+        stats->leadP50Ms, stats->leadP95Ms, stats->leadP99Ms,
+        stats->callbackJitterMs, stats->callbackJitterP99Ms,
+        stats->wakeJitterMs
+    );
+}
+
 void audioCallback(void *unused, Uint8 *byteStream, int byteStreamLength) {
     float* floatStream = (float*) byteStream;
     Sint32 localAudioCallbackLeftOff = SDL_AtomicGet(&audioCallbackLeftOff);
+    Sint32 available = SDL_AtomicGet(&audioMainWritten) - localAudioCallbackLeftOff;
+    Uint64 now = SDL_GetPerformanceCounter();
     Uint32 i;
+
+    if (callbackLastTicks) {
+        Sint64 deviation = (Sint64)(now - callbackLastTicks) - (Sint64)callbackPeriodTicks;
+        Uint64 deviationUs = (deviation < 0 ? -deviation : deviation) * 1000000 / SDL_GetPerformanceFrequency();
+        Uint32 jitterUs = SDL_AtomicGet(&callbackJitterUs);
+        jitterUs -= jitterUs / 64;
+        if (deviationUs > jitterUs)
+            jitterUs = deviationUs;
+        SDL_AtomicSet(&callbackJitterUs, jitterUs);
+        SDL_AtomicAdd(&callbackJitterHistogram[histogramBin(deviationUs / 1000.0)], 1);
+    }
+    callbackLastTicks = now;
+    SDL_AtomicAdd(&callbackCount, 1);
+
+    if (available < 0)
+        available += audioBufferLength;
+    if ((Uint32)available < floatStreamLength) {
+        SDL_AtomicAdd(&callbackUnderruns, 1);
+        callbackProfilerUnderrun(&profiler);
+    }
+
     for (i = 0; i < floatStreamLength; i++) {
         floatStream[i] = audioBuffer[localAudioCallbackLeftOff];
         localAudioCallbackLeftOff++;
@@ -129,6 +352,835 @@ void audioCallback(void *unused, Uint8 *byteStream, int byteStreamLength) {
     SDL_AtomicSet(&audioCallbackLeftOff, localAudioCallbackLeftOff);
 }
 
+/* Standard MIDI File playback on top of the voice synth */
+#define MIDI_VOICES 64
+#define MIDI_GAIN 0.05
+#define MIDI_DRUM_CHANNEL 9
+#define MIDI_RELEASE_SECONDS 2
+#define MIDI_TEMPO 0xFF
+
+typedef struct {
+    Uint64 tick;
+    Uint8 status;
+    Uint8 data1;
+    Uint8 data2;
+    Uint32 tempo;
+} midiRawEvent;
+
+typedef struct {
+    Uint64 frame;
+    Uint8 status;
+    Uint8 data1;
+    Uint8 data2;
+} midiEvent;
+
+/* per-voice multimode filter, run as a bank of biquads across voices */
+#define FILTER_LANES 4
+#define FILTER_GROUPS (MIDI_VOICES / FILTER_LANES)
+#define FILTER_MAX_BLOCK 512
+#define FILTER_DEFAULT_CUTOFF 2000
+#define FILTER_DEFAULT_RESONANCE 0.707
+
+enum {
+    FILTER_OFF,
+    FILTER_LOWPASS,
+    FILTER_HIGHPASS,
+    FILTER_BANDPASS
+};
+
+/*
+ * Structure of arrays, one slot per voice. Coefficients ramp linearly from
+ * their current value to target over each block. io holds each group of
+ * FILTER_LANES voices frame-interleaved so one vector covers one frame.
+ */
+typedef struct {
+    alignas(16) float b0[MIDI_VOICES];
+    alignas(16) float b1[MIDI_VOICES];
+    alignas(16) float b2[MIDI_VOICES];
+    alignas(16) float a1[MIDI_VOICES];
+    alignas(16) float a2[MIDI_VOICES];
+    alignas(16) float targetB0[MIDI_VOICES];
+    alignas(16) float targetB1[MIDI_VOICES];
+    alignas(16) float targetB2[MIDI_VOICES];
+    alignas(16) float targetA1[MIDI_VOICES];
+    alignas(16) float targetA2[MIDI_VOICES];
+    alignas(16) float z1[MIDI_VOICES];
+    alignas(16) float z2[MIDI_VOICES];
+    alignas(16) float io[FILTER_GROUPS][FILTER_MAX_BLOCK * FILTER_LANES];
+} biquadBank;
+
+typedef struct {
+    voice v;
+    Uint8 active;
+    Uint8 channel;
+    Uint8 note;
+    Uint8 filterDirty;
+    Uint8 filterSnap;
+    double cutoff;
+    double resonance;
+    Uint32 started;
+} midiVoice;
+
+typedef struct {
+    std::vector<midiEvent> events;
+    std::vector<float> waveform;
+    size_t nextEvent;
+    Uint64 frame;
+    Uint32 allocations;
+    Uint32 steals;
+    Uint32 peakVoices;
+    int filterMode;
+    double channelPan[16];
+    double channelCutoff[16];
+    double channelResonance[16];
+    midiVoice voices[MIDI_VOICES];
+    biquadBank bank;
+} midiPlayer;
+
+midiPlayer midi;
+
+Uint32 readBigEndian(const Uint8 *data, int bytes) {
+    Uint32 value = 0;
+    int i;
+    for (i = 0; i < bytes; i++)
+        value = (value << 8) | data[i];
+    return value;
+}
+
+int readVarLen(const Uint8 *data, size_t end, size_t *pos, Uint32 *value) {
+    int i;
+    *value = 0;
+    for (i = 0; i < 4 && *pos < end; i++) {
+        Uint8 byte = data[(*pos)++];
+        *value = (*value << 7) | (byte & 0x7F);
+        if (!(byte & 0x80))
+            return 1;
+    }
+    return 0;
+}
+
+bool compareRawEvents(const midiRawEvent &a, const midiRawEvent &b) {
+    return a.tick < b.tick;
+}
+
+/*
+ * Flattens all tracks into one list of note and pan events stamped with
+ * the absolute stereo frame they fall on at the current sampleRate.
+ */
+int parseMidi(const Uint8 *data, size_t size, std::vector<midiEvent> *events) {
+    std::vector<midiRawEvent> raw;
+    midiRawEvent re;
+    midiEvent e;
+    Uint32 headerLength, trackCount, division, t;
+    size_t pos;
+
+    if (size < 14 || memcmp(data, "MThd", 4) != 0) {
+        printf("\nNot a Standard MIDI File.\n");
+        return 1;
+    }
+    headerLength = readBigEndian(data + 4, 4);
+    trackCount = readBigEndian(data + 10, 2);
+    division = readBigEndian(data + 12, 2);
+    if (division & 0x8000 || division == 0) {
+        printf("\nSMPTE time division is not supported.\n");
+        return 2;
+    }
+
+    pos = 8 + headerLength;
+    for (t = 0; t < trackCount && pos + 8 <= size; ) {
+        Uint32 chunkLength = readBigEndian(data + pos + 4, 4);
+        bool isTrack = memcmp(data + pos, "MTrk", 4) == 0;
+        size_t end = pos + 8 + chunkLength;
+        Uint64 tick = 0;
+        Uint8 runningStatus = 0;
+        if (end > size)
+            end = size;
+        pos += 8;
+        if (!isTrack) {
+            pos = end;
+            continue;
+        }
+        t++;
+
+        while (pos < end) {
+            Uint32 delta, length;
+            Uint8 status;
+            if (!readVarLen(data, end, &pos, &delta) || pos >= end)
+                break;
+            tick += delta;
+            status = data[pos];
+            if (status & 0x80)
+                pos++;
+            else if (runningStatus)
+                status = runningStatus;
+            else
+                break;
+
+            if (status == 0xFF) {
+                Uint8 type;
+                if (pos >= end)
+                    break;
+                type = data[pos++];
+                if (!readVarLen(data, end, &pos, &length) || pos + length > end)
+                    break;
+                if (type == 0x51 && length == 3) {
+                    re.tick = tick;
+                    re.status = MIDI_TEMPO;
+                    re.tempo = readBigEndian(data + pos, 3);
+                    raw.push_back(re);
+                }
+                pos += length;
+                if (type == 0x2F)
+                    break;
+            }
+            else if (status == 0xF0 || status == 0xF7) {
+                if (!readVarLen(data, end, &pos, &length) || pos + length > end)
+                    break;
+                pos += length;
+            }
+            else {
+                int dataBytes = ((status & 0xE0) == 0xC0) ? 1 : 2;
+                Uint8 type = status & 0xF0;
+                runningStatus = status;
+                if (pos + dataBytes > end)
+                    break;
+                re.tick = tick;
+                re.status = status;
+                re.data1 = data[pos];
+                re.data2 = dataBytes == 2 ? data[pos + 1] : 0;
+                re.tempo = 0;
+                pos += dataBytes;
+                if (type == 0x90 && re.data2 == 0)
+                    re.status = 0x80 | (status & 0x0F);
+                if (type == 0x80 || type == 0x90
+                        || (type == 0xB0 && (re.data1 == 10 || re.data1 == 71 || re.data1 == 74)))
+                    raw.push_back(re);
+            }
+        }
+        pos = end;
+    }
+
+    std::stable_sort(raw.begin(), raw.end(), compareRawEvents);
+
+    /* walk the tempo map, 120 bpm until told otherwise */
+    double framesPerTick = 500000.0 * sampleRate / (1000000.0 * division);
+    double tempoFrame = 0;
+    Uint64 tempoTick = 0;
+    size_t i;
+    events->clear();
+    for (i = 0; i < raw.size(); i++) {
+        double frame = tempoFrame + (raw[i].tick - tempoTick) * framesPerTick;
+        if (raw[i].status == MIDI_TEMPO) {
+            tempoFrame = frame;
+            tempoTick = raw[i].tick;
+            framesPerTick = (double)raw[i].tempo * sampleRate / (1000000.0 * division);
+            continue;
+        }
+        e.frame = frame + 0.5;
+        e.status = raw[i].status;
+        e.data1 = raw[i].data1;
+        e.data2 = raw[i].data2;
+        events->push_back(e);
+    }
+    return 0;
+}
+
+void writeVarLen(std::vector<Uint8> *out, Uint32 value) {
+    Uint8 bytes[4];
+    int count = 0;
+    do {
+        bytes[count++] = value & 0x7F;
+        value >>= 7;
+    } while (value);
+    while (count--)
+        out->push_back(bytes[count] | (count ? 0x80 : 0));
+}
+
+void writeBigEndian(std::vector<Uint8> *out, Uint32 value, int bytes) {
+    while (bytes--)
+        out->push_back((value >> (bytes * 8)) & 0xFF);
+}
+
+/*
+ * Dense reference file for the synth benchmark: 15 melodic channels each
+ * playing four-note 16th-note chords at 120 bpm, so about 60 voices sound
+ * at once, with a filter cutoff sweep on every step.
+ */
+void buildReferenceMidi(std::vector<Uint8> *smf, Uint32 seconds) {
+    const Uint32 division = 480;
+    const Uint32 step = division / 4;
+    Uint32 steps = seconds * 8;
+    Uint32 channel, s, n;
+    std::vector<Uint8> track;
+
+    smf->clear();
+    smf->insert(smf->end(), "MThd", "MThd" + 4);
+    writeBigEndian(smf, 6, 4);
+    writeBigEndian(smf, 1, 2);
+    writeBigEndian(smf, 16, 2);
+    writeBigEndian(smf, division, 2);
+
+    for (channel = 0; channel < 16; channel++) {
+        track.clear();
+        if (channel == MIDI_DRUM_CHANNEL) {
+            /* tempo track in the drum slot */
+            writeVarLen(&track, 0);
+            track.push_back(0xFF);
+            track.push_back(0x51);
+            track.push_back(3);
+            writeBigEndian(&track, 500000, 3);
+        }
+        else {
+            writeVarLen(&track, 0);
+            track.push_back(0xB0 | channel);
+            track.push_back(10);
+            track.push_back(channel * 8);
+            writeVarLen(&track, 0);
+            track.push_back(0xB0 | channel);
+            track.push_back(71);
+            track.push_back(channel * 6);
+            for (s = 0; s < steps; s++) {
+                Uint8 root = 36 + (channel * 3 + s * 7) % 48;
+                /* filter sweep for the biquad bank */
+                writeVarLen(&track, 0);
+                track.push_back(0xB0 | channel);
+                track.push_back(74);
+                track.push_back((s * 5 + channel * 9) % 128);
+                for (n = 0; n < 4; n++) {
+                    writeVarLen(&track, 0);
+                    track.push_back(0x90 | channel);
+                    track.push_back(root + n * 4);
+                    track.push_back(64 + (s * 13 + n * 5) % 63);
+                }
+                for (n = 0; n < 4; n++) {
+                    writeVarLen(&track, n == 0 ? step : 0);
+                    track.push_back(0x80 | channel);
+                    track.push_back(root + n * 4);
+                    track.push_back(0);
+                }
+            }
+        }
+        writeVarLen(&track, 0);
+        track.push_back(0xFF);
+        track.push_back(0x2F);
+        track.push_back(0);
+
+        smf->insert(smf->end(), "MTrk", "MTrk" + 4);
+        writeBigEndian(smf, track.size(), 4);
+        smf->insert(smf->end(), track.begin(), track.end());
+    }
+}
+
+int loadMidiFile(const char *path, std::vector<Uint8> *smf) {
+    FILE *f = fopen(path, "rb");
+    long size;
+    if (f == NULL) {
+        printf("\nFailed to open %s\n", path);
+        return 1;
+    }
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    smf->resize(size > 0 ? size : 0);
+    if (size <= 0 || fread(&(*smf)[0], 1, size, f) != (size_t)size) {
+        printf("\nFailed to read %s\n", path);
+        fclose(f);
+        return 2;
+    }
+    fclose(f);
+    return 0;
+}
+
+int initMidiPlayer(midiPlayer *mp, const std::vector<Uint8> &smf) {
+    int i;
+    if (smf.empty() || parseMidi(&smf[0], smf.size(), &mp->events))
+        return 1;
+    mp->waveform.resize(getWaveformLength(0));
+    buildSineWave(&mp->waveform[0], mp->waveform.size());
+    mp->nextEvent = 0;
+    mp->frame = 0;
+    mp->allocations = 0;
+    mp->steals = 0;
+    mp->peakVoices = 0;
+    for (i = 0; i < 16; i++) {
+        mp->channelPan[i] = 0.5;
+        mp->channelCutoff[i] = FILTER_DEFAULT_CUTOFF;
+        mp->channelResonance[i] = FILTER_DEFAULT_RESONANCE;
+    }
+    for (i = 0; i < MIDI_VOICES; i++)
+        mp->voices[i].active = 0;
+    SDL_memset(&mp->bank, 0, sizeof(mp->bank));
+    return 0;
+}
+
+void midiNoteOn(midiPlayer *mp, Uint8 channel, Uint8 note, Uint8 velocity) {
+    midiVoice *mv = NULL;
+    midiVoice *oldest = NULL;
+    Uint32 active = 0;
+    int i;
+
+    for (i = 0; i < MIDI_VOICES; i++) {
+        midiVoice *candidate = &mp->voices[i];
+        if (!candidate->active) {
+            if (mv == NULL)
+                mv = candidate;
+            continue;
+        }
+        active++;
+        if (oldest == NULL || candidate->started < oldest->started)
+            oldest = candidate;
+    }
+    if (mv == NULL) {
+        mv = oldest;
+        mp->steals++;
+        mv->filterSnap = 0;
+    }
+    else {
+        if (++active > mp->peakVoices)
+            mp->peakVoices = active;
+        /* a free slot starts from a silent filter instead of ramping */
+        mv->filterSnap = 1;
+        mp->bank.z1[mv - mp->voices] = 0;
+        mp->bank.z2[mv - mp->voices] = 0;
+    }
+
+    mv->active = 1;
+    mv->channel = channel;
+    mv->note = note;
+    mv->started = mp->allocations++;
+    mv->v.waveform = &mp->waveform[0];
+    mv->v.waveformLength = mp->waveform.size();
+    mv->v.volume = velocity / 127.0 * MIDI_GAIN;
+    mv->v.pan = mp->channelPan[channel];
+    mv->v.frequency = getFrequency(note - 12);
+    mv->v.phase = 0;
+    mv->cutoff = mp->channelCutoff[channel];
+    mv->resonance = mp->channelResonance[channel];
+    mv->filterDirty = 1;
+}
+
+void midiControlChange(midiPlayer *mp, Uint8 channel, Uint8 controller, Uint8 value) {
+    int i;
+    switch (controller) {
+    case 10:
+        mp->channelPan[channel] = value / 127.0;
+        return;
+    case 71:
+        mp->channelResonance[channel] = 0.5 + value / 127.0 * 11.5;
+        break;
+    case 74:
+        mp->channelCutoff[channel] = 40 * pow(450, value / 127.0);
+        break;
+    }
+    for (i = 0; i < MIDI_VOICES; i++) {
+        midiVoice *mv = &mp->voices[i];
+        if (mv->active && mv->channel == channel) {
+            mv->cutoff = mp->channelCutoff[channel];
+            mv->resonance = mp->channelResonance[channel];
+            mv->filterDirty = 1;
+        }
+    }
+}
+
+void midiNoteOff(midiPlayer *mp, Uint8 channel, Uint8 note) {
+    midiVoice *oldest = NULL;
+    int i;
+    for (i = 0; i < MIDI_VOICES; i++) {
+        midiVoice *mv = &mp->voices[i];
+        if (mv->active && mv->channel == channel && mv->note == note
+                && (oldest == NULL || mv->started < oldest->started))
+            oldest = mv;
+    }
+    if (oldest)
+        oldest->active = 0;
+}
+
+void applyMidiEvent(midiPlayer *mp, midiEvent *e) {
+    Uint8 channel = e->status & 0x0F;
+    switch (e->status & 0xF0) {
+    case 0x90:
+        /* no drum kit in a sine synth */
+        if (channel != MIDI_DRUM_CHANNEL)
+            midiNoteOn(mp, channel, e->data1, e->data2);
+        break;
+    case 0x80:
+        midiNoteOff(mp, channel, e->data1);
+        break;
+    case 0xB0:
+        midiControlChange(mp, channel, e->data1, e->data2);
+        break;
+    }
+}
+
+/* RBJ cookbook coefficients, normalised by a0 */
+void setBiquadTarget(biquadBank *bank, int lane, int mode, double cutoff, double resonance) {
+    double w0, cosw, alpha, a0, b0, b1, b2;
+    if (cutoff > sampleRate * 0.45)
+        cutoff = sampleRate * 0.45;
+    if (cutoff < 10)
+        cutoff = 10;
+    w0 = Tao * cutoff / sampleRate;
+    cosw = cos(w0);
+    alpha = sin(w0) / (2 * resonance);
+    switch (mode) {
+    case FILTER_HIGHPASS:
+        b0 = (1 + cosw) / 2;
+        b1 = -(1 + cosw);
+        b2 = (1 + cosw) / 2;
+        break;
+    case FILTER_BANDPASS:
+        b0 = alpha;
+        b1 = 0;
+        b2 = -alpha;
+        break;
+    default:
+        b0 = (1 - cosw) / 2;
+        b1 = 1 - cosw;
+        b2 = (1 - cosw) / 2;
+        break;
+    }
+    a0 = 1 + alpha;
+    bank->targetB0[lane] = b0 / a0;
+    bank->targetB1[lane] = b1 / a0;
+    bank->targetB2[lane] = b2 / a0;
+    bank->targetA1[lane] = -2 * cosw / a0;
+    bank->targetA2[lane] = (1 - alpha) / a0;
+}
+
+void snapBiquad(biquadBank *bank, int lane) {
+    bank->b0[lane] = bank->targetB0[lane];
+    bank->b1[lane] = bank->targetB1[lane];
+    bank->b2[lane] = bank->targetB2[lane];
+    bank->a1[lane] = bank->targetA1[lane];
+    bank->a2[lane] = bank->targetA2[lane];
+}
+
+/* transposed direct form II over FILTER_LANES voices at once, in place */
+void processBiquadGroup(biquadBank *bank, int group, Uint32 frames) {
+    int lane0 = group * FILTER_LANES;
+    float *io = bank->io[group];
+    float step = 1.0f / frames;
+    Uint32 n;
+#if defined(__SSE__)
+    __m128 vstep = _mm_set1_ps(step);
+    __m128 b0 = _mm_load_ps(&bank->b0[lane0]);
+    __m128 b1 = _mm_load_ps(&bank->b1[lane0]);
+    __m128 b2 = _mm_load_ps(&bank->b2[lane0]);
+    __m128 a1 = _mm_load_ps(&bank->a1[lane0]);
+    __m128 a2 = _mm_load_ps(&bank->a2[lane0]);
+    __m128 db0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(&bank->targetB0[lane0]), b0), vstep);
+    __m128 db1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(&bank->targetB1[lane0]), b1), vstep);
+    __m128 db2 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(&bank->targetB2[lane0]), b2), vstep);
+    __m128 da1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(&bank->targetA1[lane0]), a1), vstep);
+    __m128 da2 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(&bank->targetA2[lane0]), a2), vstep);
+    __m128 z1 = _mm_load_ps(&bank->z1[lane0]);
+    __m128 z2 = _mm_load_ps(&bank->z2[lane0]);
+    for (n = 0; n < frames; n++) {
+        __m128 x = _mm_load_ps(&io[n * FILTER_LANES]);
+        __m128 y;
+        b0 = _mm_add_ps(b0, db0);
+        b1 = _mm_add_ps(b1, db1);
+        b2 = _mm_add_ps(b2, db2);
+        a1 = _mm_add_ps(a1, da1);
+        a2 = _mm_add_ps(a2, da2);
+        y = _mm_add_ps(_mm_mul_ps(b0, x), z1);
+        z1 = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(b1, x), _mm_mul_ps(a1, y)), z2);
+        z2 = _mm_sub_ps(_mm_mul_ps(b2, x), _mm_mul_ps(a2, y));
+        _mm_store_ps(&io[n * FILTER_LANES], y);
+    }
+    _mm_store_ps(&bank->z1[lane0], z1);
+    _mm_store_ps(&bank->z2[lane0], z2);
+#else
+    int lane;
+    for (lane = 0; lane < FILTER_LANES; lane++) {
+        int l = lane0 + lane;
+        float b0 = bank->b0[l], b1 = bank->b1[l], b2 = bank->b2[l];
+        float a1 = bank->a1[l], a2 = bank->a2[l];
+        float db0 = (bank->targetB0[l] - b0) * step;
+        float db1 = (bank->targetB1[l] - b1) * step;
+        float db2 = (bank->targetB2[l] - b2) * step;
+        float da1 = (bank->targetA1[l] - a1) * step;
+        float da2 = (bank->targetA2[l] - a2) * step;
+        float z1 = bank->z1[l], z2 = bank->z2[l];
+        for (n = 0; n < frames; n++) {
+            float x = io[n * FILTER_LANES + lane];
+            float y;
+            b0 += db0;
+            b1 += db1;
+            b2 += db2;
+            a1 += da1;
+            a2 += da2;
+            y = b0 * x + z1;
+            z1 = b1 * x - a1 * y + z2;
+            z2 = b2 * x - a2 * y;
+            io[n * FILTER_LANES + lane] = y;
+        }
+        bank->z1[l] = z1;
+        bank->z2[l] = z2;
+    }
+#endif
+    /* land exactly on target so ramps never drift */
+    for (n = 0; n < FILTER_LANES; n++)
+        snapBiquad(bank, lane0 + n);
+}
+
+void processBiquadBank(biquadBank *bank, Uint64 laneMask, Uint32 frames) {
+    int group;
+#if defined(__SSE__)
+    /* decaying filter state must not fall into denormals */
+    _mm_setcsr(_mm_getcsr() | 0x8040);
+#endif
+    for (group = 0; group < FILTER_GROUPS; group++) {
+        if ((laneMask >> (group * FILTER_LANES)) & ((1 << FILTER_LANES) - 1))
+            processBiquadGroup(bank, group, frames);
+    }
+}
+
+/* mono voice output into one lane of the bank's interleaved io */
+void speakLane(voice *v, float *io, Uint32 frames) {
+    double phaseIncrement = v->frequency/sampleRate;
+    Uint32 sourceIndex;
+    Uint32 n;
+    for (n = 0; n < frames; n++) {
+        v->phase += phaseIncrement;
+        if (v->phase >= 1)
+            v->phase -= 1;
+        sourceIndex = v->phase*v->waveformLength;
+        io[n * FILTER_LANES] += v->waveform[sourceIndex]*v->volume;
+    }
+}
+
+void applyDueMidiEvents(midiPlayer *mp) {
+    while (mp->nextEvent < mp->events.size() && mp->events[mp->nextEvent].frame <= mp->frame) {
+        applyMidiEvent(mp, &mp->events[mp->nextEvent]);
+        mp->nextEvent++;
+    }
+}
+
+Uint32 framesToNextMidiEvent(midiPlayer *mp, Uint32 frames) {
+    if (mp->nextEvent < mp->events.size() && mp->events[mp->nextEvent].frame - mp->frame < frames)
+        return mp->events[mp->nextEvent].frame - mp->frame;
+    return frames;
+}
+
+/*
+ * Filtered path for up to FILTER_MAX_BLOCK frames: voices render mono into
+ * their bank lane, the bank filters every group with a sounding voice, and
+ * the result is panned into out.
+ */
+void renderMidiFilteredBlock(midiPlayer *mp, float *out, Uint32 frames) {
+    biquadBank *bank = &mp->bank;
+    Uint64 lanesUsed = 0;
+    Uint32 groupsCleared = 0;
+    Uint32 done = 0;
+    Uint32 segment, n;
+    int i;
+
+    while (done < frames) {
+        applyDueMidiEvents(mp);
+        segment = framesToNextMidiEvent(mp, frames - done);
+        for (i = 0; i < MIDI_VOICES; i++) {
+            int group = i / FILTER_LANES;
+            if (!mp->voices[i].active)
+                continue;
+            if (!(groupsCleared & (1u << group))) {
+                SDL_memset(bank->io[group], 0, frames * FILTER_LANES * sizeof(float));
+                groupsCleared |= 1u << group;
+            }
+            speakLane(&mp->voices[i].v, &bank->io[group][done * FILTER_LANES + i % FILTER_LANES], segment);
+            lanesUsed |= (Uint64)1 << i;
+        }
+        done += segment;
+        mp->frame += segment;
+    }
+
+    for (i = 0; i < MIDI_VOICES; i++) {
+        midiVoice *mv = &mp->voices[i];
+        if (!(lanesUsed & ((Uint64)1 << i)) || !mv->filterDirty)
+            continue;
+        setBiquadTarget(bank, i, mp->filterMode, mv->cutoff, mv->resonance);
+        if (mv->filterSnap)
+            snapBiquad(bank, i);
+        mv->filterDirty = 0;
+        mv->filterSnap = 0;
+    }
+    processBiquadBank(bank, lanesUsed, frames);
+
+    for (i = 0; i < MIDI_VOICES; i++) {
+        float *y = &bank->io[i / FILTER_LANES][i % FILTER_LANES];
+        float left, right;
+        if (!(lanesUsed & ((Uint64)1 << i)))
+            continue;
+        left = 1 - mp->voices[i].v.pan;
+        right = mp->voices[i].v.pan;
+        for (n = 0; n < frames; n++) {
+            out[n * 2] += y[n * FILTER_LANES] * left;
+            out[n * 2 + 1] += y[n * FILTER_LANES] * right;
+        }
+    }
+}
+
+/*
+ * Adds floatCount interleaved stereo floats of the song into out, splitting
+ * the block wherever an event falls so every note starts on its own frame.
+ */
+void renderMidi(midiPlayer *mp, float *out, Uint32 floatCount) {
+    Uint32 frames = floatCount / 2;
+    Uint32 done = 0;
+    Uint32 segment;
+    int i;
+
+    if (mp->filterMode != FILTER_OFF) {
+        while (done < frames) {
+            segment = std::min(frames - done, (Uint32)FILTER_MAX_BLOCK);
+            renderMidiFilteredBlock(mp, &out[done * 2], segment);
+            done += segment;
+        }
+        return;
+    }
+
+    while (done < frames) {
+        applyDueMidiEvents(mp);
+        segment = framesToNextMidiEvent(mp, frames - done);
+        for (i = 0; i < MIDI_VOICES; i++) {
+            if (mp->voices[i].active)
+                speakRange(&mp->voices[i].v, &out[done * 2], segment * 2);
+        }
+        done += segment;
+        mp->frame += segment;
+    }
+}
+
+int midiFinished(midiPlayer *mp) {
+    int i;
+    if (mp->nextEvent < mp->events.size())
+        return 0;
+    if (!mp->events.empty() && mp->frame > mp->events.back().frame + MIDI_RELEASE_SECONDS * sampleRate)
+        return 1;
+    for (i = 0; i < MIDI_VOICES; i++) {
+        if (mp->voices[i].active)
+            return 0;
+    }
+    return 1;
+}
+
+void writeLittleEndian(FILE *f, Uint32 value, int bytes) {
+    while (bytes--) {
+        fputc(value & 0xFF, f);
+        value >>= 8;
+    }
+}
+
+/* 32-bit float stereo WAV header */
+void writeWavHeader(FILE *f, Uint32 dataBytes) {
+    fwrite("RIFF", 1, 4, f);
+    writeLittleEndian(f, 36 + dataBytes, 4);
+    fwrite("WAVEfmt ", 1, 8, f);
+    writeLittleEndian(f, 16, 4);
+    writeLittleEndian(f, 3, 2);
+    writeLittleEndian(f, 2, 2);
+    writeLittleEndian(f, sampleRate, 4);
+    writeLittleEndian(f, sampleRate * 2 * sizeof(float), 4);
+    writeLittleEndian(f, 2 * sizeof(float), 2);
+    writeLittleEndian(f, 32, 2);
+    fwrite("data", 1, 4, f);
+    writeLittleEndian(f, dataBytes, 4);
+}
+
+/*
+ * Renders the whole song as fast as possible, optionally into a WAV file.
+ * Only time spent in renderMidi counts towards the realtime factor.
+ */
+int renderMidiOffline(midiPlayer *mp, const char *wavPath) {
+    std::vector<float> block(samplesPerFrame);
+    FILE *wav = NULL;
+    Uint64 frames = 0;
+    Uint64 renderTicks = 0;
+    Uint64 wallStart, start;
+    double renderSeconds, wallSeconds, audioSeconds;
+
+    if (wavPath) {
+        wav = fopen(wavPath, "wb");
+        if (wav == NULL) {
+            printf("\nFailed to create %s\n", wavPath);
+            return 1;
+        }
+        writeWavHeader(wav, 0);
+    }
+
+    wallStart = SDL_GetPerformanceCounter();
+    while (!midiFinished(mp)) {
+        std::fill(block.begin(), block.end(), 0.0f);
+        start = SDL_GetPerformanceCounter();
+        renderMidi(mp, &block[0], samplesPerFrame);
+        renderTicks += SDL_GetPerformanceCounter() - start;
+        frames += samplesPerFrame / 2;
+        if (wav)
+            fwrite(&block[0], sizeof(float), samplesPerFrame, wav);
+    }
+    wallSeconds = (double)(SDL_GetPerformanceCounter() - wallStart) / SDL_GetPerformanceFrequency();
+    renderSeconds = (double)renderTicks / SDL_GetPerformanceFrequency();
+    audioSeconds = (double)frames / sampleRate;
+
+    if (wav) {
+        fseek(wav, 0, SEEK_SET);
+        writeWavHeader(wav, frames * 2 * sizeof(float));
+        fclose(wav);
+    }
+
+    printf(
+        " events__________%u\n"
+        " audio___________%.2f s\n"
+        " synth time______%.3f s\n"
+        " wall time_______%.3f s\n"
+        " realtime factor_%.1fx (synth) %.1fx (wall)\n"
+        " peak voices_____%u\n"
+        " voice steals____%u\n\n",
+        (Uint32)mp->events.size(),
+        audioSeconds,
+        renderSeconds,
+        wallSeconds,
+        renderSeconds > 0 ? audioSeconds / renderSeconds : 0,
+        wallSeconds > 0 ? audioSeconds / wallSeconds : 0,
+        mp->peakVoices,
+        mp->steals
+    );
+    return 0;
+}
+
+/* raw bank throughput with every lane busy and coefficients moving */
+void benchmarkBiquadBank(void) {
+    static biquadBank bank;
+    const Uint32 blocks = 20000;
+    Uint64 start, ticks;
+    Uint32 b, i;
+    double seconds, filterSamples;
+
+    SDL_memset(&bank, 0, sizeof(bank));
+    for (i = 0; i < FILTER_GROUPS; i++) {
+        for (b = 0; b < FILTER_MAX_BLOCK * FILTER_LANES; b++)
+            bank.io[i][b] = (float)rand() / RAND_MAX - 0.5f;
+    }
+    start = SDL_GetPerformanceCounter();
+    for (b = 0; b < blocks; b++) {
+        for (i = 0; i < MIDI_VOICES; i++)
+            setBiquadTarget(&bank, i, FILTER_LOWPASS + i % 3, 200 + (b + i * 37) % 8000, 0.707);
+        processBiquadBank(&bank, ~(Uint64)0, FILTER_MAX_BLOCK);
+    }
+    ticks = SDL_GetPerformanceCounter() - start;
+    seconds = (double)ticks / SDL_GetPerformanceFrequency();
+    filterSamples = (double)blocks * FILTER_MAX_BLOCK * MIDI_VOICES;
+    printf(
+        " biquad bank_____%.1f M filter-samples/s\n"
+        " per sample______%.3f ns\n"
+        " realtime voices_%.0f at %u Hz\n\n",
+        filterSamples / seconds / 1e6,
+        seconds * 1e9 / filterSamples,
+        filterSamples / seconds / sampleRate,
+        sampleRate
+    );
+}
+
 int init(void) {
     SDL_Init(SDL_INIT_AUDIO | SDL_INIT_TIMER);
     SDL_AudioSpec want;
@@ -139,6 +1191,7 @@ int init(void) {
     want.channels = 2;
     want.samples = floatStreamLength;
     want.callback = audioCallback;
+    callbackProfilerWrap(&profiler, "testaudio3", &want);
 
     AudioDevice = SDL_OpenAudioDevice(NULL, 0, &want, &audioSpec, SDL_AUDIO_ALLOW_FORMAT_CHANGE);
     if (AudioDevice == 0) {
@@ -146,6 +1199,8 @@ int init(void) {
         return 1;
     }
 
+    callbackProfilerStart(&profiler, &audioSpec);
+
     printf("want:\n");
     logSpec(&want);
     printf("audioSpec:\n");
@@ -162,10 +1217,15 @@ int init(void) {
     msPerFrame = 1000 / frameRate;
     audioMainLeftOff = samplesPerFrame * 8;
     SDL_AtomicSet(&audioCallbackLeftOff, 0);
+    SDL_AtomicSet(&audioMainWritten, audioMainLeftOff);
+    callbackPeriodTicks = SDL_GetPerformanceFrequency() * floatStreamLength / (sampleRate * audioSpec.channels);
 
     if (audioBufferLength % samplesPerFrame)
         audioBufferLength += samplesPerFrame - (audioBufferLength % samplesPerFrame);
     audioBuffer = (float*)malloc(sizeof(float) * audioBufferLength);
+    SDL_memset(audioBuffer, 0, sizeof(float) * audioBufferLength);
+
+    initLeadController(&leadControl);
 
     return 0;
 }
@@ -177,9 +1237,64 @@ int onExit(void) {
 }
 
 int main(int argc, char *argv[]) {
-    float  syncCompensationFactor = 0.0016;
     Sint32 mainAudioLead;
+    double sleepMs;
+    Uint64 sleepStart;
     Uint32 i;
+    leadStats stats;
+    const char *midiPath = NULL;
+    const char *wavPath = NULL;
+    int bench = 0;
+    int benchFilter = 0;
+    int filterMode = FILTER_OFF;
+    int playMidi = 0;
+    std::vector<Uint8> smf;
+
+    for (i = 1; i < (Uint32)argc; i++) {
+        if (strcmp(argv[i], "--render") == 0 && i + 1 < (Uint32)argc)
+            wavPath = argv[++i];
+        else if (strcmp(argv[i], "--bench") == 0)
+            bench = 1;
+        else if (strcmp(argv[i], "--bench-filter") == 0)
+            benchFilter = 1;
+        else if (strcmp(argv[i], "--filter") == 0 && i + 1 < (Uint32)argc) {
+            i++;
+            if (strcmp(argv[i], "hp") == 0)
+                filterMode = FILTER_HIGHPASS;
+            else if (strcmp(argv[i], "bp") == 0)
+                filterMode = FILTER_BANDPASS;
+            else
+                filterMode = FILTER_LOWPASS;
+        }
+        else
+            midiPath = argv[i];
+    }
+
+    if (bench || benchFilter || wavPath) {
+        samplesPerFrame = sampleRate / frameRate;
+        if (midiPath) {
+            if (loadMidiFile(midiPath, &smf))
+                return 1;
+        }
+        else {
+            printf("rendering dense reference sequence\n");
+            buildReferenceMidi(&smf, 60);
+        }
+        if (benchFilter) {
+            benchmarkBiquadBank();
+            printf("unfiltered:\n");
+            if (initMidiPlayer(&midi, smf) || renderMidiOffline(&midi, NULL))
+                return 1;
+            if (filterMode == FILTER_OFF)
+                filterMode = FILTER_LOWPASS;
+        }
+        if (initMidiPlayer(&midi, smf))
+            return 1;
+        midi.filterMode = filterMode;
+        if (benchFilter)
+            printf("filtered:\n");
+        return renderMidiOffline(&midi, wavPath);
+    }
 
     voice testVoiceA;
     voice testVoiceB;
@@ -209,6 +1324,13 @@ int main(int argc, char *argv[]) {
     if (init())
         return 1;
 
+    if (midiPath) {
+        if (loadMidiFile(midiPath, &smf) || initMidiPlayer(&midi, smf))
+            return 1;
+        midi.filterMode = filterMode;
+        playMidi = 1;
+    }
+
     SDL_Delay(42);
     SDL_PauseAudioDevice(AudioDevice, 0);
     while (running) {
@@ -219,9 +1341,16 @@ int main(int argc, char *argv[]) {
         }
         for (i = 0; i < samplesPerFrame; i++)
             audioBuffer[audioMainLeftOff+i] = 0;
-        speak(&testVoiceA);
-        speak(&testVoiceB);
-        speak(&testVoiceC);
+        if (playMidi) {
+            renderMidi(&midi, &audioBuffer[audioMainLeftOff], samplesPerFrame);
+            if (midiFinished(&midi))
+                running = SDL_FALSE;
+        }
+        else {
+            speak(&testVoiceA);
+            speak(&testVoiceB);
+            speak(&testVoiceC);
+        }
         if (audioMainAccumulator > 1) {
             for (i=0; i<samplesPerFrame; i++) {
                 audioBuffer[audioMainLeftOff+i] /= audioMainAccumulator;
@@ -231,13 +1360,28 @@ int main(int argc, char *argv[]) {
         audioMainLeftOff += samplesPerFrame;
         if (audioMainLeftOff == audioBufferLength)
             audioMainLeftOff = 0;
+        SDL_AtomicSet(&audioMainWritten, audioMainLeftOff);
         mainAudioLead = audioMainLeftOff - SDL_AtomicGet(&audioCallbackLeftOff);
         if (mainAudioLead < 0)
             mainAudioLead += audioBufferLength;
-        if (mainAudioLead < floatStreamLength)
-            printf("An audio collision may have occured!\n");
-        SDL_Delay(mainAudioLead * syncCompensationFactor);
+        sleepMs = updateLeadController(&leadControl, mainAudioLead);
+        if (leadControl.frames % (frameRate * 10) == 0) {
+            getLeadStats(&stats);
+            logLeadStats(&stats);
+        }
+        if (sleepMs >= 1) {
+            sleepStart = SDL_GetPerformanceCounter();
+            SDL_Delay(sleepMs);
+            updateWakeJitter(&leadControl, (Uint32)sleepMs,
+                (SDL_GetPerformanceCounter() - sleepStart) * 1000.0 / SDL_GetPerformanceFrequency());
+        }
+        callbackProfilerPoll(&profiler);
     }
+    getLeadStats(&stats);
+    printf("lead stats:\n");
+    logLeadStats(&stats);
+    SDL_PauseAudioDevice(AudioDevice, 1);
+    callbackProfilerDump(&profiler);
     onExit();
     return 0;
 }
\ No newline at end of file
@@ -1,51 +1,250 @@
 #include <SDL.h>
 
 #include <queue>
+#include <atomic>
+#include <algorithm>
+#include <vector>
 #include <cmath>
 #include <stdio.h>
+#include <limits.h>
 #include <assert.h>
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "callbackprofiler.h"
 
 const int AMPLITUDE = 28000;
 const int FREQUENCY = 44100;
 
+// the mix is linear up to the knee, then bends smoothly towards full scale,
+// so overlapping beeps get louder without clipping at the clamp
+const float MIX_KNEE = 0.5f;
+
+// submissions are drained into the timeline at most this many per callback,
+// so a burst from the main thread never makes one callback run long
+const int SUBMIT_QUEUE_SIZE = 16384;
+const int MAX_DRAIN_PER_CALLBACK = 1024;
+const int TIMELINE_SIZE = 16384;
+const int MAX_ACTIVE_BEEPS = 64;
+
+// one completion slot per in-flight beep, ticket % COMPLETION_SLOTS
+const int COMPLETION_SLOTS = SUBMIT_QUEUE_SIZE + TIMELINE_SIZE;
+
 struct BeepObject
 {
     double freq;
-    int samplesLeft;
+    Uint64 startSample;
+    Uint32 length;
+    Uint32 ticket;
+    double phase;
+};
+
+typedef void (*BeepDoneCallback)(Uint32 ticket, void* userdata);
+
+struct BeepDoneRegistration
+{
+    Uint32 ticket;
+    BeepDoneCallback callback;
+    void* userdata;
+};
+
+// bounded multi-producer single-consumer queue, the consumer is the callback
+class BeepQueue
+{
+private:
+    struct Cell
+    {
+        std::atomic<Uint32> sequence;
+        BeepObject beep;
+    };
+    // SUBMIT_QUEUE_SIZE cells, on the heap so a Beeper fits on any stack
+    Cell* cells;
+    std::atomic<Uint32> enqueuePos;
+    Uint32 dequeuePos;
+public:
+    BeepQueue();
+    ~BeepQueue();
+    bool push(const BeepObject& bo);
+    bool pop(BeepObject* bo);
 };
 
 class Beeper
 {
 private:
-    double v;
-    std::queue<BeepObject> beeps;
-		SDL_AudioDeviceID dev;
+    BeepQueue submitted;
+    // min-heap on startSample, owned by the callback, TIMELINE_SIZE long
+    BeepObject* timeline;
+    int timelineSize;
+    BeepObject active[MAX_ACTIVE_BEEPS];
+    int activeCount;
+    float* mixBuffer;
+    int mixBufferLength;
+    std::atomic<Uint64> sampleClock;
+    std::atomic<Uint64> nextFreeSample;
+    std::atomic<Uint32> beepsSubmitted;
+    std::atomic<Uint32> beepsFinished;
+    Uint32 latency;
+    SDL_AudioDeviceID dev;
+    // times audio_callback against the buffer period, dumped when the device closes
+    callbackProfiler profiler;
+
+    // completion: the callback publishes finished tickets and bumps the
+    // futex word, it only makes the wake syscall when someone is waiting
+    std::atomic<Uint32> nextTicket;
+    // COMPLETION_SLOTS each, allocated with the mix buffer
+    std::atomic<Uint32>* doneTicket;
+    Uint64* doneTicks;
+    std::atomic<Uint32> completionEpoch;
+    std::atomic<Uint32> waiters;
+
+    // onDone callbacks run on a notifier thread, never on the audio thread
+    SDL_Thread* notifier;
+    SDL_mutex* registrationMutex;
+    std::vector<BeepDoneRegistration> registrations;
+    std::atomic<bool> notifierQuit;
+
+    void finish(Uint32 ticket, Uint64 ticks);
+    void waitForEpoch(Uint32 epoch);
+    void wakeWaiters();
+    static int notifierThread(void* data);
 public:
     Beeper();
     ~Beeper();
-    void beep(double freq, int duration);
+    Uint64 now();
+    Uint32 beepAt(double freq, Uint64 startSample, Uint32 length);
+    Uint32 beep(double freq, int duration);
     void generateSamples(Sint16 *stream, int length);
+    bool isDone(Uint32 ticket);
+    Uint64 completedAt(Uint32 ticket);
+    void waitFor(Uint32 ticket);
+    void onDone(Uint32 ticket, BeepDoneCallback callback, void* userdata);
     void wait();
 };
 
 void audio_callback(void*, Uint8*, int);
 
+static void futexWait(std::atomic<Uint32>* word, Uint32 expected)
+{
+#if defined(__linux__)
+    syscall(SYS_futex, (Uint32*)word, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+#else
+    if (word->load() == expected) {
+        SDL_Delay(1);
+    }
+#endif
+}
+
+static void futexWake(std::atomic<Uint32>* word)
+{
+#if defined(__linux__)
+    syscall(SYS_futex, (Uint32*)word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+BeepQueue::BeepQueue()
+{
+    cells = new Cell[SUBMIT_QUEUE_SIZE];
+    for (int i = 0; i < SUBMIT_QUEUE_SIZE; i++) {
+        cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    enqueuePos.store(0, std::memory_order_relaxed);
+    dequeuePos = 0;
+}
+
+BeepQueue::~BeepQueue()
+{
+    delete[] cells;
+}
+
+bool BeepQueue::push(const BeepObject& bo)
+{
+    Uint32 pos = enqueuePos.load(std::memory_order_relaxed);
+    for (;;) {
+        Cell& cell = cells[pos & (SUBMIT_QUEUE_SIZE - 1)];
+        Uint32 seq = cell.sequence.load(std::memory_order_acquire);
+        Sint32 diff = (Sint32)(seq - pos);
+        if (diff == 0) {
+            if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                cell.beep = bo;
+                cell.sequence.store(pos + 1, std::memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            // full
+            return false;
+        } else {
+            pos = enqueuePos.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+bool BeepQueue::pop(BeepObject* bo)
+{
+    Cell& cell = cells[dequeuePos & (SUBMIT_QUEUE_SIZE - 1)];
+    Uint32 seq = cell.sequence.load(std::memory_order_acquire);
+    if ((Sint32)(seq - (dequeuePos + 1)) < 0) {
+        return false;
+    }
+    *bo = cell.beep;
+    cell.sequence.store(dequeuePos + SUBMIT_QUEUE_SIZE, std::memory_order_release);
+    dequeuePos++;
+    return true;
+}
+
+static bool laterStart(const BeepObject& a, const BeepObject& b)
+{
+    return a.startSample > b.startSample;
+}
+
 Beeper::Beeper()
 {
     SDL_AudioSpec desiredSpec;
 
+    timeline = new BeepObject[TIMELINE_SIZE];
+    timelineSize = 0;
+    activeCount = 0;
+    sampleClock.store(0);
+    nextFreeSample.store(0);
+    beepsSubmitted.store(0);
+    beepsFinished.store(0);
+    // ticket 0 is never handed out, slots start out as already done
+    nextTicket.store(1);
+    doneTicket = new std::atomic<Uint32>[COMPLETION_SLOTS];
+    doneTicks = new Uint64[COMPLETION_SLOTS];
+    for (int i = 0; i < COMPLETION_SLOTS; i++) {
+        doneTicket[i].store(i - COMPLETION_SLOTS);
+        doneTicks[i] = 0;
+    }
+    completionEpoch.store(0);
+    waiters.store(0);
+    notifier = NULL;
+    registrationMutex = SDL_CreateMutex();
+    notifierQuit.store(false);
+
+    SDL_zero(desiredSpec);
     desiredSpec.freq = FREQUENCY;
     desiredSpec.format = AUDIO_S16SYS;
     desiredSpec.channels = 1;
     desiredSpec.samples = 2048;
     desiredSpec.callback = audio_callback;
     desiredSpec.userdata = this;
+    callbackProfilerWrap(&profiler, "testaudiobeep", &desiredSpec);
 
-    SDL_AudioSpec obtainedSpec;
+    // without a device the beeper still renders through generateSamples, as benchaudio does
+    SDL_AudioSpec obtainedSpec = desiredSpec;
 
 		dev = SDL_OpenAudioDevice(NULL, 0, &desiredSpec, &obtainedSpec, SDL_AUDIO_ALLOW_ANY_CHANGE);
     // you might want to look for errors here
     //SDL_OpenAudio(&desiredSpec, &obtainedSpec);
+    callbackProfilerStart(&profiler, &obtainedSpec);
+
+    // the callback never allocates, size the mix buffer up front
+    mixBufferLength = std::max((int)obtainedSpec.size / 2, (int)desiredSpec.samples);
+    mixBuffer = new float[mixBufferLength];
+    latency = obtainedSpec.samples;
 
     // start play audio
     //SDL_PauseAudio(0);
@@ -54,62 +253,259 @@ Beeper::Beeper()
 
 Beeper::~Beeper()
 {
+		SDL_PauseAudioDevice(dev, 1);
+    callbackProfilerDump(&profiler);
 		SDL_CloseAudioDevice(dev);
     //SDL_CloseAudio();
+    if (notifier) {
+        notifierQuit.store(true);
+        wakeWaiters();
+        SDL_WaitThread(notifier, NULL);
+    }
+    SDL_DestroyMutex(registrationMutex);
+    delete[] mixBuffer;
+    delete[] timeline;
+    delete[] doneTicket;
+    delete[] doneTicks;
 }
 
-void Beeper::generateSamples(Sint16 *stream, int length)
+// earliest sample a new beep can still start on without being late
+Uint64 Beeper::now()
 {
-    int i = 0;
-    while (i < length) {
+    return sampleClock.load(std::memory_order_acquire) + latency;
+}
 
-        if (beeps.empty()) {
-            while (i < length) {
-                stream[i] = 0;
-                i++;
-            }
+// returns the beep's completion ticket, 0 if the submit queue was full
+Uint32 Beeper::beepAt(double freq, Uint64 startSample, Uint32 length)
+{
+    BeepObject bo;
+    bo.freq = freq;
+    bo.startSample = startSample;
+    bo.length = length;
+    bo.phase = 0;
+    bo.ticket = nextTicket.fetch_add(1);
+    if (bo.ticket == 0) {
+        bo.ticket = nextTicket.fetch_add(1);
+    }
+
+    // the slot is free once the ticket COMPLETION_SLOTS before us is done
+    waitFor(bo.ticket - COMPLETION_SLOTS);
+
+    beepsSubmitted.fetch_add(1, std::memory_order_release);
+    if (!submitted.push(bo)) {
+        // nothing will ever finish this ticket, retire it here
+        finish(bo.ticket, SDL_GetPerformanceCounter());
+        wakeWaiters();
+        return 0;
+    }
+    return bo.ticket;
+}
+
+// queues the beep right after the previous one, like the old std::queue did
+Uint32 Beeper::beep(double freq, int duration)
+{
+    Uint32 length = (Uint64)duration * FREQUENCY / 1000;
+    Uint64 start = nextFreeSample.load();
+    Uint64 earliest;
+    Uint32 ticket;
+    do {
+        earliest = std::max(start, now());
+    } while (!nextFreeSample.compare_exchange_weak(start, earliest + length));
+
+    while ((ticket = beepAt(freq, earliest, length)) == 0) {
+        SDL_Delay(1);
+    }
+    return ticket;
+}
+
+void Beeper::finish(Uint32 ticket, Uint64 ticks)
+{
+    int slot = ticket % COMPLETION_SLOTS;
+    doneTicks[slot] = ticks;
+    doneTicket[slot].store(ticket, std::memory_order_release);
+    beepsFinished.fetch_add(1, std::memory_order_release);
+}
+
+bool Beeper::isDone(Uint32 ticket)
+{
+    // slots only ever move forward, a newer ticket means ours finished
+    Uint32 done = doneTicket[ticket % COMPLETION_SLOTS].load(std::memory_order_acquire);
+    return (Sint32)(done - ticket) >= 0;
+}
+
+// performance counter value when the callback rendered the last sample
+Uint64 Beeper::completedAt(Uint32 ticket)
+{
+    if (!isDone(ticket)) {
+        return 0;
+    }
+    return doneTicks[ticket % COMPLETION_SLOTS];
+}
+
+void Beeper::wakeWaiters()
+{
+    completionEpoch.fetch_add(1);
+    if (waiters.load() > 0) {
+        futexWake(&completionEpoch);
+    }
+}
+
+void Beeper::waitForEpoch(Uint32 epoch)
+{
+    waiters.fetch_add(1);
+    futexWait(&completionEpoch, epoch);
+    waiters.fetch_sub(1);
+}
+
+void Beeper::waitFor(Uint32 ticket)
+{
+    for (;;) {
+        Uint32 epoch = completionEpoch.load();
+        if (isDone(ticket)) {
             return;
         }
-        BeepObject& bo = beeps.front();
+        waitForEpoch(epoch);
+    }
+}
 
-        int samplesToDo = std::min(i + bo.samplesLeft, length);
-        bo.samplesLeft -= samplesToDo - i;
+int Beeper::notifierThread(void* data)
+{
+    Beeper* beeper = (Beeper*)data;
+    std::vector<BeepDoneRegistration> ready;
 
-        while (i < samplesToDo) {
-            stream[i] = AMPLITUDE * std::sin(v * 2 * M_PI / FREQUENCY);
-            i++;
-            v += bo.freq;
+    while (!beeper->notifierQuit.load()) {
+        Uint32 epoch = beeper->completionEpoch.load();
+
+        SDL_LockMutex(beeper->registrationMutex);
+        std::vector<BeepDoneRegistration>& pending = beeper->registrations;
+        for (size_t i = 0; i < pending.size(); ) {
+            if (beeper->isDone(pending[i].ticket)) {
+                ready.push_back(pending[i]);
+                pending[i] = pending.back();
+                pending.pop_back();
+            } else {
+                i++;
+            }
         }
+        SDL_UnlockMutex(beeper->registrationMutex);
 
-        if (bo.samplesLeft == 0) {
-            beeps.pop();
+        for (size_t i = 0; i < ready.size(); i++) {
+            ready[i].callback(ready[i].ticket, ready[i].userdata);
+        }
+        if (ready.empty()) {
+            beeper->waitForEpoch(epoch);
         }
+        ready.clear();
     }
+    return 0;
 }
 
-void Beeper::beep(double freq, int duration)
+// callback runs on the notifier thread once the beep has finished
+void Beeper::onDone(Uint32 ticket, BeepDoneCallback callback, void* userdata)
 {
+    BeepDoneRegistration registration;
+    registration.ticket = ticket;
+    registration.callback = callback;
+    registration.userdata = userdata;
+
+    SDL_LockMutex(registrationMutex);
+    registrations.push_back(registration);
+    if (notifier == NULL) {
+        notifier = SDL_CreateThread(notifierThread, "BeepNotifier", this);
+    }
+    SDL_UnlockMutex(registrationMutex);
+
+    // the beep may already be done, make the notifier look again
+    wakeWaiters();
+}
+
+static float softLimit(float x)
+{
+    float magnitude = std::fabs(x);
+    if (magnitude <= MIX_KNEE) {
+        return x;
+    }
+    float bent = MIX_KNEE + (1.0f - MIX_KNEE) * std::tanh((magnitude - MIX_KNEE) / (1.0f - MIX_KNEE));
+    return x < 0 ? -bent : bent;
+}
+
+void Beeper::generateSamples(Sint16 *stream, int length)
+{
+    Uint64 blockStart = sampleClock.load(std::memory_order_relaxed);
+    Uint64 blockEnd;
+    Uint64 finishedTicks = 0;
     BeepObject bo;
-    bo.freq = freq;
-    bo.samplesLeft = duration * FREQUENCY / 1000;
+    int i;
+
+    if (length > mixBufferLength) {
+        length = mixBufferLength;
+    }
+    blockEnd = blockStart + length;
 
-		SDL_LockAudioDevice(dev);
-    //SDL_LockAudio();
-    beeps.push(bo);
-    //SDL_UnlockAudio();
-		SDL_UnlockAudioDevice(dev);
+    // pull new submissions into the sorted timeline
+    for (i = 0; i < MAX_DRAIN_PER_CALLBACK && timelineSize < TIMELINE_SIZE; i++) {
+        if (!submitted.pop(&bo)) {
+            break;
+        }
+        timeline[timelineSize++] = bo;
+        std::push_heap(timeline, timeline + timelineSize, laterStart);
+    }
+
+    // start everything due in this block
+    while (timelineSize > 0 && activeCount < MAX_ACTIVE_BEEPS && timeline[0].startSample < blockEnd) {
+        std::pop_heap(timeline, timeline + timelineSize, laterStart);
+        active[activeCount++] = timeline[--timelineSize];
+    }
+
+    std::fill(mixBuffer, mixBuffer + length, 0.0f);
+    i = 0;
+    while (i < activeCount) {
+        BeepObject& beep = active[i];
+        // late beeps start at the top of the block and keep their length
+        int offset = beep.startSample > blockStart ? (int)std::min(beep.startSample - blockStart, (Uint64)length) : 0;
+        int count = std::min((Uint32)(length - offset), beep.length);
+        double increment = beep.freq * 2 * M_PI / FREQUENCY;
+
+        for (int s = offset; s < offset + count; s++) {
+            mixBuffer[s] += std::sin(beep.phase);
+            beep.phase += increment;
+        }
+        beep.phase = std::fmod(beep.phase, 2 * M_PI);
+        beep.length -= count;
+        beep.startSample = blockEnd;
+
+        if (beep.length == 0) {
+            if (finishedTicks == 0) {
+                finishedTicks = SDL_GetPerformanceCounter();
+            }
+            finish(beep.ticket, finishedTicks);
+            active[i] = active[--activeCount];
+        } else {
+            i++;
+        }
+    }
+
+    for (i = 0; i < length; i++) {
+        float sample = softLimit(mixBuffer[i]) * AMPLITUDE;
+        stream[i] = (Sint16)std::max(-32768.0f, std::min(32767.0f, sample));
+    }
+
+    sampleClock.store(blockEnd, std::memory_order_release);
+    if (finishedTicks) {
+        wakeWaiters();
+    }
 }
 
+// waits for every beep submitted so far
 void Beeper::wait()
 {
-    int size;
-    do {
-        SDL_Delay(20);
-        SDL_LockAudioDevice(dev);
-        size = beeps.size();
-        SDL_UnlockAudioDevice(dev);
-    } while (size > 0);
-
+    for (;;) {
+        Uint32 epoch = completionEpoch.load();
+        if (beepsFinished.load(std::memory_order_acquire) == beepsSubmitted.load(std::memory_order_acquire)) {
+            return;
+        }
+        waitForEpoch(epoch);
+    }
 }
 
 void audio_callback(void *_beeper, Uint8 *_stream, int _length)
@@ -122,6 +518,11 @@ void audio_callback(void *_beeper, Uint8 *_stream, int _length)
     beeper->generateSamples(stream, length);
 }
 
+static void printDone(Uint32 ticket, void* userdata)
+{
+    printf("beep %u done\n", ticket);
+}
+
 int main(int argc, char* argv[])
 {
     SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_TIMER);
@@ -131,7 +532,18 @@ int main(int argc, char* argv[])
 
     Beeper b;
     b.beep(Hz, duration);
+
+    // a major triad over the long beep, one sample-exact start per note
+    Uint64 start = b.now() + FREQUENCY;
+    Uint32 third = b.beepAt(Hz * 5 / 4, start, FREQUENCY * 2);
+    Uint32 fifth = b.beepAt(Hz * 3 / 2, start + FREQUENCY / 2, FREQUENCY * 2);
+    b.onDone(fifth, printDone, NULL);
+
+    b.waitFor(third);
+    Uint64 woke = SDL_GetPerformanceCounter();
+    printf("wake-up latency %.3f ms\n", (woke - b.completedAt(third)) * 1000.0 / SDL_GetPerformanceFrequency());
+
     b.wait();
 
     return 0;
-}
\ No newline at end of file
+}
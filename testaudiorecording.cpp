@@ -6,8 +6,37 @@ and may not be redistributed without written permission.*/
 #include <SDL_image.h>
 #include <SDL_ttf.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <string>
 #include <sstream>
+#include <vector>
+#include <map>
+#include <atomic>
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+//Using libavcodec to compress recordings on the fly
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libswresample/swresample.h>
+#include <libavutil/audio_fifo.h>
+}
+
+//Callback deadline profiles and the stats export shared with the other players
+#include "callbackprofiler.h"
+#include "statsregistry.h"
 
 //Screen dimension constants
 const int SCREEN_WIDTH = 640;
@@ -16,11 +45,122 @@ const int SCREEN_HEIGHT = 480;
 //Maximum number of supported recording devices
 const int MAX_RECORDING_DEVICES = 10;
 
-//Maximum recording time
-const int MAX_RECORDING_SECONDS = 5;
+//Audio the rings between the callbacks and the disk threads can hold
+const int RING_BUFFER_SECONDS = 2;
+
+//Size and alignment of each disk write
+const int DISK_CHUNK_BYTES = 1 << 20;
+const int DISK_ALIGNMENT = 4096;
+
+//Recording store chunks the pool maps at startup and at a time as it grows;
+//chunks go back as soon as they are on disk so a take of any length needs few
+const int POOL_RESERVE_CHUNKS = 8;
+const int POOL_SLAB_CHUNKS = 8;
+
+//How long the disk threads sleep when there is nothing to do
+const int DISK_POLL_MS = 5;
+
+//Size of the canonical WAV header
+const int WAV_HEADER_BYTES = 44;
+
+//Where recordings are streamed to, per storage format
+const char* RECORDING_FILE = "recording.wav";
+const char* RECORDING_FLAC_FILE = "recording.flac";
+const char* RECORDING_OPUS_FILE = "recording.opus";
+
+//Where multitrack recordings are streamed to
+const char* MULTITRACK_FILE = "multitrack.wav";
+
+//Device buffer size and output chunk for multitrack capture
+const Uint16 MULTITRACK_BUFFER_SAMPLES = 1024;
+const int MULTITRACK_CHUNK_FRAMES = 1024;
+
+//Callback timestamps each device can queue before the writer takes them
+const int MULTITRACK_TIMESTAMP_ENTRIES = 1024;
+
+//How hard alignment error bends the ratio, per second of error, and the most it may
+const double MULTITRACK_ALIGN_GAIN = 0.5;
+const double MULTITRACK_MAX_RATIO_OFFSET = 0.005;
+
+//How often the writer reports drift
+const int MULTITRACK_REPORT_SECONDS = 10;
+
+//Size of the texture glyphs are packed into
+const int GLYPH_ATLAS_SIZE = 1024;
+
+//Channels the level meters measure
+const int METER_CHANNELS = 2;
+
+//True peak is measured by 4x oversampling through a 48 tap polyphase filter
+const int TRUE_PEAK_PHASES = 4;
+const int TRUE_PEAK_TAPS = 12;
+
+//Frames the meters deinterleave at a time
+const int METER_CHUNK_FRAMES = 256;
+
+//Meter ballistics
+const float METER_PEAK_RELEASE_SECONDS = 1.5f;
+const float METER_RMS_SECONDS = 0.3f;
+
+//Meter display range
+const float METER_FLOOR_DB = -60.0f;
+
+//Block size and count for the metering benchmark
+const int METER_BENCH_FRAMES = 64;
+const int METER_BENCH_BLOCKS = 200000;
+
+//Audio kept from before speech starts and how long it carries on after
+const int VAD_PREROLL_MS = 300;
+const int VAD_HANGOVER_MS = 700;
+
+//Block level above the noise floor that counts as speech, and the lower level that keeps it going
+const float VAD_ONSET_DB = 12.0f;
+const float VAD_RELEASE_DB = 6.0f;
+
+//Quietest block that can count as speech, so a dead quiet input does not trigger on hiss
+const float VAD_MIN_DB = -55.0f;
+
+//How fast the noise floor follows a rising background, and the slower rate while the gate is open
+//so a background that starts loud or gets louder cannot hold the gate open for good
+const float VAD_FLOOR_RISE_DB_PER_SECOND = 3.0f;
+const float VAD_FLOOR_RISE_OPEN_DB_PER_SECOND = 1.0f;
+
+//Samples and rounds for the sample conversion benchmark
+const int CONVERT_BENCH_SAMPLES = 1 << 16;
+const int CONVERT_BENCH_ROUNDS = 2000;
+
+//Synthetic capture tone, its level and the on/off period of the bursts generator
+const float SYNTHETIC_TONE_HZ = 440.0f;
+const float SYNTHETIC_TONE_LEVEL = 0.5f;
+const float SYNTHETIC_NOISE_LEVEL = 0.001f;
+const int SYNTHETIC_BURST_MS = 1000;
+
+//Frames the encoder thread takes out of the capture ring at a time
+const int ENCODE_CHUNK_FRAMES = 4096;
+
+//Opus bitrate
+const int OPUS_BIT_RATE = 128000;
+
+//Device buffer sizes for recording and for live monitoring
+const Uint16 RECORDING_BUFFER_SAMPLES = 4096;
+const Uint16 MONITOR_BUFFER_SAMPLES = 256;
 
-//Maximum recording time plus padding
-const int RECORDING_BUFFER_SECONDS = MAX_RECORDING_SECONDS + 1;
+//Drift controller gains and the most it may bend the monitor clock
+const double MONITOR_DRIFT_KP = 0.002;
+const double MONITOR_DRIFT_KI = 0.0000005;
+const double MONITOR_MAX_RATIO_OFFSET = 0.005;
+
+//Buffer sizes the loopback latency test steps through
+const Uint16 LATENCY_TEST_SIZES[] = { 64, 128, 256, 512, 1024, 2048, 4096 };
+const int LATENCY_TEST_SIZE_COUNT = sizeof( LATENCY_TEST_SIZES ) / sizeof( LATENCY_TEST_SIZES[ 0 ] );
+const int LATENCY_TEST_TRIALS = 3;
+
+//Settle time before each impulse and how long to wait for it to come back
+const Uint32 LATENCY_SETTLE_MS = 300;
+const Uint32 LATENCY_TIMEOUT_MS = 1000;
+
+//Captured level that counts as the impulse arriving
+const float LATENCY_THRESHOLD = 0.25f;
 
 //The various recording actions we can take
 enum RecordingState
@@ -30,9 +170,36 @@ enum RecordingState
 	RECORDING,
 	RECORDED,
 	PLAYBACK,
+	MONITORING,
+	MEASURING_LATENCY,
+	MULTITRACK_RECORDING,
 	ERROR
 };
 
+//How recordings are stored
+enum StorageFormat
+{
+	STORAGE_WAV,
+	STORAGE_FLAC,
+	STORAGE_OPUS
+};
+
+//How samples are kept in the rings, the store and WAV files
+enum SampleFormat
+{
+	SAMPLE_F32,
+	SAMPLE_S16,
+	SAMPLE_S24
+};
+
+//What the audio callbacks are doing
+enum AudioMode
+{
+	AUDIO_MODE_RECORD,
+	AUDIO_MODE_MONITOR,
+	AUDIO_MODE_LATENCY
+};
+
 //Texture wrapper class
 class LTexture
 {
@@ -79,367 +246,4438 @@ class LTexture
 		int mHeight;
 };
 
-//Starts up SDL and creates window
-bool init();
+//Pre-faulted, locked, page aligned chunks of DISK_CHUNK_BYTES, used by one thread at a time
+class LChunkPool
+{
+	public:
+		//Initializes variables
+		LChunkPool();
 
-//Loads media
-bool loadMedia();
+		//Unmaps everything
+		~LChunkPool();
 
-//Frees media and shuts down SDL
-void close();
+		//Maps chunks ahead of time
+		bool reserve( int chunks );
 
-//Recording/playback callbacks
-void audioRecordingCallback( void* userdata, Uint8* stream, int len );
-void audioPlaybackCallback( void* userdata, Uint8* stream, int len );
+		//Takes a chunk, growing the pool when none are free, NULL when out of memory
+		Uint8* acquire();
 
-//The window we'll be rendering to
-SDL_Window* gWindow = NULL;
+		//Returns a chunk as is, nothing is cleared
+		void release( Uint8* chunk );
 
-//The window renderer
-SDL_Renderer* gRenderer = NULL;
+		//Unmaps everything, all chunks must be released
+		void free();
 
-//Globally used font
-TTF_Font* gFont = NULL;
-SDL_Color gTextColor = { 0, 0, 0, 0xFF };
+		//Gets chunk counts
+		int getChunkCount();
+		int getFreeCount();
 
-//Prompt texture
-LTexture gPromptTexture;
+	private:
+		//Maps a slab of chunks, faults it in and locks it
+		bool grow( int chunks );
 
-//The text textures that specify recording device names
-LTexture gDeviceTextures[ MAX_RECORDING_DEVICES ];
+		//Mapped slabs and their sizes
+		std::vector<void*> mSlabs;
+		std::vector<size_t> mSlabBytes;
 
-//Number of available devices
-int gRecordingDeviceCount = 0;
+		//Chunks ready to hand out, most recently used last
+		std::vector<Uint8*> mFree;
 
-//Recieved audio spec
-SDL_AudioSpec gReceivedRecordingSpec;
-SDL_AudioSpec gReceivedPlaybackSpec;
+		//Whether locking failed, so it is only reported once
+		bool mLockFailed;
+};
+
+//The part of a recording not yet on disk, as a list of pool chunks
+class LRecordingStore
+{
+	public:
+		//Initializes variables
+		LRecordingStore();
 
-//Recording data buffer
-Uint8* gRecordingBuffer = NULL;
+		//Gets free space at the end, taking a new chunk once the last is full
+		Uint8* getWriteSpace( Uint32& len );
 
-//Size of data buffer
-Uint32 gBufferByteSize = 0;
+		//Marks bytes at the end as written
+		void commit( Uint32 len );
 
-//Position in data buffer
-Uint32 gBufferBytePosition = 0;
+		//Gets a whole chunk by its index from the start of the recording, it must not be retired
+		Uint8* getChunk( int index );
 
-//Maximum position in data buffer for recording
-Uint32 gBufferByteMaxPosition = 0;
+		//Hands every chunk wholly before offset back to the pool, once it is on disk
+		void retire( Uint64 offset );
 
-LTexture::LTexture()
+		//Hands every chunk back to the pool without clearing
+		void clear();
+
+		//Gets bytes stored since the start of the recording and chunks still held
+		Uint64 getSize();
+		int getChunkCount();
+
+	private:
+		//Chunks held, the first is chunk mFirstChunk of the recording
+		std::vector<Uint8*> mChunks;
+		int mFirstChunk;
+		Uint64 mSize;
+};
+
+//Text drawn from glyphs rasterized once into a shared texture
+class LGlyphAtlas
 {
-	//Initialize
-	mTexture = NULL;
-	mWidth = 0;
-	mHeight = 0;
-}
+	public:
+		//Initializes variables
+		LGlyphAtlas();
 
-LTexture::~LTexture()
+		//Deallocates texture
+		~LGlyphAtlas();
+
+		//Creates the atlas for a font and rasterizes printable ASCII up front
+		bool load( TTF_Font* font );
+
+		//Deallocates texture
+		void free();
+
+		//Queues a UTF-8 string with its top left at x, y
+		void render( const std::string& text, int x, int y, SDL_Color color );
+
+		//Draws everything queued in one call
+		void flush();
+
+		//Gets width of a UTF-8 string and the line height
+		int measure( const std::string& text );
+		int getLineHeight();
+
+	private:
+		//Where a glyph sits in the atlas and how far it moves the pen
+		struct Glyph
+		{
+			SDL_Rect source;
+			int advance;
+			bool loaded;
+		};
+
+		//Finds a glyph, rasterizing it on first use
+		Glyph* findGlyph( Uint32 codepoint );
+
+		//Rasterizes a glyph and packs it into the atlas
+		bool rasterize( Uint32 codepoint, Glyph& glyph );
+
+		//Font and atlas
+		TTF_Font* mFont;
+		SDL_Texture* mTexture;
+
+		//ASCII directly, anything else by code point
+		Glyph mAscii[ 128 ];
+		std::map<Uint32, Glyph> mGlyphs;
+
+		//Shelf packing position
+		int mPenX;
+		int mPenY;
+		int mShelfHeight;
+
+		//Quads queued since the last flush
+		std::vector<SDL_Vertex> mVertices;
+		std::vector<int> mIndices;
+};
+
+//Lock-free single producer single consumer byte ring
+class LRingBuffer
 {
-	//Deallocate
-	free();
-}
+	public:
+		//Initializes variables
+		LRingBuffer();
 
-bool LTexture::loadFromFile( std::string path )
+		//Deallocates memory
+		~LRingBuffer();
+
+		//Allocates a ring of at least the given size, rounded up to a power of two
+		bool allocate( Uint32 size );
+
+		//Deallocates ring
+		void free();
+
+		//Empties the ring, only while neither side is running
+		void reset();
+
+		//Copies in as much as fits, returns bytes written
+		Uint32 write( const Uint8* data, Uint32 len );
+
+		//Copies out up to len bytes, returns bytes read
+		Uint32 read( Uint8* data, Uint32 len );
+
+		//Copies out up to len bytes without consuming them
+		Uint32 peek( Uint8* data, Uint32 len );
+
+		//Consumes up to len bytes without copying them
+		Uint32 skip( Uint32 len );
+
+		//Gets fill state
+		Uint32 readAvailable();
+		Uint32 writeAvailable();
+		Uint32 getSize();
+
+	private:
+		//Ring storage
+		Uint8* mBuffer;
+		Uint32 mSize;
+
+		//Monotonic positions, the ring index is position & ( mSize - 1 )
+		std::atomic<Uint64> mWritePosition;
+		std::atomic<Uint64> mReadPosition;
+};
+
+//Linear interpolating F32 resampler pulling from a ring at a variable ratio
+class LDriftResampler
 {
-	//Get rid of preexisting texture
-	free();
+	public:
+		//Initializes variables
+		LDriftResampler();
 
-	//The final texture
-	SDL_Texture* newTexture = NULL;
+		//Deallocates memory
+		~LDriftResampler();
 
-	//Load image at specified path
-	SDL_Surface* loadedSurface = IMG_Load( path.c_str() );
-	if( loadedSurface == NULL )
-	{
-		printf( "Unable to load image %s! SDL_image Error: %s\n", path.c_str(), IMG_GetError() );
-	}
-	else
-	{
-		//Color key image
-		SDL_SetColorKey( loadedSurface, SDL_TRUE, SDL_MapRGB( loadedSurface->format, 0, 0xFF, 0xFF ) );
+		//Allocates for blocks of up to maxOutFrames at ratios up to 1 + maxRatioOffset
+		bool allocate( int channels, Uint32 maxOutFrames, double maxRatioOffset );
 
-		//Create texture from surface pixels
-        newTexture = SDL_CreateTextureFromSurface( gRenderer, loadedSurface );
-		if( newTexture == NULL )
-		{
-			printf( "Unable to create texture from %s! SDL Error: %s\n", path.c_str(), SDL_GetError() );
-		}
-		else
-		{
-			//Get image dimensions
-			mWidth = loadedSurface->w;
-			mHeight = loadedSurface->h;
-		}
+		//Deallocates scratch
+		void free();
 
-		//Get rid of old loaded surface
-		SDL_FreeSurface( loadedSurface );
-	}
+		//Silent history, zero phase and position
+		void reset();
 
-	//Return success
-	mTexture = newTexture;
-	return mTexture != NULL;
-}
+		//Input frames the ring needs to make outFrames at ratio
+		Uint32 framesNeeded( Uint32 outFrames, double ratio );
 
-#if defined(_SDL_TTF_H) || defined(SDL_TTF_H)
-bool LTexture::loadFromRenderedText( std::string textureText, SDL_Color textColor )
+		//Makes up to outFrames at ratio input frames per output frame, returns frames made
+		Uint32 process( LRingBuffer& ring, float* out, Uint32 outFrames, double ratio );
+
+		//Drops input frames without making output
+		Uint32 skip( LRingBuffer& ring, Uint32 frames );
+
+		//Input frame position of the next output frame
+		double getPosition();
+
+	private:
+		//Frame 0 is the last input frame of the previous block, the rest is peeked from the ring
+		float* mScratch;
+		Uint32 mScratchFrames;
+		int mChannels;
+
+		//Fractional read position past the history frame
+		double mPhase;
+
+		//Input frames taken out of the ring so far
+		Uint64 mConsumed;
+};
+
+//One capture device of a multitrack recording
+class LCaptureTrack
 {
-	//Get rid of preexisting texture
-	free();
+	public:
+		//Initializes variables
+		LCaptureTrack();
 
-	//Render text surface
-	SDL_Surface* textSurface = TTF_RenderUTF8_Solid( gFont, textureText.c_str(), textColor );
-	if( textSurface != NULL )
-	{
-		//Create texture from surface pixels
-        mTexture = SDL_CreateTextureFromSurface( gRenderer, textSurface );
-		if( mTexture == NULL )
-		{
-			printf( "Unable to create texture from rendered text! SDL Error: %s\n", SDL_GetError() );
-		}
-		else
-		{
-			//Get image dimensions
-			mWidth = textSurface->w;
-			mHeight = textSurface->h;
-		}
+		//Closes device
+		~LCaptureTrack();
 
-		//Get rid of old surface
-		SDL_FreeSurface( textSurface );
-	}
-	else
-	{
-		printf( "Unable to render text surface! SDL_ttf Error: %s\n", TTF_GetError() );
-	}
+		//Opens the capture device paused, timing is relative to epoch ticks
+		bool open( int index, Uint64 epoch );
 
-	
-	//Return success
-	return mTexture != NULL;
-}
-#endif
+		//Closes device and frees rings
+		void close();
 
-void LTexture::free()
+		//Starts and stops the device
+		void start();
+		void stop();
+
+		//Folds queued callback timestamps into the clock fit
+		void updateClock();
+
+		//Host time in seconds when the given input frame was captured
+		double getTime( double frame );
+
+		//Device frames per host second
+		double getRate();
+
+		//Device name, ring and resampler for the writer
+		const char* getName();
+		LRingBuffer& getRing();
+		LDriftResampler& getResampler();
+
+		//Whether the first block has arrived, and its capture start time
+		bool hasStarted();
+		double getStartTime();
+
+		//Blocks dropped because the ring was full
+		int getDroppedBlocks();
+
+		//Recording callback, userdata is the track
+		static void audioCallback( void* userdata, Uint8* stream, int len );
+
+	private:
+		//Queues the block and when it arrived
+		void capture( Uint8* stream, int len );
+
+		//Device
+		SDL_AudioDeviceID mDeviceId;
+		SDL_AudioSpec mSpec;
+		std::string mName;
+
+		//Audio and timestamps from the callback
+		LRingBuffer mRing;
+		LRingBuffer mTimestamps;
+		Uint64 mEpoch;
+		Uint64 mFramesQueued;
+		SDL_atomic_t mDroppedBlocks;
+
+		//Running least squares fit of capture time against frame position
+		double mFitCount;
+		double mMeanFrame;
+		double mMeanTime;
+		double mFrameVariance;
+		double mCovariance;
+		double mStartTime;
+
+		//Pulls aligned output out of the ring
+		LDriftResampler mResampler;
+};
+
+//Levels of one stream as the UI shows them, linear amplitude
+struct LevelReading
 {
-	//Free texture if it exists
-	if( mTexture != NULL )
-	{
-		SDL_DestroyTexture( mTexture );
-		mTexture = NULL;
-		mWidth = 0;
-		mHeight = 0;
+	float peak[ METER_CHANNELS ];
+	float rms[ METER_CHANNELS ];
+	float truePeak[ METER_CHANNELS ];
+
+	//Time spent metering and the audio time it covered, for the overhead figure
+	Uint64 meterTicks;
+	Uint64 meteredFrames;
+};
+
+//Wait-free hand-off of the latest reading from one writer to one reader
+class LTripleBuffer
+{
+	public:
+		//Initializes variables
+		LTripleBuffer();
+
+		//Slot the writer fills
+		LevelReading* getBack();
+
+		//Swaps the filled back slot in as the newest reading
+		void publish();
+
+		//Takes the newest reading if there is one, returns whether it changed
+		bool update();
+
+		//Slot the reader owns
+		const LevelReading& getFront();
+
+	private:
+		//Set on the middle index when the writer published since the last update
+		static const Uint32 FRESH = 4;
+
+		LevelReading mSlots[ 3 ];
+		Uint32 mBack;
+		Uint32 mFront;
+		std::atomic<Uint32> mMiddle;
+};
+
+//Peak, RMS and true peak of interleaved stereo F32, measured in the callback
+class LLevelMeter
+{
+	public:
+		//Initializes variables
+		LLevelMeter();
+
+		//Resets levels and sets ballistics for the stream's rate, only while the device is paused
+		void setup( int freq );
+
+		//Measures a block and publishes the levels
+		void process( const float* samples, Uint32 frames );
+
+		//Newest levels for the render loop
+		const LevelReading& getLevels();
+
+	private:
+		//Measures up to METER_CHUNK_FRAMES frames
+		void processChunk( const float* samples, Uint32 frames, float* peak, float* sumSquares, float* truePeak );
+
+		//Interpolation filter, one group of the four phases per tap
+		alignas(16) float mCoefficients[ TRUE_PEAK_TAPS ][ TRUE_PEAK_PHASES ];
+
+		//Each channel's previous taps followed by the chunk being measured
+		alignas(16) float mChannel[ METER_CHANNELS ][ TRUE_PEAK_TAPS + METER_CHUNK_FRAMES ];
+
+		//Levels with ballistics applied
+		float mPeak[ METER_CHANNELS ];
+		float mMeanSquare[ METER_CHANNELS ];
+		float mTruePeak[ METER_CHANNELS ];
+
+		//Decay factors for the last block size
+		int mFreq;
+		Uint32 mDecayFrames;
+		float mPeakDecay;
+		float mRmsDecay;
+
+		//Overhead accounting
+		Uint64 mMeterTicks;
+		Uint64 mMeteredFrames;
+
+		//Hand-off to the render loop
+		LTripleBuffer mReadings;
+};
+
+//Converts F32 device audio to and from the storage sample format, optionally with TPDF dither
+class LSampleConverter
+{
+	public:
+		//Initializes variables
+		LSampleConverter();
+
+		//Sets the storage format and whether to dither
+		void setup( SampleFormat format, bool dither );
+
+		//Converts float samples to the storage format
+		void fromFloat( const float* in, Uint8* out, Uint32 count );
+
+		//Expands stored samples back to float
+		void toFloat( const Uint8* in, float* out, Uint32 count );
+
+		//Gets the storage format and its size
+		SampleFormat getFormat();
+		Uint32 getSampleBytes();
+
+	private:
+		//Next dither value, in LSBs
+		float nextDither();
+
+		SampleFormat mFormat;
+		bool mDither;
+
+		//Four xorshift generators, one per vector lane
+		alignas(16) Uint32 mState[ 4 ];
+};
+
+//Drives the recording callback from a WAV file or a generator on its own clock, for runs without a microphone
+class LSyntheticSource
+{
+	public:
+		//Initializes variables
+		LSyntheticSource();
+
+		//Stops the clock and frees the audio
+		~LSyntheticSource();
+
+		//Loads a WAV file converted to the spec, or sets up the "sine" or "bursts" generator
+		bool open( std::string source, const SDL_AudioSpec& spec );
+
+		//Starts calling the callback, speed is a multiple of real time and 0 runs flat out
+		bool start( double speed, Uint64 frames );
+
+		//Waits for the clock thread to finish
+		void stop();
+
+		//Gets whether every frame has been delivered
+		bool isDone();
+
+		//Gets what the clock thread measured, only once it has stopped
+		Uint64 getBlocks();
+		Uint64 getCallbackTicks();
+		Uint64 getMaxCallbackTicks();
+		Uint64 getElapsedTicks();
+		Uint32 getPeakRingFill();
+
+	private:
+		//Clock thread entry point
+		static int clockThread( void* data );
+
+		//Fills the next block of the source
+		void fill( float* block, Uint32 frames );
+
+		//What is being played in, F32 in the spec's layout
+		SDL_AudioSpec mSpec;
+		std::vector<float> mFile;
+		std::string mGenerator;
+
+		//Position in the file or generator, in frames
+		Uint64 mPosition;
+
+		//Clock settings
+		double mSpeed;
+		Uint64 mFrames;
+		SDL_Thread* mThread;
+		SDL_atomic_t mStop;
+		SDL_atomic_t mDone;
+
+		//Measurements
+		Uint64 mBlocks;
+		Uint64 mCallbackTicks;
+		Uint64 mMaxCallbackTicks;
+		Uint64 mElapsedTicks;
+		Uint32 mPeakRingFill;
+};
+
+//Passes audio on only while someone is talking, keeping a little from before they started
+class LVoiceGate
+{
+	public:
+		//Initializes variables
+		LVoiceGate();
+
+		//Deallocates memory
+		~LVoiceGate();
+
+		//Allocates the pre-roll for the stream stored at the given sample size, only while the device is paused
+		bool allocate( const SDL_AudioSpec& spec, Uint32 sampleBytes );
+
+		//Deallocates pre-roll
+		void free();
+
+		//Starts over listening, only while the device is paused
+		void reset();
+
+		//Measures a block and hands its stored form, along with the pre-roll when speech starts, to the ring.
+		//Returns false if the ring could not take it
+		bool process( const float* samples, const Uint8* stream, Uint32 len, LRingBuffer& out );
+
+		//Gets whether speech is being passed on
+		bool isOpen();
+
+	private:
+		//Block level in dB relative to full scale
+		float measure( const float* samples, Uint32 count );
+
+		//Audio from just before speech starts, oldest bytes are dropped to make room
+		LRingBuffer mPreRoll;
+		Uint32 mPreRollBytes;
+
+		//Background level
+		float mFloorDb;
+
+		//Frames of quiet left before the gate closes
+		Uint32 mHangoverFrames;
+		Uint32 mHangoverLeft;
+
+		//Stream layout
+		Uint32 mFrameBytes;
+		int mChannels;
+		int mFreq;
+
+		//Read by the render loop
+		SDL_atomic_t mOpen;
+};
+
+//Compresses interleaved F32 audio and muxes it into a file
+class LStreamEncoder
+{
+	public:
+		//Initializes variables
+		LStreamEncoder();
+
+		//Finishes the file
+		~LStreamEncoder();
+
+		//Creates the file and encoder for audio in the given spec
+		bool open( const char* path, AVCodecID codecId, const SDL_AudioSpec& spec );
+
+		//Encodes interleaved F32 frames
+		bool encode( const float* samples, int frames );
+
+		//Flushes the encoder and finishes the file
+		void close();
+
+		//Gets size of the finished file
+		Uint64 getFileBytes();
+
+	private:
+		//Sends a frame to the encoder and writes out the packets, NULL flushes
+		bool encodeFrame( AVFrame* frame );
+
+		//Encodes frames out of the FIFO
+		bool encodeFifo( int frames );
+
+		//Output file and encoder
+		AVFormatContext* mFormat;
+		AVCodecContext* mCodec;
+		AVStream* mStream;
+
+		//Converts to the encoder's format and rate
+		SwrContext* mResampler;
+		Uint8** mConverted;
+		int mConvertedCapacity;
+
+		//Collects converted audio into encoder sized frames
+		AVAudioFifo* mFifo;
+		AVFrame* mFrame;
+		int mFrameSize;
+
+		//Presentation time of the next frame in samples
+		Sint64 mNextPts;
+
+		//Size of the finished file
+		Uint64 mFileBytes;
+};
+
+//Starts up SDL and creates window
+bool init();
+
+//Loads media
+bool loadMedia();
+
+//Frees media and shuts down SDL
+void close();
+
+//Opens the capture device and the default playback device with the given buffer size
+bool openAudioDevices( int index, Uint16 samples );
+
+//Registers what the stats export publishes and starts it when STATS_EXPORT is set
+void startStats();
+
+//Sizes rings, conversion, meters and the monitor for the received specs
+bool allocateStreams();
+
+//Closes both audio devices
+void closeAudioDevices();
+
+//Live monitoring through the monitor ring
+bool startMonitoring();
+bool stopMonitoring();
+
+//Loopback round trip test, returns false once every buffer size is done
+bool startLatencyTest();
+bool updateLatencyTest();
+
+//Draws the input and output meters
+void renderMeters();
+
+//Times the meter on small blocks and prints its share of the callback budget
+void benchmarkMeters();
+
+//Times each sample conversion and prints samples per nanosecond
+void benchmarkConversion();
+
+//Records from the synthetic source with no window and reports on the capture path
+int runHeadless();
+
+//Parses storage options, returns false on bad arguments
+bool parseArguments( int argc, char* args[] );
+
+//Records every capture device at once into one multitrack file
+bool startMultitrackCapture();
+void stopMultitrackCapture();
+
+//Disk streaming threads
+bool startCaptureWriter();
+void stopCaptureWriter();
+bool startPlaybackReader();
+void stopPlaybackReader();
+
+//Recording/playback callbacks
+void audioRecordingCallback( void* userdata, Uint8* stream, int len );
+void audioPlaybackCallback( void* userdata, Uint8* stream, int len );
+
+//The window we'll be rendering to
+SDL_Window* gWindow = NULL;
+
+//The window renderer
+SDL_Renderer* gRenderer = NULL;
+
+//Globally used font
+TTF_Font* gFont = NULL;
+SDL_Color gTextColor = { 0, 0, 0, 0xFF };
+
+//Text renderer
+LGlyphAtlas gTextAtlas;
+
+//Prompt at the top of the screen
+std::string gPromptText;
+
+//The recording device names
+std::string gDeviceNames[ MAX_RECORDING_DEVICES ];
+
+//Time spent drawing text, for the per frame figure
+Uint64 gTextTicks = 0;
+Uint64 gTextFrames = 0;
+
+//Number of available devices
+int gRecordingDeviceCount = 0;
+
+//Recieved audio spec
+SDL_AudioSpec gReceivedRecordingSpec;
+SDL_AudioSpec gReceivedPlaybackSpec;
+
+//Ring the recording callback fills and the writer thread drains
+LRingBuffer gCaptureRing;
+
+//Ring the reader thread fills and the playback callback drains
+LRingBuffer gPlaybackRing;
+
+//Background disk threads
+SDL_Thread* gWriterThread = NULL;
+SDL_Thread* gReaderThread = NULL;
+
+//Tells the disk threads to finish up
+SDL_atomic_t gStopWriter;
+SDL_atomic_t gStopReader;
+
+//Set by the reader thread once the whole file is in the playback ring
+SDL_atomic_t gPlaybackFileDone;
+
+//Bytes a callback could not fit into or take out of its ring
+SDL_atomic_t gDroppedBytes;
+
+//Device blocks the recording callback saw and could not queue
+SDL_atomic_t gCapturedBlocks;
+SDL_atomic_t gDroppedBlocks;
+
+//Devices of the multitrack recording, track 0 is the clock reference
+LCaptureTrack gTracks[ MAX_RECORDING_DEVICES ];
+int gTrackCount = 0;
+
+//Multitrack writer
+SDL_Thread* gMultitrackThread = NULL;
+SDL_atomic_t gStopMultitrack;
+
+//Levels of what the recording device captures and the playback device plays
+LLevelMeter gInputMeter;
+LLevelMeter gOutputMeter;
+
+//Records only while someone is talking when enabled
+LVoiceGate gVoiceGate;
+bool gVoiceActivated = false;
+
+//Speech segments and device blocks kept by the gate
+SDL_atomic_t gVoiceSegments;
+SDL_atomic_t gVoiceBlocks;
+
+//Run the metering benchmark instead of the app
+bool gBenchmarkMeters = false;
+
+//Record from a synthetic source without a window for this many seconds of audio, at a multiple of real time
+double gHeadlessSeconds = 0;
+double gHeadlessSpeed = 1.0;
+std::string gSyntheticSource = "sine";
+
+//Storage sample format and dither, and whether to benchmark conversion instead of running the app
+SampleFormat gSampleFormat = SAMPLE_F32;
+bool gDither = false;
+bool gBenchmarkConversion = false;
+
+//Conversion in the callbacks, each only touched by its own callback
+LSampleConverter gCaptureConverter;
+LSampleConverter gPlaybackConverter;
+Uint8* gCaptureScratch = NULL;
+Uint8* gPlaybackScratch = NULL;
+
+//How recordings are stored and where
+StorageFormat gStorageFormat = STORAGE_WAV;
+const char* gRecordingFile = RECORDING_FILE;
+
+//Size of the last recording on disk
+Uint64 gRecordingFileBytes = 0;
+
+//Simulated encoder stall per second of audio, to show capture never waits on it
+int gEncoderStallMs = 0;
+
+//Audio bytes in the last recording
+Uint64 gRecordedBytes = 0;
+
+//Chunk pool and the last WAV recording held in it
+LChunkPool gChunkPool;
+LRecordingStore gRecordingStore;
+
+//Audio device IDs
+SDL_AudioDeviceID gRecordingDeviceId = 0;
+SDL_AudioDeviceID gPlaybackDeviceId = 0;
+
+//Capture device the user picked
+int gRecordingDeviceIndex = 0;
+
+//Current AudioMode of both callbacks
+SDL_atomic_t gAudioMode;
+
+//Ring from the capture callback straight to the playback callback
+LRingBuffer gMonitorRing;
+
+//Monitor fill level the drift controller aims for, in frames
+Uint32 gMonitorTargetFrames = 0;
+
+//Monitor resampler state, only touched by the playback callback
+bool gMonitorPrimed = false;
+double gMonitorRatio = 1.0;
+double gMonitorIntegral = 0.0;
+LDriftResampler gMonitorResampler;
+
+//Monitor health published to the main thread
+SDL_atomic_t gMonitorDriftPpm;
+SDL_atomic_t gMonitorUnderruns;
+SDL_atomic_t gMonitorOverruns;
+
+//Impulse handshake for the latency test
+SDL_atomic_t gImpulseRequested;
+std::atomic<Uint64> gImpulseEmitTicks;
+std::atomic<Uint64> gImpulseDetectTicks;
+
+//Latency test progress, main thread only
+int gLatencySizeIndex = 0;
+int gLatencyTrial = 0;
+bool gLatencyPending = false;
+Uint32 gLatencyPhaseStart = 0;
+double gLatencyResults[ LATENCY_TEST_TRIALS ];
+int gLatencyHits = 0;
+
+//Deadline profiles of the recording and playback callbacks, restarted with the devices
+callbackProfiler gRecordingProfiler;
+callbackProfiler gPlaybackProfiler;
+
+//Stats served as JSON, see statsregistry.h
+StatsRegistry gStats( "testaudiorecording" );
+
+//Bytes the writer and encoder threads have taken out of the capture ring
+StatsCounter* gWriterBytes = NULL;
+
+LRingBuffer::LRingBuffer()
+{
+	//Initialize
+	mBuffer = NULL;
+	mSize = 0;
+	mWritePosition = 0;
+	mReadPosition = 0;
+}
+
+LRingBuffer::~LRingBuffer()
+{
+	//Deallocate
+	free();
+}
+
+bool LRingBuffer::allocate( Uint32 size )
+{
+	//Get rid of preexisting ring
+	free();
+
+	//Round up to a power of two so wrapping is a mask
+	mSize = 1;
+	while( mSize < size )
+	{
+		mSize <<= 1;
+	}
+
+	mBuffer = new Uint8[ mSize ];
+	reset();
+	return mBuffer != NULL;
+}
+
+void LRingBuffer::free()
+{
+	if( mBuffer != NULL )
+	{
+		delete[] mBuffer;
+		mBuffer = NULL;
+		mSize = 0;
+	}
+}
+
+void LRingBuffer::reset()
+{
+	mWritePosition.store( 0 );
+	mReadPosition.store( 0 );
+}
+
+Uint32 LRingBuffer::write( const Uint8* data, Uint32 len )
+{
+	Uint64 writePosition = mWritePosition.load( std::memory_order_relaxed );
+	Uint64 readPosition = mReadPosition.load( std::memory_order_acquire );
+
+	//Only copy what fits
+	Uint32 space = mSize - (Uint32)( writePosition - readPosition );
+	if( len > space )
+	{
+		len = space;
+	}
+
+	//Copy up to the end of storage, then wrap
+	Uint32 index = writePosition & ( mSize - 1 );
+	Uint32 first = SDL_min( len, mSize - index );
+	memcpy( &mBuffer[ index ], data, first );
+	memcpy( mBuffer, data + first, len - first );
+
+	mWritePosition.store( writePosition + len, std::memory_order_release );
+	return len;
+}
+
+Uint32 LRingBuffer::read( Uint8* data, Uint32 len )
+{
+	Uint64 readPosition = mReadPosition.load( std::memory_order_relaxed );
+	Uint64 writePosition = mWritePosition.load( std::memory_order_acquire );
+
+	//Only copy what is there
+	Uint32 available = (Uint32)( writePosition - readPosition );
+	if( len > available )
+	{
+		len = available;
+	}
+
+	//Copy up to the end of storage, then wrap
+	Uint32 index = readPosition & ( mSize - 1 );
+	Uint32 first = SDL_min( len, mSize - index );
+	memcpy( data, &mBuffer[ index ], first );
+	memcpy( data + first, mBuffer, len - first );
+
+	mReadPosition.store( readPosition + len, std::memory_order_release );
+	return len;
+}
+
+Uint32 LRingBuffer::peek( Uint8* data, Uint32 len )
+{
+	Uint64 readPosition = mReadPosition.load( std::memory_order_relaxed );
+	Uint64 writePosition = mWritePosition.load( std::memory_order_acquire );
+
+	//Only copy what is there
+	Uint32 available = (Uint32)( writePosition - readPosition );
+	if( len > available )
+	{
+		len = available;
+	}
+
+	//Copy up to the end of storage, then wrap
+	Uint32 index = readPosition & ( mSize - 1 );
+	Uint32 first = SDL_min( len, mSize - index );
+	memcpy( data, &mBuffer[ index ], first );
+	memcpy( data + first, mBuffer, len - first );
+	return len;
+}
+
+Uint32 LRingBuffer::skip( Uint32 len )
+{
+	Uint64 readPosition = mReadPosition.load( std::memory_order_relaxed );
+	Uint32 available = (Uint32)( mWritePosition.load( std::memory_order_acquire ) - readPosition );
+	if( len > available )
+	{
+		len = available;
+	}
+	mReadPosition.store( readPosition + len, std::memory_order_release );
+	return len;
+}
+
+Uint32 LRingBuffer::readAvailable()
+{
+	return (Uint32)( mWritePosition.load( std::memory_order_acquire ) - mReadPosition.load( std::memory_order_acquire ) );
+}
+
+Uint32 LRingBuffer::writeAvailable()
+{
+	return mSize - readAvailable();
+}
+
+Uint32 LRingBuffer::getSize()
+{
+	return mSize;
+}
+
+LDriftResampler::LDriftResampler()
+{
+	//Initialize
+	mScratch = NULL;
+	mScratchFrames = 0;
+	mChannels = 0;
+	mPhase = 0.0;
+	mConsumed = 0;
+}
+
+LDriftResampler::~LDriftResampler()
+{
+	//Deallocate
+	free();
+}
+
+bool LDriftResampler::allocate( int channels, Uint32 maxOutFrames, double maxRatioOffset )
+{
+	//Get rid of preexisting scratch
+	free();
+
+	//One block at the highest ratio plus history and rounding
+	mChannels = channels;
+	mScratchFrames = (Uint32)( maxOutFrames * ( 1 + maxRatioOffset * 2 ) ) + 4;
+	mScratch = new float[ mScratchFrames * channels ];
+	reset();
+	return true;
+}
+
+void LDriftResampler::free()
+{
+	delete[] mScratch;
+	mScratch = NULL;
+	mScratchFrames = 0;
+}
+
+void LDriftResampler::reset()
+{
+	memset( mScratch, 0, mChannels * sizeof( float ) );
+	mPhase = 0.0;
+	mConsumed = 0;
+}
+
+Uint32 LDriftResampler::framesNeeded( Uint32 outFrames, double ratio )
+{
+	return (Uint32)( mPhase + outFrames * ratio ) + 1;
+}
+
+Uint32 LDriftResampler::process( LRingBuffer& ring, float* out, Uint32 outFrames, double ratio )
+{
+	int channels = mChannels;
+	Uint32 frameBytes = channels * sizeof( float );
+	float* in = mScratch;
+
+	//Peek what this block needs in after the history frame
+	Uint32 needed = SDL_min( framesNeeded( outFrames, ratio ), SDL_min( ring.readAvailable() / frameBytes, mScratchFrames - 1 ) );
+	Uint32 inFrames = 1 + ring.peek( (Uint8*)( in + channels ), needed * frameBytes ) / frameBytes;
+
+	//Linear interpolation at the fractional read position
+	double position = mPhase;
+	Uint32 i;
+	for( i = 0; i < outFrames; ++i )
+	{
+		Uint32 index = (Uint32)position;
+		if( index + 1 >= inFrames )
+		{
+			break;
+		}
+		float frac = (float)( position - index );
+		for( int c = 0; c < channels; ++c )
+		{
+			float a = in[ index * channels + c ];
+			float b = in[ ( index + 1 ) * channels + c ];
+			out[ i * channels + c ] = a + ( b - a ) * frac;
+		}
+		position += ratio;
+	}
+
+	//Consume the frames stepped past, the last one becomes history
+	Uint32 consumed = SDL_min( (Uint32)position, inFrames - 1 );
+	memmove( in, &in[ consumed * channels ], frameBytes );
+	mPhase = position - consumed;
+	ring.skip( consumed * frameBytes );
+	mConsumed += consumed;
+	return i;
+}
+
+Uint32 LDriftResampler::skip( LRingBuffer& ring, Uint32 frames )
+{
+	Uint32 frameBytes = mChannels * sizeof( float );
+	Uint32 skipped = ring.skip( frames * frameBytes ) / frameBytes;
+	mConsumed += skipped;
+	return skipped;
+}
+
+double LDriftResampler::getPosition()
+{
+	//Frame 0 of the scratch is one behind what was consumed
+	return (double)mConsumed - 1.0 + mPhase;
+}
+
+LTripleBuffer::LTripleBuffer()
+{
+	//Initialize
+	memset( mSlots, 0, sizeof( mSlots ) );
+	mBack = 0;
+	mMiddle = 1;
+	mFront = 2;
+}
+
+LevelReading* LTripleBuffer::getBack()
+{
+	return &mSlots[ mBack ];
+}
+
+void LTripleBuffer::publish()
+{
+	mBack = mMiddle.exchange( mBack | FRESH, std::memory_order_acq_rel ) & 3;
+}
+
+bool LTripleBuffer::update()
+{
+	if( !( mMiddle.load( std::memory_order_relaxed ) & FRESH ) )
+	{
+		return false;
+	}
+	mFront = mMiddle.exchange( mFront, std::memory_order_acq_rel ) & 3;
+	return true;
+}
+
+const LevelReading& LTripleBuffer::getFront()
+{
+	return mSlots[ mFront ];
+}
+
+LLevelMeter::LLevelMeter()
+{
+	//Initialize
+	memset( mCoefficients, 0, sizeof( mCoefficients ) );
+	setup( 44100 );
+}
+
+void LLevelMeter::setup( int freq )
+{
+	//Blackman windowed sinc at the original Nyquist, split into phases and
+	//normalized so each phase passes DC at unity
+	const int length = TRUE_PEAK_TAPS * TRUE_PEAK_PHASES;
+	for( int p = 0; p < TRUE_PEAK_PHASES; ++p )
+	{
+		float sum = 0;
+		for( int t = 0; t < TRUE_PEAK_TAPS; ++t )
+		{
+			int k = t * TRUE_PEAK_PHASES + p;
+			double x = ( k - ( length - 1 ) / 2.0 ) / TRUE_PEAK_PHASES;
+			double sinc = x == 0 ? 1.0 : sin( M_PI * x ) / ( M_PI * x );
+			double window = 0.42 - 0.5 * cos( 2 * M_PI * k / ( length - 1 ) ) + 0.08 * cos( 4 * M_PI * k / ( length - 1 ) );
+			mCoefficients[ t ][ p ] = (float)( sinc * window );
+			sum += mCoefficients[ t ][ p ];
+		}
+		for( int t = 0; t < TRUE_PEAK_TAPS; ++t )
+		{
+			mCoefficients[ t ][ p ] /= sum;
+		}
+	}
+
+	//Silent history and levels
+	memset( mChannel, 0, sizeof( mChannel ) );
+	for( int c = 0; c < METER_CHANNELS; ++c )
+	{
+		mPeak[ c ] = 0;
+		mMeanSquare[ c ] = 0;
+		mTruePeak[ c ] = 0;
+	}
+	mFreq = freq;
+	mDecayFrames = 0;
+	mPeakDecay = 0;
+	mRmsDecay = 0;
+	mMeterTicks = 0;
+	mMeteredFrames = 0;
+}
+
+void LLevelMeter::processChunk( const float* samples, Uint32 frames, float* peak, float* sumSquares, float* truePeak )
+{
+	Uint32 i = 0;
+
+	//Sample peak and sum of squares, two stereo frames per vector
+#if defined(__SSE__)
+	const __m128 signMask = _mm_set1_ps( -0.0f );
+	__m128 vpeak = _mm_setzero_ps();
+	__m128 vsum = _mm_setzero_ps();
+	for( ; i + 2 <= frames; i += 2 )
+	{
+		__m128 x = _mm_loadu_ps( &samples[ i * 2 ] );
+		vpeak = _mm_max_ps( vpeak, _mm_andnot_ps( signMask, x ) );
+		vsum = _mm_add_ps( vsum, _mm_mul_ps( x, x ) );
+	}
+	alignas(16) float lanes[ 8 ];
+	_mm_store_ps( lanes, vpeak );
+	_mm_store_ps( lanes + 4, vsum );
+	for( int c = 0; c < METER_CHANNELS; ++c )
+	{
+		peak[ c ] = SDL_max( peak[ c ], SDL_max( lanes[ c ], lanes[ c + 2 ] ) );
+		sumSquares[ c ] += lanes[ 4 + c ] + lanes[ 6 + c ];
+	}
+#endif
+	for( ; i < frames; ++i )
+	{
+		for( int c = 0; c < METER_CHANNELS; ++c )
+		{
+			float x = samples[ i * 2 + c ];
+			peak[ c ] = SDL_max( peak[ c ], fabsf( x ) );
+			sumSquares[ c ] += x * x;
+		}
+	}
+
+	//True peak, every input sample yields all four oversampled phases at once
+	for( int c = 0; c < METER_CHANNELS; ++c )
+	{
+		float* channel = mChannel[ c ];
+		float* in = channel + TRUE_PEAK_TAPS;
+		for( i = 0; i < frames; ++i )
+		{
+			in[ i ] = samples[ i * 2 + c ];
+		}
+
+#if defined(__SSE__)
+		__m128 coefficients[ TRUE_PEAK_TAPS ];
+		for( int t = 0; t < TRUE_PEAK_TAPS; ++t )
+		{
+			coefficients[ t ] = _mm_load_ps( mCoefficients[ t ] );
+		}
+		__m128 vtrue = _mm_setzero_ps();
+		for( i = 0; i < frames; ++i )
+		{
+			__m128 acc = _mm_setzero_ps();
+			for( int t = 0; t < TRUE_PEAK_TAPS; ++t )
+			{
+				acc = _mm_add_ps( acc, _mm_mul_ps( coefficients[ t ], _mm_set1_ps( in[ (int)i - t ] ) ) );
+			}
+			vtrue = _mm_max_ps( vtrue, _mm_andnot_ps( signMask, acc ) );
+		}
+		_mm_store_ps( lanes, vtrue );
+		truePeak[ c ] = SDL_max( truePeak[ c ], SDL_max( SDL_max( lanes[ 0 ], lanes[ 1 ] ), SDL_max( lanes[ 2 ], lanes[ 3 ] ) ) );
+#else
+		for( i = 0; i < frames; ++i )
+		{
+			for( int p = 0; p < TRUE_PEAK_PHASES; ++p )
+			{
+				float acc = 0;
+				for( int t = 0; t < TRUE_PEAK_TAPS; ++t )
+				{
+					acc += mCoefficients[ t ][ p ] * in[ (int)i - t ];
+				}
+				truePeak[ c ] = SDL_max( truePeak[ c ], fabsf( acc ) );
+			}
+		}
+#endif
+
+		//Keep the last taps as history for the next chunk
+		memmove( channel, channel + frames, TRUE_PEAK_TAPS * sizeof( float ) );
+	}
+}
+
+void LLevelMeter::process( const float* samples, Uint32 frames )
+{
+	Uint64 start = SDL_GetPerformanceCounter();
+
+	//Measure the block a chunk at a time
+	float peak[ METER_CHANNELS ] = { 0 };
+	float sumSquares[ METER_CHANNELS ] = { 0 };
+	float truePeak[ METER_CHANNELS ] = { 0 };
+	for( Uint32 done = 0; done < frames; done += METER_CHUNK_FRAMES )
+	{
+		processChunk( samples + done * METER_CHANNELS, SDL_min( frames - done, (Uint32)METER_CHUNK_FRAMES ), peak, sumSquares, truePeak );
+	}
+
+	//Decay factors only change with the block size
+	if( frames != mDecayFrames )
+	{
+		mDecayFrames = frames;
+		mPeakDecay = expf( -(float)frames / ( mFreq * METER_PEAK_RELEASE_SECONDS ) );
+		mRmsDecay = expf( -(float)frames / ( mFreq * METER_RMS_SECONDS ) );
+	}
+
+	//Peaks hold and fall back, RMS is an exponential average of the power
+	LevelReading* reading = mReadings.getBack();
+	for( int c = 0; c < METER_CHANNELS; ++c )
+	{
+		mPeak[ c ] = SDL_max( peak[ c ], mPeak[ c ] * mPeakDecay );
+		mTruePeak[ c ] = SDL_max( truePeak[ c ], mTruePeak[ c ] * mPeakDecay );
+		mMeanSquare[ c ] = mMeanSquare[ c ] * mRmsDecay + ( sumSquares[ c ] / frames ) * ( 1 - mRmsDecay );
+		reading->peak[ c ] = mPeak[ c ];
+		reading->rms[ c ] = sqrtf( mMeanSquare[ c ] );
+		reading->truePeak[ c ] = mTruePeak[ c ];
+	}
+
+	mMeterTicks += SDL_GetPerformanceCounter() - start;
+	mMeteredFrames += frames;
+	reading->meterTicks = mMeterTicks;
+	reading->meteredFrames = mMeteredFrames;
+	mReadings.publish();
+}
+
+const LevelReading& LLevelMeter::getLevels()
+{
+	mReadings.update();
+	return mReadings.getFront();
+}
+
+//When a block arrived and how many frames the ring had been given after it
+struct BlockTimestamp
+{
+	Uint64 ticks;
+	Uint64 frames;
+};
+
+LCaptureTrack::LCaptureTrack()
+{
+	//Initialize
+	mDeviceId = 0;
+	SDL_zero( mSpec );
+	mEpoch = 0;
+	mFramesQueued = 0;
+	SDL_AtomicSet( &mDroppedBlocks, 0 );
+	mFitCount = 0;
+	mMeanFrame = 0;
+	mMeanTime = 0;
+	mFrameVariance = 0;
+	mCovariance = 0;
+	mStartTime = 0;
+}
+
+LCaptureTrack::~LCaptureTrack()
+{
+	//Close device
+	close();
+}
+
+bool LCaptureTrack::open( int index, Uint64 epoch )
+{
+	//Get rid of preexisting device
+	close();
+
+	//Every track in the same format so they interleave directly
+	SDL_AudioSpec desiredSpec;
+	SDL_zero( desiredSpec );
+	desiredSpec.freq = 44100;
+	desiredSpec.format = AUDIO_F32;
+	desiredSpec.channels = 2;
+	desiredSpec.samples = MULTITRACK_BUFFER_SAMPLES;
+	desiredSpec.callback = audioCallback;
+	desiredSpec.userdata = this;
+
+	mName = SDL_GetAudioDeviceName( index, SDL_TRUE );
+	mDeviceId = SDL_OpenAudioDevice( mName.c_str(), SDL_TRUE, &desiredSpec, &mSpec, 0 );
+	if( mDeviceId == 0 )
+	{
+		printf( "Failed to open %s! SDL Error: %s\n", mName.c_str(), SDL_GetError() );
+		return false;
+	}
+
+	//Rings for audio and block timing
+	Uint32 frameBytes = mSpec.channels * sizeof( float );
+	mRing.allocate( RING_BUFFER_SECONDS * mSpec.freq * frameBytes );
+	mTimestamps.allocate( MULTITRACK_TIMESTAMP_ENTRIES * sizeof( BlockTimestamp ) );
+	mResampler.allocate( mSpec.channels, MULTITRACK_CHUNK_FRAMES, MULTITRACK_MAX_RATIO_OFFSET );
+
+	//Start the clock fit over
+	mEpoch = epoch;
+	mFramesQueued = 0;
+	SDL_AtomicSet( &mDroppedBlocks, 0 );
+	mFitCount = 0;
+	mMeanFrame = 0;
+	mMeanTime = 0;
+	mFrameVariance = 0;
+	mCovariance = 0;
+	mStartTime = 0;
+	return true;
+}
+
+void LCaptureTrack::close()
+{
+	if( mDeviceId != 0 )
+	{
+		SDL_CloseAudioDevice( mDeviceId );
+		mDeviceId = 0;
+	}
+	mRing.free();
+	mTimestamps.free();
+	mResampler.free();
+}
+
+void LCaptureTrack::start()
+{
+	SDL_PauseAudioDevice( mDeviceId, SDL_FALSE );
+}
+
+void LCaptureTrack::stop()
+{
+	SDL_PauseAudioDevice( mDeviceId, SDL_TRUE );
+}
+
+void LCaptureTrack::audioCallback( void* userdata, Uint8* stream, int len )
+{
+	( (LCaptureTrack*)userdata )->capture( stream, len );
+}
+
+void LCaptureTrack::capture( Uint8* stream, int len )
+{
+	BlockTimestamp stamp;
+	stamp.ticks = SDL_GetPerformanceCounter();
+
+	//Whole blocks only, like the single device path
+	if( mRing.writeAvailable() < (Uint32)len )
+	{
+		SDL_AtomicAdd( &mDroppedBlocks, 1 );
+		return;
+	}
+	mRing.write( stream, len );
+	mFramesQueued += len / ( mSpec.channels * sizeof( float ) );
+
+	//Timestamp the block, the writer keeps up with these easily
+	stamp.frames = mFramesQueued;
+	if( mTimestamps.writeAvailable() >= sizeof( stamp ) )
+	{
+		mTimestamps.write( (Uint8*)&stamp, sizeof( stamp ) );
+	}
+}
+
+void LCaptureTrack::updateClock()
+{
+	BlockTimestamp stamp;
+	double frequency = (double)SDL_GetPerformanceFrequency();
+	while( mTimestamps.read( (Uint8*)&stamp, sizeof( stamp ) ) == sizeof( stamp ) )
+	{
+		double time = ( stamp.ticks - mEpoch ) / frequency;
+		double frame = (double)stamp.frames;
+
+		//The first block started one block before its callback
+		if( mFitCount == 0 )
+		{
+			mStartTime = time - frame / mSpec.freq;
+		}
+
+		//Welford style update stays exact over hours of frames
+		mFitCount += 1;
+		double frameDelta = frame - mMeanFrame;
+		mMeanFrame += frameDelta / mFitCount;
+		mMeanTime += ( time - mMeanTime ) / mFitCount;
+		mFrameVariance += frameDelta * ( frame - mMeanFrame );
+		mCovariance += frameDelta * ( time - mMeanTime );
+	}
+}
+
+double LCaptureTrack::getRate()
+{
+	//Nominal rate until there is enough history to fit
+	if( mFitCount < 8 || mCovariance <= 0 )
+	{
+		return mSpec.freq;
+	}
+	return mFrameVariance / mCovariance;
+}
+
+double LCaptureTrack::getTime( double frame )
+{
+	if( mFitCount == 0 )
+	{
+		return mStartTime + frame / mSpec.freq;
+	}
+	return mMeanTime + ( frame - mMeanFrame ) / getRate();
+}
+
+const char* LCaptureTrack::getName()
+{
+	return mName.c_str();
+}
+
+LRingBuffer& LCaptureTrack::getRing()
+{
+	return mRing;
+}
+
+LDriftResampler& LCaptureTrack::getResampler()
+{
+	return mResampler;
+}
+
+bool LCaptureTrack::hasStarted()
+{
+	return mFitCount > 0;
+}
+
+double LCaptureTrack::getStartTime()
+{
+	return mStartTime;
+}
+
+int LCaptureTrack::getDroppedBlocks()
+{
+	return SDL_AtomicGet( &mDroppedBlocks );
+}
+
+LStreamEncoder::LStreamEncoder()
+{
+	//Initialize
+	mFormat = NULL;
+	mCodec = NULL;
+	mStream = NULL;
+	mResampler = NULL;
+	mConverted = NULL;
+	mConvertedCapacity = 0;
+	mFifo = NULL;
+	mFrame = NULL;
+	mFrameSize = 0;
+	mNextPts = 0;
+	mFileBytes = 0;
+}
+
+LStreamEncoder::~LStreamEncoder()
+{
+	//Finish file
+	close();
+}
+
+bool LStreamEncoder::open( const char* path, AVCodecID codecId, const SDL_AudioSpec& spec )
+{
+	//Get rid of preexisting file
+	close();
+
+	//Prefer libopus, the native Opus encoder is experimental
+	AVCodec* codec = codecId == AV_CODEC_ID_OPUS ? avcodec_find_encoder_by_name( "libopus" ) : NULL;
+	if( codec == NULL )
+	{
+		codec = avcodec_find_encoder( codecId );
+	}
+	if( codec == NULL )
+	{
+		printf( "No %s encoder available!\n", avcodec_get_name( codecId ) );
+		return false;
+	}
+
+	//Container is picked from the file extension
+	if( avformat_alloc_output_context2( &mFormat, NULL, NULL, path ) < 0 )
+	{
+		printf( "Unable to create %s!\n", path );
+		return false;
+	}
+
+	//Float input if the encoder takes it, otherwise its preferred format
+	mCodec = avcodec_alloc_context3( codec );
+	mCodec->sample_fmt = codec->sample_fmts[ 0 ];
+	for( const AVSampleFormat* format = codec->sample_fmts; *format != AV_SAMPLE_FMT_NONE; ++format )
+	{
+		if( *format == AV_SAMPLE_FMT_FLT )
+		{
+			mCodec->sample_fmt = *format;
+		}
+	}
+
+	//Keep the device rate if allowed, otherwise the highest the encoder does
+	mCodec->sample_rate = spec.freq;
+	if( codec->supported_samplerates != NULL )
+	{
+		int best = 0;
+		for( const int* rate = codec->supported_samplerates; *rate != 0; ++rate )
+		{
+			best = *rate == spec.freq ? *rate : SDL_max( best, *rate );
+			if( best == spec.freq )
+			{
+				break;
+			}
+		}
+		mCodec->sample_rate = best;
+	}
+
+	mCodec->channels = spec.channels;
+	mCodec->channel_layout = av_get_default_channel_layout( spec.channels );
+	mCodec->time_base.num = 1;
+	mCodec->time_base.den = mCodec->sample_rate;
+	if( codecId == AV_CODEC_ID_OPUS )
+	{
+		mCodec->bit_rate = OPUS_BIT_RATE;
+	}
+	if( mFormat->oformat->flags & AVFMT_GLOBALHEADER )
+	{
+		mCodec->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+	}
+	if( avcodec_open2( mCodec, codec, NULL ) < 0 )
+	{
+		printf( "Unable to open %s encoder!\n", codec->name );
+		close();
+		return false;
+	}
+
+	//Set up the stream and write the header
+	mStream = avformat_new_stream( mFormat, NULL );
+	avcodec_parameters_from_context( mStream->codecpar, mCodec );
+	mStream->time_base = mCodec->time_base;
+	if( avio_open( &mFormat->pb, path, AVIO_FLAG_WRITE ) < 0 || avformat_write_header( mFormat, NULL ) < 0 )
+	{
+		printf( "Unable to write %s!\n", path );
+		close();
+		return false;
+	}
+
+	//Converter from the device's interleaved float
+	mResampler = swr_alloc_set_opts( NULL, mCodec->channel_layout, mCodec->sample_fmt, mCodec->sample_rate,
+		av_get_default_channel_layout( spec.channels ), AV_SAMPLE_FMT_FLT, spec.freq, 0, NULL );
+	if( mResampler == NULL || swr_init( mResampler ) < 0 )
+	{
+		close();
+		return false;
+	}
+
+	//Fixed frame size unless the encoder takes anything
+	mFrameSize = mCodec->frame_size;
+	if( mFrameSize == 0 || ( codec->capabilities & AV_CODEC_CAP_VARIABLE_FRAME_SIZE ) )
+	{
+		mFrameSize = ENCODE_CHUNK_FRAMES;
+	}
+	mFifo = av_audio_fifo_alloc( mCodec->sample_fmt, mCodec->channels, mFrameSize * 2 );
+	mFrame = av_frame_alloc();
+	mFrame->nb_samples = mFrameSize;
+	mFrame->format = mCodec->sample_fmt;
+	mFrame->channel_layout = mCodec->channel_layout;
+	mFrame->sample_rate = mCodec->sample_rate;
+	if( mFifo == NULL || av_frame_get_buffer( mFrame, 0 ) < 0 )
+	{
+		close();
+		return false;
+	}
+
+	printf( "Encoding to %s with %s at %d Hz\n", path, codec->name, mCodec->sample_rate );
+	return true;
+}
+
+bool LStreamEncoder::encode( const float* samples, int frames )
+{
+	//Grow the conversion buffer to fit this block
+	int outFrames = swr_get_out_samples( mResampler, frames );
+	if( outFrames > mConvertedCapacity )
+	{
+		if( mConverted != NULL )
+		{
+			av_freep( &mConverted[ 0 ] );
+			av_freep( &mConverted );
+		}
+		if( av_samples_alloc_array_and_samples( &mConverted, NULL, mCodec->channels, outFrames, mCodec->sample_fmt, 0 ) < 0 )
+		{
+			mConvertedCapacity = 0;
+			return false;
+		}
+		mConvertedCapacity = outFrames;
+	}
+
+	//Convert into the FIFO
+	const Uint8* in = (const Uint8*)samples;
+	int converted = swr_convert( mResampler, mConverted, mConvertedCapacity, &in, frames );
+	if( converted < 0 || av_audio_fifo_write( mFifo, (void**)mConverted, converted ) < converted )
+	{
+		return false;
+	}
+
+	//Encode every full frame
+	while( av_audio_fifo_size( mFifo ) >= mFrameSize )
+	{
+		if( !encodeFifo( mFrameSize ) )
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+bool LStreamEncoder::encodeFifo( int frames )
+{
+	if( av_frame_make_writable( mFrame ) < 0 )
+	{
+		return false;
+	}
+	mFrame->nb_samples = av_audio_fifo_read( mFifo, (void**)mFrame->data, frames );
+	mFrame->pts = mNextPts;
+	mNextPts += mFrame->nb_samples;
+	return encodeFrame( mFrame );
+}
+
+bool LStreamEncoder::encodeFrame( AVFrame* frame )
+{
+	if( avcodec_send_frame( mCodec, frame ) < 0 )
+	{
+		return false;
+	}
+
+	//Write out whatever packets the encoder has ready
+	AVPacket packet;
+	av_init_packet( &packet );
+	packet.data = NULL;
+	packet.size = 0;
+	while( avcodec_receive_packet( mCodec, &packet ) == 0 )
+	{
+		av_packet_rescale_ts( &packet, mCodec->time_base, mStream->time_base );
+		packet.stream_index = mStream->index;
+		if( av_interleaved_write_frame( mFormat, &packet ) < 0 )
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+void LStreamEncoder::close()
+{
+	//Flush the resampler, the last partial frame and the encoder, then finish the file
+	if( mFormat != NULL && mFormat->pb != NULL && mFifo != NULL )
+	{
+		int converted;
+		while( mConvertedCapacity > 0 && ( converted = swr_convert( mResampler, mConverted, mConvertedCapacity, NULL, 0 ) ) > 0 )
+		{
+			av_audio_fifo_write( mFifo, (void**)mConverted, converted );
+		}
+		while( av_audio_fifo_size( mFifo ) > 0 && encodeFifo( SDL_min( av_audio_fifo_size( mFifo ), mFrameSize ) ) )
+		{
+		}
+		encodeFrame( NULL );
+		av_write_trailer( mFormat );
+		mFileBytes = avio_tell( mFormat->pb );
+	}
+
+	//Free everything
+	if( mFormat != NULL )
+	{
+		if( mFormat->pb != NULL )
+		{
+			avio_closep( &mFormat->pb );
+		}
+		avformat_free_context( mFormat );
+		mFormat = NULL;
+	}
+	avcodec_free_context( &mCodec );
+	swr_free( &mResampler );
+	if( mConverted != NULL )
+	{
+		av_freep( &mConverted[ 0 ] );
+		av_freep( &mConverted );
+	}
+	mConvertedCapacity = 0;
+	if( mFifo != NULL )
+	{
+		av_audio_fifo_free( mFifo );
+		mFifo = NULL;
+	}
+	av_frame_free( &mFrame );
+	mStream = NULL;
+	mFrameSize = 0;
+	mNextPts = 0;
+}
+
+Uint64 LStreamEncoder::getFileBytes()
+{
+	return mFileBytes;
+}
+
+LChunkPool::LChunkPool()
+{
+	//Initialize
+	mLockFailed = false;
+}
+
+LChunkPool::~LChunkPool()
+{
+	//Unmap
+	free();
+}
+
+bool LChunkPool::reserve( int chunks )
+{
+	return chunks <= getFreeCount() || grow( chunks - getFreeCount() );
+}
+
+bool LChunkPool::grow( int chunks )
+{
+	size_t bytes = (size_t)chunks * DISK_CHUNK_BYTES;
+#if defined(MAP_POPULATE)
+	void* slab = mmap( NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0 );
+#else
+	void* slab = mmap( NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+#endif
+	if( slab == MAP_FAILED )
+	{
+		printf( "Unable to map %d recording chunks! %s\n", chunks, strerror( errno ) );
+		return false;
+	}
+
+#if !defined(MAP_POPULATE)
+	//Touch every page so it is faulted in now rather than while recording
+	for( size_t offset = 0; offset < bytes; offset += DISK_ALIGNMENT )
+	{
+		( (volatile Uint8*)slab )[ offset ] = 0;
+	}
+#endif
+
+	//Keep it resident, recording still works if the limit does not allow it
+	if( mlock( slab, bytes ) != 0 && !mLockFailed )
+	{
+		printf( "Unable to lock recording chunks in memory, %s\n", strerror( errno ) );
+		mLockFailed = true;
+	}
+
+	mSlabs.push_back( slab );
+	mSlabBytes.push_back( bytes );
+	for( int i = chunks - 1; i >= 0; --i )
+	{
+		mFree.push_back( (Uint8*)slab + (size_t)i * DISK_CHUNK_BYTES );
+	}
+	return true;
+}
+
+Uint8* LChunkPool::acquire()
+{
+	if( mFree.empty() && !grow( POOL_SLAB_CHUNKS ) )
+	{
+		return NULL;
+	}
+	Uint8* chunk = mFree.back();
+	mFree.pop_back();
+	return chunk;
+}
+
+void LChunkPool::release( Uint8* chunk )
+{
+	mFree.push_back( chunk );
+}
+
+void LChunkPool::free()
+{
+	for( size_t i = 0; i < mSlabs.size(); ++i )
+	{
+		munlock( mSlabs[ i ], mSlabBytes[ i ] );
+		munmap( mSlabs[ i ], mSlabBytes[ i ] );
+	}
+	mSlabs.clear();
+	mSlabBytes.clear();
+	mFree.clear();
+}
+
+int LChunkPool::getChunkCount()
+{
+	size_t bytes = 0;
+	for( size_t i = 0; i < mSlabBytes.size(); ++i )
+	{
+		bytes += mSlabBytes[ i ];
+	}
+	return (int)( bytes / DISK_CHUNK_BYTES );
+}
+
+int LChunkPool::getFreeCount()
+{
+	return (int)mFree.size();
+}
+
+LRecordingStore::LRecordingStore()
+{
+	//Initialize
+	mFirstChunk = 0;
+	mSize = 0;
+}
+
+Uint8* LRecordingStore::getWriteSpace( Uint32& len )
+{
+	//Next chunk once the last one is full or has been retired
+	int lastChunk = mFirstChunk + (int)mChunks.size() - 1;
+	Uint32 used = mChunks.empty() ? 0 : (Uint32)( mSize - (Uint64)lastChunk * DISK_CHUNK_BYTES );
+	if( mChunks.empty() || used == (Uint32)DISK_CHUNK_BYTES )
+	{
+		Uint8* chunk = gChunkPool.acquire();
+		if( chunk == NULL )
+		{
+			len = 0;
+			return NULL;
+		}
+		mChunks.push_back( chunk );
+		used = 0;
+	}
+	len = DISK_CHUNK_BYTES - used;
+	return mChunks.back() + used;
+}
+
+void LRecordingStore::commit( Uint32 len )
+{
+	mSize += len;
+}
+
+Uint8* LRecordingStore::getChunk( int index )
+{
+	return mChunks[ index - mFirstChunk ];
+}
+
+void LRecordingStore::retire( Uint64 offset )
+{
+	//Oldest first, the chunk just flushed goes back last and is reused next
+	int done = 0;
+	while( done < (int)mChunks.size() && (Uint64)( mFirstChunk + done + 1 ) * DISK_CHUNK_BYTES <= offset )
+	{
+		gChunkPool.release( mChunks[ done ] );
+		++done;
+	}
+	mChunks.erase( mChunks.begin(), mChunks.begin() + done );
+	mFirstChunk += done;
+}
+
+void LRecordingStore::clear()
+{
+	//Most recently used chunks go back last so they are reused first
+	for( int i = (int)mChunks.size() - 1; i >= 0; --i )
+	{
+		gChunkPool.release( mChunks[ i ] );
+	}
+	mChunks.clear();
+	mFirstChunk = 0;
+	mSize = 0;
+}
+
+Uint64 LRecordingStore::getSize()
+{
+	return mSize;
+}
+
+int LRecordingStore::getChunkCount()
+{
+	return (int)mChunks.size();
+}
+
+LSampleConverter::LSampleConverter()
+{
+	//Initialize
+	setup( SAMPLE_F32, false );
+}
+
+void LSampleConverter::setup( SampleFormat format, bool dither )
+{
+	mFormat = format;
+	mDither = dither;
+
+	//Any nonzero seeds will do, they just have to differ
+	for( int i = 0; i < 4; ++i )
+	{
+		mState[ i ] = 0x9E3779B9u * ( i + 1 );
+	}
+}
+
+float LSampleConverter::nextDither()
+{
+	//Difference of two uniform values gives triangular noise spanning +-1 LSB
+	Sint32 dither[ 2 ];
+	for( int i = 0; i < 2; ++i )
+	{
+		Uint32 x = mState[ i ];
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		mState[ i ] = x;
+		dither[ i ] = (Sint32)x;
+	}
+	return ( (float)dither[ 0 ] + (float)dither[ 1 ] ) * ( 1.f / 4294967296.f );
+}
+
+void LSampleConverter::fromFloat( const float* in, Uint8* out, Uint32 count )
+{
+	//Nothing to convert
+	if( mFormat == SAMPLE_F32 )
+	{
+		memcpy( out, in, count * sizeof( float ) );
+		return;
+	}
+
+	//Full scale and the integer range it clips to
+	float scale = mFormat == SAMPLE_S16 ? 32768.f : 8388608.f;
+	float low = -scale;
+	float high = scale - 1.f;
+	Uint32 i = 0;
+
+#if defined(__SSE2__)
+	//Four samples per vector, dither comes from four generators stepped side by side
+	const __m128 vscale = _mm_set1_ps( scale );
+	const __m128 vlow = _mm_set1_ps( low );
+	const __m128 vhigh = _mm_set1_ps( high );
+	const __m128 lsb = _mm_set1_ps( 1.f / 4294967296.f );
+	__m128i state = _mm_load_si128( (const __m128i*)mState );
+	alignas(16) Sint32 lanes[ 4 ];
+	for( ; i + 4 <= count; i += 4 )
+	{
+		__m128 x = _mm_mul_ps( _mm_loadu_ps( &in[ i ] ), vscale );
+		if( mDither )
+		{
+			__m128i a = state;
+			a = _mm_xor_si128( a, _mm_slli_epi32( a, 13 ) );
+			a = _mm_xor_si128( a, _mm_srli_epi32( a, 17 ) );
+			a = _mm_xor_si128( a, _mm_slli_epi32( a, 5 ) );
+			__m128i b = a;
+			b = _mm_xor_si128( b, _mm_slli_epi32( b, 13 ) );
+			b = _mm_xor_si128( b, _mm_srli_epi32( b, 17 ) );
+			b = _mm_xor_si128( b, _mm_slli_epi32( b, 5 ) );
+			state = b;
+			x = _mm_add_ps( x, _mm_mul_ps( _mm_add_ps( _mm_cvtepi32_ps( a ), _mm_cvtepi32_ps( b ) ), lsb ) );
+		}
+
+		//Clip before rounding, out of range floats would convert to the most negative integer
+		__m128i rounded = _mm_cvtps_epi32( _mm_min_ps( _mm_max_ps( x, vlow ), vhigh ) );
+		if( mFormat == SAMPLE_S16 )
+		{
+			_mm_storel_epi64( (__m128i*)( out + i * 2 ), _mm_packs_epi32( rounded, rounded ) );
+		}
+		else
+		{
+			_mm_store_si128( (__m128i*)lanes, rounded );
+			for( int l = 0; l < 4; ++l )
+			{
+				Uint8* sample = out + ( i + l ) * 3;
+				sample[ 0 ] = lanes[ l ] & 0xFF;
+				sample[ 1 ] = ( lanes[ l ] >> 8 ) & 0xFF;
+				sample[ 2 ] = ( lanes[ l ] >> 16 ) & 0xFF;
+			}
+		}
+	}
+	_mm_store_si128( (__m128i*)mState, state );
+#endif
+
+	//Whatever is left over
+	for( ; i < count; ++i )
+	{
+		float x = in[ i ] * scale + ( mDither ? nextDither() : 0.f );
+		Sint32 rounded = (Sint32)lrintf( SDL_min( SDL_max( x, low ), high ) );
+		if( mFormat == SAMPLE_S16 )
+		{
+			Sint16 sample = (Sint16)rounded;
+			memcpy( out + i * 2, &sample, 2 );
+		}
+		else
+		{
+			Uint8* sample = out + i * 3;
+			sample[ 0 ] = rounded & 0xFF;
+			sample[ 1 ] = ( rounded >> 8 ) & 0xFF;
+			sample[ 2 ] = ( rounded >> 16 ) & 0xFF;
+		}
+	}
+}
+
+void LSampleConverter::toFloat( const Uint8* in, float* out, Uint32 count )
+{
+	Uint32 i = 0;
+	if( mFormat == SAMPLE_F32 )
+	{
+		memcpy( out, in, count * sizeof( float ) );
+	}
+	else if( mFormat == SAMPLE_S16 )
+	{
+#if defined(__SSE2__)
+		//Eight samples per vector, sign extended by shifting them down from the top half
+		const __m128 vscale = _mm_set1_ps( 1.f / 32768.f );
+		for( ; i + 8 <= count; i += 8 )
+		{
+			__m128i x = _mm_loadu_si128( (const __m128i*)( in + i * 2 ) );
+			__m128i lo = _mm_srai_epi32( _mm_unpacklo_epi16( x, x ), 16 );
+			__m128i hi = _mm_srai_epi32( _mm_unpackhi_epi16( x, x ), 16 );
+			_mm_storeu_ps( &out[ i ], _mm_mul_ps( _mm_cvtepi32_ps( lo ), vscale ) );
+			_mm_storeu_ps( &out[ i + 4 ], _mm_mul_ps( _mm_cvtepi32_ps( hi ), vscale ) );
+		}
+#endif
+		for( ; i < count; ++i )
+		{
+			Sint16 sample;
+			memcpy( &sample, in + i * 2, 2 );
+			out[ i ] = sample * ( 1.f / 32768.f );
+		}
+	}
+	else
+	{
+		//Packed samples go to the top of a 32 bit word so the sign comes along
+		for( ; i < count; ++i )
+		{
+			const Uint8* sample = in + i * 3;
+			Sint32 value = (Sint32)( ( (Uint32)sample[ 0 ] << 8 ) | ( (Uint32)sample[ 1 ] << 16 ) | ( (Uint32)sample[ 2 ] << 24 ) );
+			out[ i ] = value * ( 1.f / 2147483648.f );
+		}
+	}
+}
+
+SampleFormat LSampleConverter::getFormat()
+{
+	return mFormat;
+}
+
+Uint32 LSampleConverter::getSampleBytes()
+{
+	return mFormat == SAMPLE_F32 ? 4 : ( mFormat == SAMPLE_S16 ? 2 : 3 );
+}
+
+LSyntheticSource::LSyntheticSource()
+{
+	//Initialize
+	SDL_zero( mSpec );
+	mPosition = 0;
+	mSpeed = 1.0;
+	mFrames = 0;
+	mThread = NULL;
+	SDL_AtomicSet( &mStop, 0 );
+	SDL_AtomicSet( &mDone, 0 );
+	mBlocks = 0;
+	mCallbackTicks = 0;
+	mMaxCallbackTicks = 0;
+	mElapsedTicks = 0;
+	mPeakRingFill = 0;
+}
+
+LSyntheticSource::~LSyntheticSource()
+{
+	//Stop the clock
+	stop();
+}
+
+bool LSyntheticSource::open( std::string source, const SDL_AudioSpec& spec )
+{
+	mSpec = spec;
+	mPosition = 0;
+	mFile.clear();
+	mGenerator.clear();
+
+	//Generators need nothing loaded
+	if( source == "sine" || source == "bursts" )
+	{
+		mGenerator = source;
+		return true;
+	}
+
+	//Load the file and convert it to the capture layout
+	SDL_AudioSpec wavSpec;
+	Uint8* wavData = NULL;
+	Uint32 wavBytes = 0;
+	if( SDL_LoadWAV( source.c_str(), &wavSpec, &wavData, &wavBytes ) == NULL )
+	{
+		printf( "Unable to load %s! SDL Error: %s\n", source.c_str(), SDL_GetError() );
+		return false;
+	}
+	SDL_AudioCVT cvt;
+	if( SDL_BuildAudioCVT( &cvt, wavSpec.format, wavSpec.channels, wavSpec.freq, AUDIO_F32, spec.channels, spec.freq ) < 0 )
+	{
+		printf( "Unable to convert %s! SDL Error: %s\n", source.c_str(), SDL_GetError() );
+		SDL_FreeWAV( wavData );
+		return false;
+	}
+	std::vector<Uint8> converted( (size_t)wavBytes * SDL_max( cvt.len_mult, 1 ) );
+	memcpy( &converted[ 0 ], wavData, wavBytes );
+	SDL_FreeWAV( wavData );
+	cvt.buf = &converted[ 0 ];
+	cvt.len = wavBytes;
+	if( cvt.needed && SDL_ConvertAudio( &cvt ) < 0 )
+	{
+		printf( "Unable to convert %s! SDL Error: %s\n", source.c_str(), SDL_GetError() );
+		return false;
+	}
+	Uint32 bytes = cvt.needed ? cvt.len_cvt : wavBytes;
+	mFile.resize( bytes / sizeof( float ) / spec.channels * spec.channels );
+	if( mFile.empty() )
+	{
+		printf( "%s has no audio!\n", source.c_str() );
+		return false;
+	}
+	memcpy( &mFile[ 0 ], &converted[ 0 ], mFile.size() * sizeof( float ) );
+	return true;
+}
+
+bool LSyntheticSource::start( double speed, Uint64 frames )
+{
+	stop();
+	mSpeed = speed;
+	mFrames = frames;
+	mBlocks = 0;
+	mCallbackTicks = 0;
+	mMaxCallbackTicks = 0;
+	mElapsedTicks = 0;
+	mPeakRingFill = 0;
+	SDL_AtomicSet( &mStop, 0 );
+	SDL_AtomicSet( &mDone, 0 );
+	mThread = SDL_CreateThread( clockThread, "SyntheticSource", this );
+	return mThread != NULL;
+}
+
+void LSyntheticSource::stop()
+{
+	if( mThread != NULL )
+	{
+		SDL_AtomicSet( &mStop, 1 );
+		SDL_WaitThread( mThread, NULL );
+		mThread = NULL;
+	}
+}
+
+bool LSyntheticSource::isDone()
+{
+	return SDL_AtomicGet( &mDone ) != 0;
+}
+
+void LSyntheticSource::fill( float* block, Uint32 frames )
+{
+	int channels = mSpec.channels;
+
+	//Loop the file
+	if( !mFile.empty() )
+	{
+		Uint64 fileFrames = mFile.size() / channels;
+		for( Uint32 i = 0; i < frames; ++i )
+		{
+			memcpy( &block[ i * channels ], &mFile[ ( ( mPosition + i ) % fileFrames ) * channels ], channels * sizeof( float ) );
+		}
+		mPosition += frames;
+		return;
+	}
+
+	//Tone over a little noise, the bursts generator switches the tone on and off
+	Uint64 burstFrames = (Uint64)mSpec.freq * SYNTHETIC_BURST_MS / 1000;
+	for( Uint32 i = 0; i < frames; ++i )
+	{
+		Uint64 frame = mPosition + i;
+		bool toneOn = mGenerator == "sine" || ( frame / burstFrames ) % 2 == 0;
+		float tone = toneOn ? SYNTHETIC_TONE_LEVEL * sinf( 2.0f * (float)M_PI * SYNTHETIC_TONE_HZ * (float)( frame % mSpec.freq ) / mSpec.freq ) : 0.f;
+		for( int c = 0; c < channels; ++c )
+		{
+			block[ i * channels + c ] = tone + SYNTHETIC_NOISE_LEVEL * ( (float)rand() / RAND_MAX * 2 - 1 );
+		}
+	}
+	mPosition += frames;
+}
+
+int LSyntheticSource::clockThread( void* data )
+{
+	LSyntheticSource* source = (LSyntheticSource*)data;
+	Uint32 frames = source->mSpec.samples;
+	std::vector<float> block( frames * source->mSpec.channels );
+	Uint64 frequency = SDL_GetPerformanceFrequency();
+	Uint64 start = SDL_GetPerformanceCounter();
+	Uint64 delivered = 0;
+
+	while( !SDL_AtomicGet( &source->mStop ) && delivered < source->mFrames )
+	{
+		//Audio is produced ahead of time, like a device filling its buffer
+		source->fill( &block[ 0 ], frames );
+
+		//Time the callback alone
+		Uint64 before = SDL_GetPerformanceCounter();
+		audioRecordingCallback( NULL, (Uint8*)&block[ 0 ], (int)( block.size() * sizeof( float ) ) );
+		Uint64 ticks = SDL_GetPerformanceCounter() - before;
+		source->mCallbackTicks += ticks;
+		source->mMaxCallbackTicks = SDL_max( source->mMaxCallbackTicks, ticks );
+		++source->mBlocks;
+		delivered += frames;
+
+		//This thread is the only writer, so what it sees is the most the ring ever held
+		source->mPeakRingFill = SDL_max( source->mPeakRingFill, gCaptureRing.readAvailable() );
+
+		//Wait for the next block's turn on the scaled clock
+		if( source->mSpeed > 0 )
+		{
+			Uint64 due = start + (Uint64)( (double)delivered / source->mSpec.freq / source->mSpeed * frequency );
+			Uint64 now = SDL_GetPerformanceCounter();
+			if( due > now )
+			{
+				SDL_Delay( (Uint32)( ( due - now ) * 1000 / frequency ) );
+			}
+		}
+	}
+
+	source->mElapsedTicks = SDL_GetPerformanceCounter() - start;
+	SDL_AtomicSet( &source->mDone, 1 );
+	return 0;
+}
+
+Uint64 LSyntheticSource::getBlocks()
+{
+	return mBlocks;
+}
+
+Uint64 LSyntheticSource::getCallbackTicks()
+{
+	return mCallbackTicks;
+}
+
+Uint64 LSyntheticSource::getMaxCallbackTicks()
+{
+	return mMaxCallbackTicks;
+}
+
+Uint64 LSyntheticSource::getElapsedTicks()
+{
+	return mElapsedTicks;
+}
+
+Uint32 LSyntheticSource::getPeakRingFill()
+{
+	return mPeakRingFill;
+}
+
+LVoiceGate::LVoiceGate()
+{
+	//Initialize
+	mPreRollBytes = 0;
+	mFloorDb = VAD_MIN_DB;
+	mHangoverFrames = 0;
+	mHangoverLeft = 0;
+	mFrameBytes = 0;
+	mChannels = 0;
+	mFreq = 0;
+	SDL_AtomicSet( &mOpen, 0 );
+}
+
+LVoiceGate::~LVoiceGate()
+{
+	//Deallocate
+	free();
+}
+
+bool LVoiceGate::allocate( const SDL_AudioSpec& spec, Uint32 sampleBytes )
+{
+	//The ring rounds up, so keep track of how much pre-roll is actually wanted
+	mFrameBytes = spec.channels * sampleBytes;
+	mFreq = spec.freq;
+	mPreRollBytes = (Uint32)( (Uint64)spec.freq * VAD_PREROLL_MS / 1000 ) * mFrameBytes;
+	mHangoverFrames = (Uint32)( (Uint64)spec.freq * VAD_HANGOVER_MS / 1000 );
+	mChannels = spec.channels;
+	reset();
+	return mPreRoll.allocate( mPreRollBytes + spec.samples * mFrameBytes );
+}
+
+void LVoiceGate::free()
+{
+	mPreRoll.free();
+}
+
+void LVoiceGate::reset()
+{
+	//Assume quiet until the floor has been heard
+	mPreRoll.reset();
+	mFloorDb = VAD_MIN_DB;
+	mHangoverLeft = 0;
+	SDL_AtomicSet( &mOpen, 0 );
+}
+
+float LVoiceGate::measure( const float* samples, Uint32 count )
+{
+	//Mean square over every channel, a mono sum would cancel out of phase input
+	float sumSquares = 0.f;
+	for( Uint32 i = 0; i < count; ++i )
+	{
+		sumSquares += samples[ i ] * samples[ i ];
+	}
+	return 10.f * log10f( sumSquares / SDL_max( count, (Uint32)1 ) + 1e-12f );
+}
+
+bool LVoiceGate::process( const float* samples, const Uint8* stream, Uint32 len, LRingBuffer& out )
+{
+	Uint32 frames = len / mFrameBytes;
+	float levelDb = measure( samples, frames * mChannels );
+	bool open = mHangoverLeft > 0;
+
+	//Speech starts well above the background and carries on while somewhat above it
+	float thresholdDb = mFloorDb + ( open ? VAD_RELEASE_DB : VAD_ONSET_DB );
+	bool speech = levelDb > SDL_max( thresholdDb, VAD_MIN_DB );
+
+	//The floor drops straight to quieter blocks and creeps up otherwise, slowly while talking;
+	//the gaps between words pull it back down so real speech keeps the gate open
+	if( levelDb < mFloorDb )
+	{
+		mFloorDb = levelDb;
+	}
+	else
+	{
+		float rise = speech ? VAD_FLOOR_RISE_OPEN_DB_PER_SECOND : VAD_FLOOR_RISE_DB_PER_SECOND;
+		mFloorDb = SDL_min( levelDb, mFloorDb + rise * frames / mFreq );
+	}
+
+	//Quiet and closed, keep the newest audio as pre-roll and nothing else
+	if( !speech && !open )
+	{
+		Uint32 keep = mPreRoll.readAvailable() + len;
+		if( keep > mPreRollBytes )
+		{
+			mPreRoll.skip( keep - mPreRollBytes );
+		}
+		mPreRoll.write( stream, len );
+		return true;
+	}
+
+	//Hold the gate open until the hangover runs out
+	mHangoverLeft = speech ? mHangoverFrames : ( mHangoverLeft > frames ? mHangoverLeft - frames : 0 );
+
+	//Speech just started, lead in with what came before it
+	bool fits = true;
+	if( !open )
+	{
+		Uint32 preRoll = mPreRoll.readAvailable();
+		fits = out.writeAvailable() >= preRoll + len;
+		if( fits )
+		{
+			Uint8 copy[ 4096 ];
+			while( Uint32 got = mPreRoll.read( copy, sizeof( copy ) ) )
+			{
+				out.write( copy, got );
+			}
+		}
+		mPreRoll.reset();
+		SDL_AtomicAdd( &gVoiceSegments, 1 );
+		SDL_AtomicSet( &mOpen, 1 );
+	}
+	else if( mHangoverLeft == 0 )
+	{
+		SDL_AtomicSet( &mOpen, 0 );
+	}
+
+	//Pass the block on
+	fits = fits && out.writeAvailable() >= len;
+	if( fits )
+	{
+		out.write( stream, len );
+		SDL_AtomicAdd( &gVoiceBlocks, 1 );
+	}
+	return fits;
+}
+
+bool LVoiceGate::isOpen()
+{
+	return SDL_AtomicGet( &mOpen ) != 0;
+}
+
+//Reads one code point and moves past it, bad bytes become U+FFFD
+Uint32 decodeUtf8( const char*& text )
+{
+	Uint8 lead = *text++;
+	if( lead < 0x80 )
+	{
+		return lead;
+	}
+
+	//Sequence length from the lead byte
+	int extra = lead >= 0xF0 ? 3 : lead >= 0xE0 ? 2 : lead >= 0xC0 ? 1 : -1;
+	if( extra < 0 )
+	{
+		return 0xFFFD;
+	}
+	Uint32 codepoint = lead & ( 0x3F >> extra );
+	for( int i = 0; i < extra; ++i )
+	{
+		if( ( *text & 0xC0 ) != 0x80 )
+		{
+			return 0xFFFD;
+		}
+		codepoint = ( codepoint << 6 ) | ( *text++ & 0x3F );
+	}
+	return codepoint;
+}
+
+LGlyphAtlas::LGlyphAtlas()
+{
+	//Initialize
+	mFont = NULL;
+	mTexture = NULL;
+	memset( mAscii, 0, sizeof( mAscii ) );
+	mPenX = 0;
+	mPenY = 0;
+	mShelfHeight = 0;
+}
+
+LGlyphAtlas::~LGlyphAtlas()
+{
+	//Deallocate
+	free();
+}
+
+bool LGlyphAtlas::load( TTF_Font* font )
+{
+	//Get rid of preexisting atlas
+	free();
+
+	//Glyphs are white with alpha, color comes from the vertices
+	mTexture = SDL_CreateTexture( gRenderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STATIC, GLYPH_ATLAS_SIZE, GLYPH_ATLAS_SIZE );
+	if( mTexture == NULL )
+	{
+		printf( "Unable to create glyph atlas! SDL Error: %s\n", SDL_GetError() );
+		return false;
+	}
+	SDL_SetTextureBlendMode( mTexture, SDL_BLENDMODE_BLEND );
+	mFont = font;
+
+	//Start with a clear atlas
+	std::vector<Uint32> clear( GLYPH_ATLAS_SIZE * GLYPH_ATLAS_SIZE, 0 );
+	SDL_UpdateTexture( mTexture, NULL, &clear[ 0 ], GLYPH_ATLAS_SIZE * sizeof( Uint32 ) );
+
+	//Everything the prompts use is ready before the first frame
+	for( Uint32 c = ' '; c < 127; ++c )
+	{
+		findGlyph( c );
+	}
+	return true;
+}
+
+void LGlyphAtlas::free()
+{
+	if( mTexture != NULL )
+	{
+		SDL_DestroyTexture( mTexture );
+		mTexture = NULL;
+	}
+	mFont = NULL;
+	memset( mAscii, 0, sizeof( mAscii ) );
+	mGlyphs.clear();
+	mPenX = 0;
+	mPenY = 0;
+	mShelfHeight = 0;
+	mVertices.clear();
+	mIndices.clear();
+}
+
+LGlyphAtlas::Glyph* LGlyphAtlas::findGlyph( Uint32 codepoint )
+{
+	//Cached already
+	Glyph* glyph = codepoint < 128 ? &mAscii[ codepoint ] : &mGlyphs[ codepoint ];
+	if( glyph->loaded )
+	{
+		return glyph;
+	}
+
+	//Rasterize it, falling back to a question mark
+	if( !rasterize( codepoint, *glyph ) )
+	{
+		if( codepoint == '?' )
+		{
+			return NULL;
+		}
+		Glyph* fallback = findGlyph( '?' );
+		if( fallback != NULL )
+		{
+			*glyph = *fallback;
+		}
+	}
+	return glyph->loaded ? glyph : NULL;
+}
+
+bool LGlyphAtlas::rasterize( Uint32 codepoint, Glyph& glyph )
+{
+	if( mFont == NULL || !TTF_GlyphIsProvided32( mFont, codepoint ) )
+	{
+		return false;
+	}
+
+	//Render the glyph on its own, full line height so glyphs share a baseline
+	SDL_Color white = { 0xFF, 0xFF, 0xFF, 0xFF };
+	SDL_Surface* rendered = TTF_RenderGlyph32_Blended( mFont, codepoint, white );
+	if( rendered == NULL )
+	{
+		return false;
+	}
+	SDL_Surface* surface = SDL_ConvertSurfaceFormat( rendered, SDL_PIXELFORMAT_ARGB8888, 0 );
+	SDL_FreeSurface( rendered );
+	if( surface == NULL )
+	{
+		return false;
+	}
+
+	//Next shelf when this row is full
+	if( mPenX + surface->w > GLYPH_ATLAS_SIZE )
+	{
+		mPenX = 0;
+		mPenY += mShelfHeight + 1;
+		mShelfHeight = 0;
+	}
+	if( mPenY + surface->h > GLYPH_ATLAS_SIZE )
+	{
+		printf( "Glyph atlas is full, U+%04X will not be drawn\n", codepoint );
+		SDL_FreeSurface( surface );
+		return false;
+	}
+
+	//Upload just this glyph's rectangle
+	SDL_Rect source = { mPenX, mPenY, surface->w, surface->h };
+	SDL_UpdateTexture( mTexture, &source, surface->pixels, surface->pitch );
+	mPenX += surface->w + 1;
+	mShelfHeight = SDL_max( mShelfHeight, surface->h );
+
+	int advance = surface->w;
+	TTF_GlyphMetrics32( mFont, codepoint, NULL, NULL, NULL, NULL, &advance );
+	glyph.source = source;
+	glyph.advance = advance;
+	glyph.loaded = true;
+	SDL_FreeSurface( surface );
+	return true;
+}
+
+//Fills in one corner of a glyph quad
+inline void setVertex( SDL_Vertex& vertex, float x, float y, float u, float v, SDL_Color color )
+{
+	vertex.position.x = x;
+	vertex.position.y = y;
+	vertex.color = color;
+	vertex.tex_coord.x = u;
+	vertex.tex_coord.y = v;
+}
+
+void LGlyphAtlas::render( const std::string& text, int x, int y, SDL_Color color )
+{
+	//Room for every byte being a glyph, trimmed to what was used at the end
+	size_t vertexCount = mVertices.size();
+	size_t indexCount = mIndices.size();
+	mVertices.resize( vertexCount + text.size() * 4 );
+	mIndices.resize( indexCount + text.size() * 6 );
+	SDL_Vertex* vertex = &mVertices[ vertexCount ];
+	int* index = &mIndices[ indexCount ];
+
+	float scale = 1.0f / GLYPH_ATLAS_SIZE;
+	const char* cursor = text.c_str();
+	while( *cursor != '\0' )
+	{
+		Glyph* glyph = findGlyph( decodeUtf8( cursor ) );
+		if( glyph == NULL )
+		{
+			continue;
+		}
+
+		//Two triangles per glyph
+		const SDL_Rect& r = glyph->source;
+		float left = (float)x;
+		float right = (float)( x + r.w );
+		float top = (float)y;
+		float bottom = (float)( y + r.h );
+		float u0 = r.x * scale;
+		float u1 = ( r.x + r.w ) * scale;
+		float v0 = r.y * scale;
+		float v1 = ( r.y + r.h ) * scale;
+		int base = (int)vertexCount;
+		setVertex( vertex[ 0 ], left, top, u0, v0, color );
+		setVertex( vertex[ 1 ], right, top, u1, v0, color );
+		setVertex( vertex[ 2 ], right, bottom, u1, v1, color );
+		setVertex( vertex[ 3 ], left, bottom, u0, v1, color );
+		index[ 0 ] = base;
+		index[ 1 ] = base + 1;
+		index[ 2 ] = base + 2;
+		index[ 3 ] = base;
+		index[ 4 ] = base + 2;
+		index[ 5 ] = base + 3;
+		vertex += 4;
+		index += 6;
+		vertexCount += 4;
+		indexCount += 6;
+		x += glyph->advance;
+	}
+	mVertices.resize( vertexCount );
+	mIndices.resize( indexCount );
+}
+
+void LGlyphAtlas::flush()
+{
+	if( !mIndices.empty() )
+	{
+		SDL_RenderGeometry( gRenderer, mTexture, &mVertices[ 0 ], (int)mVertices.size(), &mIndices[ 0 ], (int)mIndices.size() );
+	}
+	mVertices.clear();
+	mIndices.clear();
+}
+
+int LGlyphAtlas::measure( const std::string& text )
+{
+	int width = 0;
+	const char* cursor = text.c_str();
+	while( *cursor != '\0' )
+	{
+		Glyph* glyph = findGlyph( decodeUtf8( cursor ) );
+		if( glyph != NULL )
+		{
+			width += glyph->advance;
+		}
+	}
+	return width;
+}
+
+int LGlyphAtlas::getLineHeight()
+{
+	return mFont != NULL ? TTF_FontLineSkip( mFont ) : 0;
+}
+
+LTexture::LTexture()
+{
+	//Initialize
+	mTexture = NULL;
+	mWidth = 0;
+	mHeight = 0;
+}
+
+LTexture::~LTexture()
+{
+	//Deallocate
+	free();
+}
+
+bool LTexture::loadFromFile( std::string path )
+{
+	//Get rid of preexisting texture
+	free();
+
+	//The final texture
+	SDL_Texture* newTexture = NULL;
+
+	//Load image at specified path
+	SDL_Surface* loadedSurface = IMG_Load( path.c_str() );
+	if( loadedSurface == NULL )
+	{
+		printf( "Unable to load image %s! SDL_image Error: %s\n", path.c_str(), IMG_GetError() );
+	}
+	else
+	{
+		//Color key image
+		SDL_SetColorKey( loadedSurface, SDL_TRUE, SDL_MapRGB( loadedSurface->format, 0, 0xFF, 0xFF ) );
+
+		//Create texture from surface pixels
+        newTexture = SDL_CreateTextureFromSurface( gRenderer, loadedSurface );
+		if( newTexture == NULL )
+		{
+			printf( "Unable to create texture from %s! SDL Error: %s\n", path.c_str(), SDL_GetError() );
+		}
+		else
+		{
+			//Get image dimensions
+			mWidth = loadedSurface->w;
+			mHeight = loadedSurface->h;
+		}
+
+		//Get rid of old loaded surface
+		SDL_FreeSurface( loadedSurface );
+	}
+
+	//Return success
+	mTexture = newTexture;
+	return mTexture != NULL;
+}
+
+#if defined(_SDL_TTF_H) || defined(SDL_TTF_H)
+bool LTexture::loadFromRenderedText( std::string textureText, SDL_Color textColor )
+{
+	//Get rid of preexisting texture
+	free();
+
+	//Render text surface
+	SDL_Surface* textSurface = TTF_RenderUTF8_Solid( gFont, textureText.c_str(), textColor );
+	if( textSurface != NULL )
+	{
+		//Create texture from surface pixels
+        mTexture = SDL_CreateTextureFromSurface( gRenderer, textSurface );
+		if( mTexture == NULL )
+		{
+			printf( "Unable to create texture from rendered text! SDL Error: %s\n", SDL_GetError() );
+		}
+		else
+		{
+			//Get image dimensions
+			mWidth = textSurface->w;
+			mHeight = textSurface->h;
+		}
+
+		//Get rid of old surface
+		SDL_FreeSurface( textSurface );
+	}
+	else
+	{
+		printf( "Unable to render text surface! SDL_ttf Error: %s\n", TTF_GetError() );
+	}
+
+	
+	//Return success
+	return mTexture != NULL;
+}
+#endif
+
+void LTexture::free()
+{
+	//Free texture if it exists
+	if( mTexture != NULL )
+	{
+		SDL_DestroyTexture( mTexture );
+		mTexture = NULL;
+		mWidth = 0;
+		mHeight = 0;
+	}
+}
+
+void LTexture::setColor( Uint8 red, Uint8 green, Uint8 blue )
+{
+	//Modulate texture rgb
+	SDL_SetTextureColorMod( mTexture, red, green, blue );
+}
+
+void LTexture::setBlendMode( SDL_BlendMode blending )
+{
+	//Set blending function
+	SDL_SetTextureBlendMode( mTexture, blending );
+}
+		
+void LTexture::setAlpha( Uint8 alpha )
+{
+	//Modulate texture alpha
+	SDL_SetTextureAlphaMod( mTexture, alpha );
+}
+
+void LTexture::render( int x, int y, SDL_Rect* clip, double angle, SDL_Point* center, SDL_RendererFlip flip )
+{
+	//Set rendering space and render to screen
+	SDL_Rect renderQuad = { x, y, mWidth, mHeight };
+
+	//Set clip rendering dimensions
+	if( clip != NULL )
+	{
+		renderQuad.w = clip->w;
+		renderQuad.h = clip->h;
+	}
+
+	//Render to screen
+	SDL_RenderCopyEx( gRenderer, mTexture, clip, &renderQuad, angle, center, flip );
+}
+
+int LTexture::getWidth()
+{
+	return mWidth;
+}
+
+int LTexture::getHeight()
+{
+	return mHeight;
+}
+
+bool init()
+{
+	//Initialization flag
+	bool success = true;
+
+	//Initialize SDL
+	if( SDL_Init( SDL_INIT_VIDEO | SDL_INIT_AUDIO ) < 0 )
+	{
+		printf( "SDL could not initialize! SDL Error: %s\n", SDL_GetError() );
+		success = false;
+	}
+	else
+	{
+		//Set texture filtering to linear
+		if( !SDL_SetHint( SDL_HINT_RENDER_SCALE_QUALITY, "1" ) )
+		{
+			printf( "Warning: Linear texture filtering not enabled!" );
+		}
+
+		//Create window
+		gWindow = SDL_CreateWindow( "SDL Tutorial", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, SCREEN_WIDTH, SCREEN_HEIGHT, SDL_WINDOW_SHOWN );
+		if( gWindow == NULL )
+		{
+			printf( "Window could not be created! SDL Error: %s\n", SDL_GetError() );
+			success = false;
+		}
+		else
+		{
+			//Create vsynced renderer for window
+			gRenderer = SDL_CreateRenderer( gWindow, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC );
+			if( gRenderer == NULL )
+			{
+				printf( "Renderer could not be created! SDL Error: %s\n", SDL_GetError() );
+				success = false;
+			}
+			else
+			{
+				//Initialize renderer color
+				SDL_SetRenderDrawColor( gRenderer, 0xFF, 0xFF, 0xFF, 0xFF );
+
+				//Initialize PNG loading
+				int imgFlags = IMG_INIT_PNG;
+				if( !( IMG_Init( imgFlags ) & imgFlags ) )
+				{
+					printf( "SDL_image could not initialize! SDL_image Error: %s\n", IMG_GetError() );
+					success = false;
+				}
+
+				//Initialize SDL_ttf
+				if( TTF_Init() == -1 )
+				{
+					printf("SDL_ttf could not initialize! SDL_ttf Error: %s\n", TTF_GetError());
+					success = false;
+				}
+			}
+		}
+	}
+
+	return success;
+}
+
+bool loadMedia()
+{
+	//Loading success flag
+	bool success = true;
+
+	//Open the font
+	gFont = TTF_OpenFont( "msyh.ttc", 28 );
+	if( gFont == NULL )
+	{
+		printf( "Failed to load lazy font! SDL_ttf Error: %s\n", TTF_GetError() );
+		success = false;
+	}
+	//Rasterize the font into the atlas
+	else if( !gTextAtlas.load( gFont ) )
+	{
+		success = false;
+	}
+	else
+	{
+		//Set starting prompt 
+		gPromptText = "Select your recording device:";
+
+		//Get capture device count
+		gRecordingDeviceCount = SDL_GetNumAudioDevices( SDL_TRUE );
+
+		//No recording devices
+		if( gRecordingDeviceCount < 1 )
+		{
+			printf( "Unable to get audio capture device! SDL Error: %s\n", SDL_GetError() );
+			success = false;
+		}
+		//At least one device connected
+		else
+		{
+			//Cap recording device count
+			if( gRecordingDeviceCount > MAX_RECORDING_DEVICES )
+			{
+				gRecordingDeviceCount = MAX_RECORDING_DEVICES;
+			}
+
+			//Render device names
+			std::stringstream promptText;
+			for( int i = 0; i < gRecordingDeviceCount; ++i )
+			{
+				//Get capture device name
+				promptText.str( "" );
+				promptText << i << ": " << SDL_GetAudioDeviceName( i, SDL_TRUE );
+
+				//Keep the name for drawing
+				gDeviceNames[ i ] = promptText.str();
+			}
+		}
+	}
+
+	return success;
+}
+
+void close()
+{
+	//Report text cost
+	if( gTextFrames > 0 )
+	{
+		printf( "Text took %.1f us per frame\n", (double)gTextTicks / gTextFrames * 1000000 / SDL_GetPerformanceFrequency() );
+	}
+
+	//Free glyph atlas
+	gTextAtlas.free();
+
+	//Free global font
+	TTF_CloseFont( gFont );
+	gFont = NULL;
+
+	//Destroy window	
+	SDL_DestroyRenderer( gRenderer );
+	SDL_DestroyWindow( gWindow );
+	gWindow = NULL;
+	gRenderer = NULL;
+
+	//Stop disk threads
+	stopCaptureWriter();
+	stopPlaybackReader();
+	stopMultitrackCapture();
+
+	//Close audio devices
+	closeAudioDevices();
+	gMonitorRing.free();
+
+	//Free rings
+	gCaptureRing.free();
+	gVoiceGate.free();
+	gPlaybackRing.free();
+
+	//Free recording memory
+	gRecordingStore.clear();
+	gChunkPool.free();
+
+	//Last snapshot and the socket go with the app
+	gStats.stop();
+
+	//Quit SDL subsystems
+	TTF_Quit();
+	IMG_Quit();
+	SDL_Quit();
+}
+
+void fillWavHeader( Uint8* header, const SDL_AudioSpec& spec, SampleFormat format, Uint64 dataBytes )
+{
+	//Sizes saturate past 4GB, most readers then play to the end of the file
+	Uint32 dataSize = dataBytes > 0xFFFFFFFF - 36 ? 0xFFFFFFFF - 36 : (Uint32)dataBytes;
+	int bitsPerSample = format == SAMPLE_F32 ? 32 : ( format == SAMPLE_S16 ? 16 : 24 );
+	int blockAlign = spec.channels * bitsPerSample / 8;
+	Uint32 fields[] = {
+		36 + dataSize, 16, (Uint32)( format == SAMPLE_F32 ? 3 : 1 ) | ( (Uint32)spec.channels << 16 ),
+		(Uint32)spec.freq, (Uint32)( spec.freq * blockAlign ), (Uint32)blockAlign | ( (Uint32)bitsPerSample << 16 ), dataSize
+	};
+	int offsets[] = { 4, 16, 20, 24, 28, 32, 40 };
+
+	memcpy( header, "RIFF", 4 );
+	memcpy( header + 8, "WAVEfmt ", 8 );
+	memcpy( header + 36, "data", 4 );
+	for( int i = 0; i < 7; ++i )
+	{
+		for( int b = 0; b < 4; ++b )
+		{
+			header[ offsets[ i ] + b ] = ( fields[ i ] >> ( b * 8 ) ) & 0xFF;
+		}
+	}
+}
+
+bool writeFully( int fd, const Uint8* data, size_t len )
+{
+	while( len > 0 )
+	{
+		ssize_t written = ::write( fd, data, len );
+		if( written <= 0 )
+		{
+			printf( "Failed to write recording! %s\n", strerror( errno ) );
+			return false;
+		}
+		data += written;
+		len -= written;
+	}
+	return true;
+}
+
+int captureWriterThread( void* data )
+{
+	//Open the output file
+	int fd = open( RECORDING_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+	if( fd < 0 )
+	{
+		printf( "Unable to create %s! %s\n", RECORDING_FILE, strerror( errno ) );
+		return -1;
+	}
+
+	//Leave room for the header, it gets filled in once the length is known
+	Uint8 header[ WAV_HEADER_BYTES ];
+	Uint32 space = 0;
+	Uint8* headerSpace = gRecordingStore.getWriteSpace( space );
+	if( headerSpace == NULL )
+	{
+		close( fd );
+		return -1;
+	}
+	memset( headerSpace, 0, WAV_HEADER_BYTES );
+	gRecordingStore.commit( WAV_HEADER_BYTES );
+
+	Uint64 dataBytes = 0;
+	Uint64 flushed = 0;
+	bool ok = true;
+
+	while( ok )
+	{
+		//Check before draining so nothing written before the stop is missed
+		bool stopping = SDL_AtomicGet( &gStopWriter ) != 0;
+
+		//Drain the ring straight into the store
+		Uint8* chunk = gRecordingStore.getWriteSpace( space );
+		if( chunk == NULL )
+		{
+			printf( "Out of memory for the recording!\n" );
+			ok = false;
+			break;
+		}
+		Uint32 got = gCaptureRing.read( chunk, space );
+		gRecordingStore.commit( got );
+		dataBytes += got;
+		statsAdd( gWriterBytes, got );
+
+		//Full chunks are page aligned, write them out as they are and hand them back,
+		//so the pool only ever holds what is between the ring and the disk
+		while( gRecordingStore.getSize() - flushed >= (Uint64)DISK_CHUNK_BYTES && ok )
+		{
+			ok = writeFully( fd, gRecordingStore.getChunk( flushed / DISK_CHUNK_BYTES ), DISK_CHUNK_BYTES );
+			flushed += DISK_CHUNK_BYTES;
+			gRecordingStore.retire( flushed );
+		}
+
+		if( got == 0 )
+		{
+			if( stopping )
+			{
+				break;
+			}
+			SDL_Delay( DISK_POLL_MS );
+		}
+	}
+
+	//Write what is left and the final header, then everything is on disk
+	if( ok && gRecordingStore.getSize() > flushed )
+	{
+		ok = writeFully( fd, gRecordingStore.getChunk( flushed / DISK_CHUNK_BYTES ), gRecordingStore.getSize() - flushed );
+	}
+	gRecordingStore.clear();
+	fillWavHeader( header, gReceivedRecordingSpec, gSampleFormat, dataBytes );
+	if( pwrite( fd, header, WAV_HEADER_BYTES, 0 ) != WAV_HEADER_BYTES )
+	{
+		printf( "Failed to finish %s header!\n", RECORDING_FILE );
+	}
+
+	close( fd );
+	gRecordedBytes = dataBytes;
+	gRecordingFileBytes = WAV_HEADER_BYTES + dataBytes;
+	return ok ? 0 : -1;
+}
+
+int playbackReaderThread( void* data )
+{
+	//Open the recording and skip its header
+	int fd = open( RECORDING_FILE, O_RDONLY );
+	if( fd < 0 || lseek( fd, WAV_HEADER_BYTES, SEEK_SET ) != WAV_HEADER_BYTES )
+	{
+		printf( "Unable to open %s! %s\n", RECORDING_FILE, strerror( errno ) );
+		if( fd >= 0 )
+		{
+			close( fd );
+		}
+		SDL_AtomicSet( &gPlaybackFileDone, 1 );
+		return -1;
+	}
+
+	void* staging = NULL;
+	if( posix_memalign( &staging, DISK_ALIGNMENT, DISK_CHUNK_BYTES ) != 0 )
+	{
+		close( fd );
+		SDL_AtomicSet( &gPlaybackFileDone, 1 );
+		return -1;
+	}
+	Uint8* chunk = (Uint8*)staging;
+	Uint64 left = gRecordedBytes;
+
+	while( !SDL_AtomicGet( &gStopReader ) && left > 0 )
+	{
+		//Top the ring up in large reads once a quarter of it is free
+		Uint32 space = gPlaybackRing.writeAvailable();
+		if( space < gPlaybackRing.getSize() / 4 )
+		{
+			SDL_Delay( DISK_POLL_MS );
+			continue;
+		}
+
+		ssize_t got = ::read( fd, chunk, SDL_min( (Uint64)SDL_min( space, (Uint32)DISK_CHUNK_BYTES ), left ) );
+		if( got <= 0 )
+		{
+			break;
+		}
+		gPlaybackRing.write( chunk, got );
+		left -= got;
+	}
+
+	SDL_AtomicSet( &gPlaybackFileDone, 1 );
+	close( fd );
+	::free( staging );
+	return 0;
+}
+
+int captureEncoderThread( void* data )
+{
+	LStreamEncoder encoder;
+	bool ok = encoder.open( gRecordingFile, gStorageFormat == STORAGE_OPUS ? AV_CODEC_ID_OPUS : AV_CODEC_ID_FLAC, gReceivedRecordingSpec );
+
+	//Whole frames out of the ring, the callback only ever writes whole blocks
+	int channels = gReceivedRecordingSpec.channels;
+	Uint32 frameBytes = channels * sizeof( float );
+	float* chunk = new float[ ENCODE_CHUNK_FRAMES * channels ];
+	Uint64 dataBytes = 0;
+	Uint64 nextStall = gReceivedRecordingSpec.freq * frameBytes;
+
+	while( true )
+	{
+		//Check before draining so nothing written before the stop is missed
+		bool stopping = SDL_AtomicGet( &gStopWriter ) != 0;
+
+		Uint32 got = gCaptureRing.read( (Uint8*)chunk, ENCODE_CHUNK_FRAMES * frameBytes );
+		if( got == 0 )
+		{
+			if( stopping )
+			{
+				break;
+			}
+			SDL_Delay( DISK_POLL_MS );
+			continue;
+		}
+
+		//Keep draining after a failure so the callback is never held up
+		if( ok && !encoder.encode( chunk, got / frameBytes ) )
+		{
+			printf( "Encoding failed, discarding the rest of the recording!\n" );
+			ok = false;
+		}
+		dataBytes += got;
+		statsAdd( gWriterBytes, got );
+
+		//Pretend the encoder got stuck now and then
+		if( gEncoderStallMs > 0 && dataBytes >= nextStall )
+		{
+			SDL_Delay( gEncoderStallMs );
+			nextStall += gReceivedRecordingSpec.freq * frameBytes;
+		}
+	}
+
+	encoder.close();
+	delete[] chunk;
+	gRecordedBytes = dataBytes;
+	gRecordingFileBytes = encoder.getFileBytes();
+	return ok ? 0 : -1;
+}
+
+bool writePlaybackRing( const Uint8* data, Uint32 len )
+{
+	//Wait for room, the reader is allowed to block
+	while( len > 0 )
+	{
+		if( SDL_AtomicGet( &gStopReader ) )
+		{
+			return false;
+		}
+		Uint32 written = gPlaybackRing.write( data, len );
+		data += written;
+		len -= written;
+		if( len > 0 )
+		{
+			SDL_Delay( DISK_POLL_MS );
+		}
+	}
+	return true;
+}
+
+int playbackDecoderThread( void* data )
+{
+	AVFormatContext* format = NULL;
+	AVCodecContext* codec = NULL;
+	SwrContext* resampler = NULL;
+	AVCodec* decoder = NULL;
+	int stream = -1;
+
+	//Open the compressed recording
+	if( avformat_open_input( &format, gRecordingFile, NULL, NULL ) == 0 && avformat_find_stream_info( format, NULL ) >= 0 )
+	{
+		stream = av_find_best_stream( format, AVMEDIA_TYPE_AUDIO, -1, -1, &decoder, 0 );
+	}
+	if( stream >= 0 )
+	{
+		codec = avcodec_alloc_context3( decoder );
+		avcodec_parameters_to_context( codec, format->streams[ stream ]->codecpar );
+		if( codec->channel_layout == 0 )
+		{
+			codec->channel_layout = av_get_default_channel_layout( codec->channels );
+		}
+		if( avcodec_open2( codec, decoder, NULL ) == 0 )
+		{
+			//Convert back to what the playback device takes
+			resampler = swr_alloc_set_opts( NULL, av_get_default_channel_layout( gReceivedPlaybackSpec.channels ), AV_SAMPLE_FMT_FLT, gReceivedPlaybackSpec.freq,
+				codec->channel_layout, codec->sample_fmt, codec->sample_rate, 0, NULL );
+		}
+	}
+	if( resampler == NULL || swr_init( resampler ) < 0 )
+	{
+		printf( "Unable to decode %s!\n", gRecordingFile );
+		swr_free( &resampler );
+		avcodec_free_context( &codec );
+		avformat_close_input( &format );
+		SDL_AtomicSet( &gPlaybackFileDone, 1 );
+		return -1;
+	}
+
+	AVFrame* frame = av_frame_alloc();
+	AVPacket packet;
+	av_init_packet( &packet );
+	Uint32 frameBytes = gReceivedPlaybackSpec.channels * sizeof( float );
+	Uint8* converted = NULL;
+	int convertedCapacity = 0;
+	bool flushing = false;
+	bool ok = true;
+
+	while( ok )
+	{
+		//Feed the decoder, an empty packet flushes it at the end of the file
+		if( !flushing )
+		{
+			if( av_read_frame( format, &packet ) < 0 )
+			{
+				flushing = true;
+				avcodec_send_packet( codec, NULL );
+			}
+			else
+			{
+				if( packet.stream_index == stream )
+				{
+					avcodec_send_packet( codec, &packet );
+				}
+				av_packet_unref( &packet );
+			}
+		}
+
+		//Convert each decoded frame into the playback ring
+		int received = 0;
+		while( ok && ( received = avcodec_receive_frame( codec, frame ) ) == 0 )
+		{
+			int outFrames = swr_get_out_samples( resampler, frame->nb_samples );
+			if( outFrames > convertedCapacity )
+			{
+				delete[] converted;
+				converted = new Uint8[ outFrames * frameBytes ];
+				convertedCapacity = outFrames;
+			}
+			int got = swr_convert( resampler, &converted, convertedCapacity, (const Uint8**)frame->extended_data, frame->nb_samples );
+			ok = got >= 0 && writePlaybackRing( converted, got * frameBytes );
+		}
+		if( flushing && received == AVERROR_EOF )
+		{
+			break;
+		}
+	}
+
+	SDL_AtomicSet( &gPlaybackFileDone, 1 );
+	delete[] converted;
+	av_frame_free( &frame );
+	swr_free( &resampler );
+	avcodec_free_context( &codec );
+	avformat_close_input( &format );
+	return 0;
+}
+
+int multitrackWriterThread( void* data )
+{
+	//Open the output file
+	int fd = open( MULTITRACK_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+	if( fd < 0 )
+	{
+		printf( "Unable to create %s! %s\n", MULTITRACK_FILE, strerror( errno ) );
+		return -1;
+	}
+
+	//Stereo per device, interleaved into one wide frame
+	SDL_AudioSpec fileSpec;
+	SDL_zero( fileSpec );
+	fileSpec.freq = 44100;
+	fileSpec.format = AUDIO_F32;
+	fileSpec.channels = gTrackCount * 2;
+	Uint32 outFrameBytes = fileSpec.channels * sizeof( float );
+
+	void* staging = NULL;
+	if( posix_memalign( &staging, DISK_ALIGNMENT, DISK_CHUNK_BYTES ) != 0 )
+	{
+		close( fd );
+		return -1;
+	}
+	Uint8* chunk = (Uint8*)staging;
+	memset( chunk, 0, WAV_HEADER_BYTES );
+	Uint32 filled = WAV_HEADER_BYTES;
+	float* trackOut = new float[ MULTITRACK_CHUNK_FRAMES * 2 ];
+
+	//Per track correction state
+	double ratio[ MAX_RECORDING_DEVICES ];
+	double worstError[ MAX_RECORDING_DEVICES ];
+	int starvedChunks[ MAX_RECORDING_DEVICES ];
+	for( int t = 0; t < gTrackCount; ++t )
+	{
+		ratio[ t ] = 1.0;
+		worstError[ t ] = 0.0;
+		starvedChunks[ t ] = 0;
+	}
+
+	//Wait for every device to deliver, then drop what each captured before the last one started
+	bool aligned = false;
+	Uint64 dataBytes = 0;
+	Uint64 framesOut = 0;
+	bool ok = true;
+
+	while( ok )
+	{
+		bool stopping = SDL_AtomicGet( &gStopMultitrack ) != 0;
+		for( int t = 0; t < gTrackCount; ++t )
+		{
+			gTracks[ t ].updateClock();
+		}
+
+		if( !aligned )
+		{
+			bool started = true;
+			double latestStart = 0;
+			for( int t = 0; t < gTrackCount; ++t )
+			{
+				started = started && gTracks[ t ].hasStarted();
+				latestStart = SDL_max( latestStart, gTracks[ t ].getStartTime() );
+			}
+			if( !started )
+			{
+				if( stopping )
+				{
+					break;
+				}
+				SDL_Delay( DISK_POLL_MS );
+				continue;
+			}
+			for( int t = 0; t < gTrackCount; ++t )
+			{
+				Uint32 lead = (Uint32)( ( latestStart - gTracks[ t ].getStartTime() ) * fileSpec.freq + 0.5 );
+				gTracks[ t ].getResampler().skip( gTracks[ t ].getRing(), lead );
+			}
+			aligned = true;
+		}
+
+		//Each track reads at its clock relative to the reference, bent toward the
+		//reference's capture time so alignment holds however long it runs
+		double referenceRate = gTracks[ 0 ].getRate();
+		double referenceTime = gTracks[ 0 ].getTime( gTracks[ 0 ].getResampler().getPosition() );
+		for( int t = 1; t < gTrackCount; ++t )
+		{
+			double error = gTracks[ t ].getTime( gTracks[ t ].getResampler().getPosition() ) - referenceTime;
+			double correction = SDL_max( -MULTITRACK_MAX_RATIO_OFFSET, SDL_min( MULTITRACK_MAX_RATIO_OFFSET, -error * MULTITRACK_ALIGN_GAIN ) );
+			ratio[ t ] = gTracks[ t ].getRate() / referenceRate * ( 1.0 + correction );
+			if( fabs( error ) > worstError[ t ] && framesOut > (Uint64)fileSpec.freq )
+			{
+				worstError[ t ] = fabs( error );
+			}
+		}
+
+		//Go a chunk at a time once the reference has one
+		LRingBuffer& referenceRing = gTracks[ 0 ].getRing();
+		Uint32 referenceFrames = referenceRing.readAvailable() / ( 2 * sizeof( float ) );
+		if( referenceFrames < gTracks[ 0 ].getResampler().framesNeeded( MULTITRACK_CHUNK_FRAMES, 1.0 ) )
+		{
+			if( stopping )
+			{
+				break;
+			}
+			SDL_Delay( DISK_POLL_MS );
+			continue;
+		}
+
+		//Hold on for tracks running late, unless the reference is backing up
+		bool waiting = false;
+		bool backedUp = referenceRing.writeAvailable() < referenceRing.getSize() / 2;
+		for( int t = 1; t < gTrackCount; ++t )
+		{
+			Uint32 available = gTracks[ t ].getRing().readAvailable() / ( 2 * sizeof( float ) );
+			waiting = waiting || ( available < gTracks[ t ].getResampler().framesNeeded( MULTITRACK_CHUNK_FRAMES, ratio[ t ] ) && !backedUp && !stopping );
+		}
+		if( waiting )
+		{
+			SDL_Delay( 1 );
+			continue;
+		}
+
+		//Resample every track into its pair of channels
+		for( int t = 0; t < gTrackCount; ++t )
+		{
+			Uint32 made = gTracks[ t ].getResampler().process( gTracks[ t ].getRing(), trackOut, MULTITRACK_CHUNK_FRAMES, t == 0 ? 1.0 : ratio[ t ] );
+			if( made < (Uint32)MULTITRACK_CHUNK_FRAMES )
+			{
+				memset( &trackOut[ made * 2 ], 0, ( MULTITRACK_CHUNK_FRAMES - made ) * 2 * sizeof( float ) );
+				++starvedChunks[ t ];
+			}
+
+			for( int i = 0; i < MULTITRACK_CHUNK_FRAMES; ++i )
+			{
+				float* frame = (float*)( chunk + filled + i * outFrameBytes );
+				frame[ t * 2 ] = trackOut[ i * 2 ];
+				frame[ t * 2 + 1 ] = trackOut[ i * 2 + 1 ];
+			}
+		}
+		filled += MULTITRACK_CHUNK_FRAMES * outFrameBytes;
+		dataBytes += MULTITRACK_CHUNK_FRAMES * outFrameBytes;
+		framesOut += MULTITRACK_CHUNK_FRAMES;
+
+		//Flush once another chunk would not fit
+		if( filled + MULTITRACK_CHUNK_FRAMES * outFrameBytes > (Uint32)DISK_CHUNK_BYTES )
+		{
+			ok = writeFully( fd, chunk, filled );
+			filled = 0;
+		}
+
+		//Report drift now and then
+		if( framesOut % ( MULTITRACK_REPORT_SECONDS * fileSpec.freq ) < MULTITRACK_CHUNK_FRAMES || stopping )
+		{
+			referenceTime = gTracks[ 0 ].getTime( gTracks[ 0 ].getResampler().getPosition() );
+			for( int t = 1; t < gTrackCount; ++t )
+			{
+				double drift = ( gTracks[ t ].getRate() / referenceRate - 1.0 ) * 1000000;
+				double error = gTracks[ t ].getTime( gTracks[ t ].getResampler().getPosition() ) - referenceTime;
+				printf( "track %d %s: drift %+.1f ppm, correction %+.1f ppm, alignment %+.1f us ( worst %.1f us ), %d dropped, %d starved\n",
+					t, gTracks[ t ].getName(), drift, ( ratio[ t ] * referenceRate / gTracks[ t ].getRate() - 1.0 ) * 1000000,
+					error * 1000000, worstError[ t ] * 1000000, gTracks[ t ].getDroppedBlocks(), starvedChunks[ t ] );
+			}
+			printf( "track 0 %s: reference at %.1f Hz, %d dropped\n", gTracks[ 0 ].getName(), referenceRate, gTracks[ 0 ].getDroppedBlocks() );
+		}
+	}
+
+	//Write what is left and the final header
+	if( ok && filled > 0 )
+	{
+		ok = writeFully( fd, chunk, filled );
+	}
+	fillWavHeader( chunk, fileSpec, SAMPLE_F32, dataBytes );
+	if( pwrite( fd, chunk, WAV_HEADER_BYTES, 0 ) != WAV_HEADER_BYTES )
+	{
+		printf( "Failed to finish %s header!\n", MULTITRACK_FILE );
+	}
+	printf( "Wrote %.1f seconds of %d tracks to %s\n", (double)framesOut / fileSpec.freq, gTrackCount, MULTITRACK_FILE );
+
+	close( fd );
+	::free( staging );
+	delete[] trackOut;
+	return ok ? 0 : -1;
+}
+
+bool startMultitrackCapture()
+{
+	//The main devices may hold one of the capture devices
+	closeAudioDevices();
+
+	//Selected device first so it is the clock reference
+	Uint64 epoch = SDL_GetPerformanceCounter();
+	gTrackCount = 0;
+	for( int i = 0; i < gRecordingDeviceCount; ++i )
+	{
+		int index = i == 0 ? gRecordingDeviceIndex : ( i == gRecordingDeviceIndex ? 0 : i );
+		if( gTracks[ gTrackCount ].open( index, epoch ) )
+		{
+			++gTrackCount;
+		}
+	}
+	if( gTrackCount == 0 )
+	{
+		openAudioDevices( gRecordingDeviceIndex, RECORDING_BUFFER_SAMPLES );
+		return false;
+	}
+
+	//Start the writer, then all devices as close together as possible
+	SDL_AtomicSet( &gStopMultitrack, 0 );
+	gMultitrackThread = SDL_CreateThread( multitrackWriterThread, "MultitrackWriter", NULL );
+	if( gMultitrackThread == NULL )
+	{
+		//Nobody would drain the tracks, back to the selected device
+		printf( "Failed to start multitrack writer! SDL Error: %s\n", SDL_GetError() );
+		stopMultitrackCapture();
+		openAudioDevices( gRecordingDeviceIndex, RECORDING_BUFFER_SAMPLES );
+		return false;
+	}
+	for( int t = 0; t < gTrackCount; ++t )
+	{
+		gTracks[ t ].start();
+	}
+	printf( "Recording %d devices to %s\n", gTrackCount, MULTITRACK_FILE );
+	return true;
+}
+
+void stopMultitrackCapture()
+{
+	//Stop the devices first so the writer can drain everything
+	for( int t = 0; t < gTrackCount; ++t )
+	{
+		gTracks[ t ].stop();
+	}
+	if( gMultitrackThread != NULL )
+	{
+		SDL_AtomicSet( &gStopMultitrack, 1 );
+		SDL_WaitThread( gMultitrackThread, NULL );
+		gMultitrackThread = NULL;
+	}
+	for( int t = 0; t < gTrackCount; ++t )
+	{
+		gTracks[ t ].close();
+	}
+	gTrackCount = 0;
+}
+
+int meterWidth( float level, int width )
+{
+	//Decibels mapped onto the bar from the floor up to full scale
+	float db = level > 0 ? 20 * log10f( level ) : METER_FLOOR_DB;
+	db = SDL_max( METER_FLOOR_DB, SDL_min( 0.0f, db ) );
+	return (int)( ( db - METER_FLOOR_DB ) / -METER_FLOOR_DB * width );
+}
+
+void renderMeters()
+{
+	LLevelMeter* meters[] = { &gInputMeter, &gOutputMeter };
+	const int barHeight = 8;
+	const int margin = 20;
+	int width = SCREEN_WIDTH - margin * 2;
+	int y = SCREEN_HEIGHT - margin - 5 * barHeight;
+
+	const char* names[] = { "In", "Out" };
+	int lineHeight = gTextAtlas.getLineHeight();
+	y -= 2 * lineHeight;
+
+	for( int m = 0; m < 2; ++m )
+	{
+		const LevelReading& levels = meters[ m ]->getLevels();
+
+		//Loudest channel in numbers above the bars
+		float peak = SDL_max( levels.peak[ 0 ], levels.peak[ 1 ] );
+		float truePeak = SDL_max( levels.truePeak[ 0 ], levels.truePeak[ 1 ] );
+		char label[ 64 ];
+		snprintf( label, sizeof( label ), "%s  peak %.1f dB  true peak %.1f dBTP", names[ m ],
+			peak > 0 ? 20 * log10f( peak ) : -INFINITY, truePeak > 0 ? 20 * log10f( truePeak ) : -INFINITY );
+		gTextAtlas.render( label, margin, y, gTextColor );
+		y += lineHeight;
+
+		for( int c = 0; c < METER_CHANNELS; ++c )
+		{
+			//Background
+			SDL_Rect bar = { margin, y, width, barHeight - 2 };
+			SDL_SetRenderDrawColor( gRenderer, 0xDD, 0xDD, 0xDD, 0xFF );
+			SDL_RenderFillRect( gRenderer, &bar );
+
+			//RMS as the solid bar
+			bar.w = meterWidth( levels.rms[ c ], width );
+			SDL_SetRenderDrawColor( gRenderer, 0x30, 0xB0, 0x30, 0xFF );
+			SDL_RenderFillRect( gRenderer, &bar );
+
+			//Sample peak as a line, true peak red once it reaches full scale
+			SDL_Rect tick = { margin + meterWidth( levels.peak[ c ], width ), y, 2, barHeight - 2 };
+			SDL_SetRenderDrawColor( gRenderer, 0x20, 0x20, 0x20, 0xFF );
+			SDL_RenderFillRect( gRenderer, &tick );
+			tick.x = margin + meterWidth( levels.truePeak[ c ], width );
+			if( levels.truePeak[ c ] >= 1.0f )
+			{
+				SDL_SetRenderDrawColor( gRenderer, 0xE0, 0x20, 0x20, 0xFF );
+			}
+			else
+			{
+				SDL_SetRenderDrawColor( gRenderer, 0x90, 0x90, 0x90, 0xFF );
+			}
+			SDL_RenderFillRect( gRenderer, &tick );
+			y += barHeight;
+		}
+		y += barHeight;
+	}
+}
+
+void printMeterOverhead( const char* name, LLevelMeter& meter, const SDL_AudioSpec& spec )
+{
+	const LevelReading& levels = meter.getLevels();
+	if( levels.meteredFrames > 0 )
+	{
+		double metering = (double)levels.meterTicks / SDL_GetPerformanceFrequency();
+		double audio = (double)levels.meteredFrames / spec.freq;
+		printf( "%s metering took %.3f%% of the callback budget at %d sample blocks\n", name, metering / audio * 100, spec.samples );
+	}
+}
+
+void benchmarkMeters()
+{
+	//A couple of seconds of loud noise in the smallest block size we care about
+	LLevelMeter* meter = new LLevelMeter;
+	meter->setup( 44100 );
+	float* block = new float[ METER_BENCH_FRAMES * METER_CHANNELS * 64 ];
+	for( int i = 0; i < METER_BENCH_FRAMES * METER_CHANNELS * 64; ++i )
+	{
+		block[ i ] = (float)rand() / RAND_MAX * 2 - 1;
+	}
+
+	Uint64 start = SDL_GetPerformanceCounter();
+	for( int b = 0; b < METER_BENCH_BLOCKS; ++b )
+	{
+		meter->process( &block[ ( b % 64 ) * METER_BENCH_FRAMES * METER_CHANNELS ], METER_BENCH_FRAMES );
+	}
+	double seconds = (double)( SDL_GetPerformanceCounter() - start ) / SDL_GetPerformanceFrequency();
+
+	//Each block has 64 frames worth of time to be produced in
+	double perBlockUs = seconds / METER_BENCH_BLOCKS * 1000000;
+	double budgetUs = METER_BENCH_FRAMES * 1000000.0 / 44100;
+	const LevelReading& levels = meter->getLevels();
+	printf( "meter: %.3f us per %d frame stereo block, %.3f%% of the %.0f us budget ( peak %.2f rms %.2f true peak %.2f )\n",
+		perBlockUs, METER_BENCH_FRAMES, perBlockUs / budgetUs * 100, budgetUs, levels.peak[ 0 ], levels.rms[ 0 ], levels.truePeak[ 0 ] );
+
+	delete[] block;
+	delete meter;
+}
+
+void benchmarkConversion()
+{
+	//Loud noise, a little over full scale now and then so clipping is part of the cost
+	float* samples = new float[ CONVERT_BENCH_SAMPLES ];
+	Uint8* stored = new Uint8[ CONVERT_BENCH_SAMPLES * sizeof( float ) ];
+	for( int i = 0; i < CONVERT_BENCH_SAMPLES; ++i )
+	{
+		samples[ i ] = (float)rand() / RAND_MAX * 2.2f - 1.1f;
+	}
+
+	const char* names[] = { "f32", "s16", "s24" };
+	SampleFormat formats[] = { SAMPLE_F32, SAMPLE_S16, SAMPLE_S24 };
+	LSampleConverter converter;
+	for( int f = 0; f < 3; ++f )
+	{
+		for( int dither = 0; dither < 2; ++dither )
+		{
+			converter.setup( formats[ f ], dither != 0 );
+			Uint64 start = SDL_GetPerformanceCounter();
+			for( int r = 0; r < CONVERT_BENCH_ROUNDS; ++r )
+			{
+				converter.fromFloat( samples, stored, CONVERT_BENCH_SAMPLES );
+			}
+			Uint64 encodeTicks = SDL_GetPerformanceCounter() - start;
+
+			start = SDL_GetPerformanceCounter();
+			for( int r = 0; r < CONVERT_BENCH_ROUNDS; ++r )
+			{
+				converter.toFloat( stored, samples, CONVERT_BENCH_SAMPLES );
+			}
+			Uint64 decodeTicks = SDL_GetPerformanceCounter() - start;
+
+			//Samples per nanosecond, the F32 rows are plain copies for reference
+			double samplesTotal = (double)CONVERT_BENCH_SAMPLES * CONVERT_BENCH_ROUNDS;
+			double perTick = 1e9 / SDL_GetPerformanceFrequency();
+			printf( "convert %s%s: to %.3f samples/ns, back %.3f samples/ns\n", names[ f ], dither ? " dither" : "",
+				samplesTotal / ( encodeTicks * perTick ), samplesTotal / ( decodeTicks * perTick ) );
+		}
+	}
+
+	delete[] stored;
+	delete[] samples;
+}
+
+int runHeadless()
+{
+	//Timers and threads only, no video, fonts or audio devices
+	if( SDL_Init( 0 ) < 0 )
+	{
+		printf( "SDL could not initialize! SDL Error: %s\n", SDL_GetError() );
+		return 1;
+	}
+
+	//Same layout the recording device is asked for
+	SDL_AudioSpec spec;
+	SDL_zero( spec );
+	spec.freq = 44100;
+	spec.format = AUDIO_F32;
+	spec.channels = 2;
+	spec.samples = RECORDING_BUFFER_SAMPLES;
+	spec.size = spec.samples * spec.channels * sizeof( float );
+	gReceivedRecordingSpec = spec;
+	gReceivedPlaybackSpec = spec;
+	bool allocated = allocateStreams();
+	SDL_AtomicSet( &gAudioMode, AUDIO_MODE_RECORD );
+
+	LSyntheticSource* source = new LSyntheticSource;
+	int result = 1;
+	if( allocated && source->open( gSyntheticSource, spec ) && startCaptureWriter() )
+	{
+		//Record until the source has delivered everything
+		Uint64 frames = (Uint64)( gHeadlessSeconds * spec.freq );
+		if( !source->start( gHeadlessSpeed, frames ) )
+		{
+			printf( "Failed to start synthetic source! SDL Error: %s\n", SDL_GetError() );
+		}
+		else
+		{
+			while( !source->isDone() )
+			{
+				SDL_Delay( DISK_POLL_MS );
+			}
+			source->stop();
+
+			//How long the writer needs to catch up and finish the file
+			Uint64 drainStart = SDL_GetPerformanceCounter();
+			stopCaptureWriter();
+			double drainMs = (double)( SDL_GetPerformanceCounter() - drainStart ) * 1000 / SDL_GetPerformanceFrequency();
+
+			//Capture path report
+			double frequency = (double)SDL_GetPerformanceFrequency();
+			double elapsed = source->getElapsedTicks() / frequency;
+			double audioSeconds = (double)source->getBlocks() * spec.samples / spec.freq;
+			double budgetUs = spec.samples * 1000000.0 / spec.freq;
+			double meanUs = source->getBlocks() > 0 ? source->getCallbackTicks() / frequency / source->getBlocks() * 1000000 : 0.0;
+			double maxUs = source->getMaxCallbackTicks() / frequency * 1000000;
+			double storedBytesPerSecond = (double)spec.freq * spec.channels * gCaptureConverter.getSampleBytes();
+			printf( "headless: %s, %.1f s of audio in %.2f s ( %.1fx real time )\n", gSyntheticSource.c_str(), audioSeconds, elapsed, elapsed > 0 ? audioSeconds / elapsed : 0.0 );
+			printf( "callback: mean %.2f us, max %.2f us per %d frame block, %.3f%% of the %.0f us budget\n",
+				meanUs, maxUs, spec.samples, meanUs / budgetUs * 100, budgetUs );
+			printf( "ring: %.2f MB/s, peak fill %.1f ms of %d ms\n", elapsed > 0 ? gRecordedBytes / elapsed / 1048576 : 0.0,
+				source->getPeakRingFill() * 1000.0 / storedBytesPerSecond, RING_BUFFER_SECONDS * 1000 );
+			printf( "writer: dropped %d of %d blocks, finished %.1f ms after the last block\n",
+				SDL_AtomicGet( &gDroppedBlocks ), SDL_AtomicGet( &gCapturedBlocks ), drainMs );
+			printf( "output: %s, %.1f KB\n", gRecordingFile, gRecordingFileBytes / 1024.0 );
+			result = SDL_AtomicGet( &gDroppedBlocks ) == 0 ? 0 : 2;
+		}
+	}
+	delete source;
+
+	//Free everything the app would
+	stopCaptureWriter();
+	gMonitorResampler.free();
+	gMonitorRing.free();
+	gCaptureRing.free();
+	gVoiceGate.free();
+	gPlaybackRing.free();
+	gRecordingStore.clear();
+	gChunkPool.free();
+	delete[] gCaptureScratch;
+	delete[] gPlaybackScratch;
+	gCaptureScratch = NULL;
+	gPlaybackScratch = NULL;
+	gStats.stop();
+	SDL_Quit();
+	return result;
+}
+
+Sint64 sampleRingFill( void* ring )
+{
+	//Ring positions are atomic, so the export thread can read the fill any time
+	return ( (LRingBuffer*)ring )->readAvailable();
+}
+
+void startStats()
+{
+	//Counters the callbacks and disk threads already keep
+	gStats.addAtomic( "capture.blocks", &gCapturedBlocks );
+	gStats.addAtomic( "capture.dropped_blocks", &gDroppedBlocks );
+	gStats.addAtomic( "capture.dropped_bytes", &gDroppedBytes );
+	gStats.addAtomic( "monitor.underruns", &gMonitorUnderruns );
+	gStats.addAtomic( "monitor.overruns", &gMonitorOverruns );
+	gStats.addAtomic( "monitor.drift_ppm", &gMonitorDriftPpm );
+	gStats.addAtomic( "vad.segments", &gVoiceSegments );
+	gStats.addAtomic( "vad.blocks", &gVoiceBlocks );
+
+	//Queue depths between the callbacks and the threads
+	gStats.addSampled( "capture_ring.bytes", sampleRingFill, &gCaptureRing );
+	gStats.addSampled( "playback_ring.bytes", sampleRingFill, &gPlaybackRing );
+	gStats.addSampled( "monitor_ring.bytes", sampleRingFill, &gMonitorRing );
+
+	gWriterBytes = gStats.addCounter( "writer.bytes" );
+	gStats.addCallbackProfiler( "recording_callback", &gRecordingProfiler );
+	gStats.addCallbackProfiler( "playback_callback", &gPlaybackProfiler );
+
+	gStats.start( getenv( "STATS_EXPORT" ) );
+}
+
+bool parseArguments( int argc, char* args[] )
+{
+	for( int i = 1; i < argc; ++i )
+	{
+		std::string arg = args[ i ];
+		if( arg == "--encode" && i + 1 < argc )
+		{
+			std::string codec = args[ ++i ];
+			if( codec == "flac" )
+			{
+				gStorageFormat = STORAGE_FLAC;
+				gRecordingFile = RECORDING_FLAC_FILE;
+			}
+			else if( codec == "opus" )
+			{
+				gStorageFormat = STORAGE_OPUS;
+				gRecordingFile = RECORDING_OPUS_FILE;
+			}
+			else
+			{
+				return false;
+			}
+		}
+		else if( arg == "--encoder-stall" && i + 1 < argc )
+		{
+			gEncoderStallMs = atoi( args[ ++i ] );
+		}
+		else if( arg == "--format" && i + 1 < argc )
+		{
+			std::string format = args[ ++i ];
+			if( format == "f32" )
+			{
+				gSampleFormat = SAMPLE_F32;
+			}
+			else if( format == "s16" )
+			{
+				gSampleFormat = SAMPLE_S16;
+			}
+			else if( format == "s24" )
+			{
+				gSampleFormat = SAMPLE_S24;
+			}
+			else
+			{
+				return false;
+			}
+		}
+		else if( arg == "--dither" )
+		{
+			gDither = true;
+		}
+		else if( arg == "--bench-convert" )
+		{
+			gBenchmarkConversion = true;
+		}
+		else if( arg == "--headless" && i + 1 < argc )
+		{
+			gHeadlessSeconds = atof( args[ ++i ] );
+			if( gHeadlessSeconds <= 0 )
+			{
+				return false;
+			}
+		}
+		else if( arg == "--source" && i + 1 < argc )
+		{
+			gSyntheticSource = args[ ++i ];
+		}
+		else if( arg == "--speed" && i + 1 < argc )
+		{
+			gHeadlessSpeed = atof( args[ ++i ] );
+			if( gHeadlessSpeed < 0 )
+			{
+				return false;
+			}
+		}
+		else if( arg == "--vad" )
+		{
+			gVoiceActivated = true;
+		}
+		else if( arg == "--bench-meter" )
+		{
+			gBenchmarkMeters = true;
+		}
+		else
+		{
+			return false;
+		}
+	}
+
+	//Encoders take float and convert to what the codec wants themselves
+	if( gStorageFormat != STORAGE_WAV && gSampleFormat != SAMPLE_F32 )
+	{
+		printf( "--format only applies to WAV recordings, encoding from f32\n" );
+		gSampleFormat = SAMPLE_F32;
+	}
+	return true;
+}
+
+bool startCaptureWriter()
+{
+	//Chunks of the last recording go back to the pool as they are
+	gRecordingStore.clear();
+	gCaptureRing.reset();
+	SDL_AtomicSet( &gStopWriter, 0 );
+	SDL_AtomicSet( &gDroppedBytes, 0 );
+	SDL_AtomicSet( &gCapturedBlocks, 0 );
+	SDL_AtomicSet( &gDroppedBlocks, 0 );
+	SDL_AtomicSet( &gVoiceSegments, 0 );
+	SDL_AtomicSet( &gVoiceBlocks, 0 );
+	gVoiceGate.reset();
+
+	//Raw WAV goes straight to disk, anything else through the encoder
+	if( gStorageFormat == STORAGE_WAV )
+	{
+		gWriterThread = SDL_CreateThread( captureWriterThread, "CaptureWriter", NULL );
+	}
+	else
+	{
+		gWriterThread = SDL_CreateThread( captureEncoderThread, "CaptureEncoder", NULL );
+	}
+	return gWriterThread != NULL;
+}
+
+void stopCaptureWriter()
+{
+	if( gWriterThread != NULL )
+	{
+		SDL_AtomicSet( &gStopWriter, 1 );
+		SDL_WaitThread( gWriterThread, NULL );
+		gWriterThread = NULL;
+	}
+}
+
+bool startPlaybackReader()
+{
+	gPlaybackRing.reset();
+	SDL_AtomicSet( &gStopReader, 0 );
+	SDL_AtomicSet( &gPlaybackFileDone, 0 );
+	if( gStorageFormat == STORAGE_WAV )
+	{
+		gReaderThread = SDL_CreateThread( playbackReaderThread, "PlaybackReader", NULL );
+	}
+	else
+	{
+		gReaderThread = SDL_CreateThread( playbackDecoderThread, "PlaybackDecoder", NULL );
+	}
+	return gReaderThread != NULL;
+}
+
+void stopPlaybackReader()
+{
+	if( gReaderThread != NULL )
+	{
+		SDL_AtomicSet( &gStopReader, 1 );
+		SDL_WaitThread( gReaderThread, NULL );
+		gReaderThread = NULL;
+	}
+}
+
+bool openAudioDevices( int index, Uint16 samples )
+{
+	//Get rid of devices from a previous mode
+	closeAudioDevices();
+	gRecordingDeviceIndex = index;
+
+	//Default audio spec, no format change so monitoring can rely on F32
+	SDL_AudioSpec desiredRecordingSpec;
+	SDL_zero(desiredRecordingSpec);
+	desiredRecordingSpec.freq = 44100;
+	desiredRecordingSpec.format = AUDIO_F32;
+	desiredRecordingSpec.channels = 2;
+	desiredRecordingSpec.samples = samples;
+	desiredRecordingSpec.callback = audioRecordingCallback;
+	callbackProfilerWrap( &gRecordingProfiler, "recording", &desiredRecordingSpec );
+
+	//Open recording device
+	gRecordingDeviceId = SDL_OpenAudioDevice( SDL_GetAudioDeviceName( index, SDL_TRUE ), SDL_TRUE, &desiredRecordingSpec, &gReceivedRecordingSpec, 0 );
+	if( gRecordingDeviceId == 0 )
+	{
+		printf( "Failed to open recording device! SDL Error: %s", SDL_GetError() );
+		return false;
+	}
+
+	//Default audio spec
+	SDL_AudioSpec desiredPlaybackSpec;
+	SDL_zero(desiredPlaybackSpec);
+	desiredPlaybackSpec.freq = 44100;
+	desiredPlaybackSpec.format = AUDIO_F32;
+	desiredPlaybackSpec.channels = 2;
+	desiredPlaybackSpec.samples = samples;
+	desiredPlaybackSpec.callback = audioPlaybackCallback;
+	callbackProfilerWrap( &gPlaybackProfiler, "playback", &desiredPlaybackSpec );
+
+	//Open playback device
+	gPlaybackDeviceId = SDL_OpenAudioDevice( NULL, SDL_FALSE, &desiredPlaybackSpec, &gReceivedPlaybackSpec, 0 );
+	if( gPlaybackDeviceId == 0 )
+	{
+		printf( "Failed to open playback device! SDL Error: %s", SDL_GetError() );
+		closeAudioDevices();
+		return false;
+	}
+
+	//Profile against the buffer sizes the devices gave us
+	callbackProfilerStart( &gRecordingProfiler, &gReceivedRecordingSpec );
+	callbackProfilerStart( &gPlaybackProfiler, &gReceivedPlaybackSpec );
+
+	if( !allocateStreams() )
+	{
+		closeAudioDevices();
+		return false;
+	}
+	return true;
+}
+
+bool allocateStreams()
+{
+	//Calculate per sample bytes
+	int bytesPerSample = gReceivedRecordingSpec.channels * ( SDL_AUDIO_BITSIZE( gReceivedRecordingSpec.format ) / 8 );
+
+	//Callbacks convert between device floats and the storage format
+	gCaptureConverter.setup( gSampleFormat, gDither );
+	gPlaybackConverter.setup( gSampleFormat, false );
+	delete[] gCaptureScratch;
+	delete[] gPlaybackScratch;
+	gCaptureScratch = new Uint8[ gReceivedRecordingSpec.size ];
+	gPlaybackScratch = new Uint8[ gReceivedPlaybackSpec.size ];
+
+	//Calculate bytes per second as stored
+	int storedBytesPerSecond = gReceivedRecordingSpec.freq * gReceivedRecordingSpec.channels * gCaptureConverter.getSampleBytes();
+
+	//Allocate rings between the callbacks and the disk threads
+	gCaptureRing.allocate( RING_BUFFER_SECONDS * storedBytesPerSecond );
+	gPlaybackRing.allocate( RING_BUFFER_SECONDS * storedBytesPerSecond );
+
+	//Monitor ring only needs a few device blocks, the fill swings by a block
+	//on each side as the callbacks interleave so aim for both blocks
+	gMonitorRing.allocate( 8 * SDL_max( gReceivedRecordingSpec.samples, gReceivedPlaybackSpec.samples ) * bytesPerSample );
+	gMonitorTargetFrames = gReceivedRecordingSpec.samples + gReceivedPlaybackSpec.samples;
+
+	//Pre-roll sized for this device
+	if( gVoiceActivated && !gVoiceGate.allocate( gReceivedRecordingSpec, gCaptureConverter.getSampleBytes() ) )
+	{
+		printf( "Failed to allocate voice gate pre-roll!\n" );
+		return false;
+	}
+
+	//Meters start over with the devices
+	gInputMeter.setup( gReceivedRecordingSpec.freq );
+	gOutputMeter.setup( gReceivedPlaybackSpec.freq );
+
+	//Room for one playback block at the highest ratio
+	gMonitorResampler.allocate( gReceivedPlaybackSpec.channels, gReceivedPlaybackSpec.samples, MONITOR_MAX_RATIO_OFFSET );
+	return true;
+}
+
+void closeAudioDevices()
+{
+	if( gRecordingDeviceId != 0 )
+	{
+		printMeterOverhead( "Input", gInputMeter, gReceivedRecordingSpec );
+		printMeterOverhead( "Output", gOutputMeter, gReceivedPlaybackSpec );
+		SDL_CloseAudioDevice( gRecordingDeviceId );
+		gRecordingDeviceId = 0;
+	}
+	if( gPlaybackDeviceId != 0 )
+	{
+		SDL_CloseAudioDevice( gPlaybackDeviceId );
+		gPlaybackDeviceId = 0;
+	}
+	gMonitorResampler.free();
+	delete[] gCaptureScratch;
+	delete[] gPlaybackScratch;
+	gCaptureScratch = NULL;
+	gPlaybackScratch = NULL;
+}
+
+bool startMonitoring()
+{
+	//Smallest buffers the devices will give us
+	if( !openAudioDevices( gRecordingDeviceIndex, MONITOR_BUFFER_SAMPLES ) )
+	{
+		return false;
+	}
+
+	//Reset the resampler, history starts out silent
+	gMonitorRing.reset();
+	gMonitorPrimed = false;
+	gMonitorRatio = 1.0;
+	gMonitorIntegral = 0.0;
+	gMonitorResampler.reset();
+	SDL_AtomicSet( &gMonitorDriftPpm, 0 );
+	SDL_AtomicSet( &gMonitorUnderruns, 0 );
+	SDL_AtomicSet( &gMonitorOverruns, 0 );
+
+	SDL_AtomicSet( &gAudioMode, AUDIO_MODE_MONITOR );
+	SDL_PauseAudioDevice( gRecordingDeviceId, SDL_FALSE );
+	SDL_PauseAudioDevice( gPlaybackDeviceId, SDL_FALSE );
+
+	printf( "Monitoring with %d/%d sample buffers, target %u frames ( %.2f ms )\n",
+		gReceivedRecordingSpec.samples, gReceivedPlaybackSpec.samples,
+		gMonitorTargetFrames, gMonitorTargetFrames * 1000.0 / gReceivedPlaybackSpec.freq );
+	return true;
+}
+
+bool stopMonitoring()
+{
+	printf( "Monitor drift %d ppm, %d underruns, %d overruns\n",
+		SDL_AtomicGet( &gMonitorDriftPpm ), SDL_AtomicGet( &gMonitorUnderruns ), SDL_AtomicGet( &gMonitorOverruns ) );
+
+	//Back to large buffers for recording
+	SDL_AtomicSet( &gAudioMode, AUDIO_MODE_RECORD );
+	return openAudioDevices( gRecordingDeviceIndex, RECORDING_BUFFER_SAMPLES );
+}
+
+bool beginLatencySize()
+{
+	if( !openAudioDevices( gRecordingDeviceIndex, LATENCY_TEST_SIZES[ gLatencySizeIndex ] ) )
+	{
+		return false;
+	}
+	gLatencyTrial = 0;
+	gLatencyHits = 0;
+	gLatencyPending = false;
+	gLatencyPhaseStart = SDL_GetTicks();
+
+	SDL_AtomicSet( &gImpulseRequested, 0 );
+	SDL_AtomicSet( &gAudioMode, AUDIO_MODE_LATENCY );
+	SDL_PauseAudioDevice( gRecordingDeviceId, SDL_FALSE );
+	SDL_PauseAudioDevice( gPlaybackDeviceId, SDL_FALSE );
+	return true;
+}
+
+bool startLatencyTest()
+{
+	printf( "Loopback latency, route the output back into the capture device\n" );
+	gLatencySizeIndex = 0;
+	return beginLatencySize();
+}
+
+bool updateLatencyTest()
+{
+	Uint32 now = SDL_GetTicks();
+
+	//Fire an impulse once the devices have settled
+	if( !gLatencyPending )
+	{
+		if( now - gLatencyPhaseStart >= LATENCY_SETTLE_MS )
+		{
+			gImpulseEmitTicks = 0;
+			gImpulseDetectTicks = 0;
+			SDL_AtomicSet( &gImpulseRequested, 1 );
+			gLatencyPending = true;
+			gLatencyPhaseStart = now;
+		}
+		return true;
+	}
+
+	//Wait for it to come back or give up
+	Uint64 emitted = gImpulseEmitTicks;
+	Uint64 detected = gImpulseDetectTicks;
+	if( emitted != 0 && detected != 0 )
+	{
+		gLatencyResults[ gLatencyHits++ ] = ( (double)detected - (double)emitted ) * 1000.0 / SDL_GetPerformanceFrequency();
+	}
+	else if( now - gLatencyPhaseStart < LATENCY_TIMEOUT_MS )
+	{
+		return true;
+	}
+	gLatencyPending = false;
+	gLatencyPhaseStart = now;
+	if( ++gLatencyTrial < LATENCY_TEST_TRIALS )
+	{
+		return true;
+	}
+
+	//Report this buffer size
+	if( gLatencyHits > 0 )
+	{
+		double best = gLatencyResults[ 0 ];
+		double sum = 0;
+		for( int i = 0; i < gLatencyHits; ++i )
+		{
+			best = SDL_min( best, gLatencyResults[ i ] );
+			sum += gLatencyResults[ i ];
+		}
+		printf( "buffer %5d ( got %5d/%5d ): round trip min %7.2f ms avg %7.2f ms ( %d/%d detected )\n",
+			LATENCY_TEST_SIZES[ gLatencySizeIndex ], gReceivedPlaybackSpec.samples, gReceivedRecordingSpec.samples,
+			best, sum / gLatencyHits, gLatencyHits, LATENCY_TEST_TRIALS );
+	}
+	else
+	{
+		printf( "buffer %5d: no impulse detected\n", LATENCY_TEST_SIZES[ gLatencySizeIndex ] );
+	}
+
+	//Next size, or back to recording if there are no more or this one will not open;
+	//the devices stay closed when recording cannot get them back either
+	if( ++gLatencySizeIndex < LATENCY_TEST_SIZE_COUNT && beginLatencySize() )
+	{
+		return true;
 	}
+	SDL_AtomicSet( &gAudioMode, AUDIO_MODE_RECORD );
+	openAudioDevices( gRecordingDeviceIndex, RECORDING_BUFFER_SAMPLES );
+	return false;
 }
 
-void LTexture::setColor( Uint8 red, Uint8 green, Uint8 blue )
+void monitorCapture( Uint8* stream, int len )
 {
-	//Modulate texture rgb
-	SDL_SetTextureColorMod( mTexture, red, green, blue );
+	//Whole blocks only so frames stay aligned
+	if( gMonitorRing.writeAvailable() >= (Uint32)len )
+	{
+		gMonitorRing.write( stream, len );
+	}
+	else
+	{
+		SDL_AtomicAdd( &gMonitorOverruns, 1 );
+	}
 }
 
-void LTexture::setBlendMode( SDL_BlendMode blending )
-{
-	//Set blending function
-	SDL_SetTextureBlendMode( mTexture, blending );
-}
-		
-void LTexture::setAlpha( Uint8 alpha )
+void monitorPlayback( Uint8* stream, int len )
 {
-	//Modulate texture alpha
-	SDL_SetTextureAlphaMod( mTexture, alpha );
+	int channels = gReceivedPlaybackSpec.channels;
+	Uint32 frameBytes = channels * sizeof( float );
+	Uint32 outFrames = len / frameBytes;
+	Uint32 fillFrames = gMonitorRing.readAvailable() / frameBytes;
+	float* out = (float*)stream;
+
+	//Hold off until the ring reaches its target
+	if( !gMonitorPrimed )
+	{
+		if( fillFrames < gMonitorTargetFrames )
+		{
+			memset( stream, 0, len );
+			return;
+		}
+		gMonitorPrimed = true;
+	}
+
+	//PI controller bends the read rate so the fill stays at target, which
+	//tracks the clock drift between the two devices
+	double error = ( (double)fillFrames - gMonitorTargetFrames ) / gMonitorTargetFrames;
+	gMonitorIntegral += error * MONITOR_DRIFT_KI;
+	gMonitorIntegral = SDL_max( -MONITOR_MAX_RATIO_OFFSET, SDL_min( MONITOR_MAX_RATIO_OFFSET, gMonitorIntegral ) );
+	gMonitorRatio = 1.0 + SDL_max( -MONITOR_MAX_RATIO_OFFSET, SDL_min( MONITOR_MAX_RATIO_OFFSET, gMonitorIntegral + error * MONITOR_DRIFT_KP ) );
+	SDL_AtomicSet( &gMonitorDriftPpm, (int)( gMonitorIntegral * 1000000 ) );
+
+	//Ran dry, output silence and prime again
+	Uint32 made = gMonitorResampler.process( gMonitorRing, out, outFrames, gMonitorRatio );
+	if( made < outFrames )
+	{
+		memset( &out[ made * channels ], 0, ( outFrames - made ) * frameBytes );
+		SDL_AtomicAdd( &gMonitorUnderruns, 1 );
+		gMonitorPrimed = false;
+	}
 }
 
-void LTexture::render( int x, int y, SDL_Rect* clip, double angle, SDL_Point* center, SDL_RendererFlip flip )
+void latencyCapture( Uint8* stream, int len )
 {
-	//Set rendering space and render to screen
-	SDL_Rect renderQuad = { x, y, mWidth, mHeight };
+	Uint64 now = SDL_GetPerformanceCounter();
 
-	//Set clip rendering dimensions
-	if( clip != NULL )
+	//Only look once an impulse is out and not yet found
+	if( gImpulseEmitTicks == 0 || gImpulseDetectTicks != 0 )
 	{
-		renderQuad.w = clip->w;
-		renderQuad.h = clip->h;
+		return;
 	}
 
-	//Render to screen
-	SDL_RenderCopyEx( gRenderer, mTexture, clip, &renderQuad, angle, center, flip );
+	int channels = gReceivedRecordingSpec.channels;
+	Uint32 frames = len / ( channels * sizeof( float ) );
+	float* in = (float*)stream;
+	for( Uint32 i = 0; i < frames * channels; ++i )
+	{
+		if( in[ i ] > LATENCY_THRESHOLD || in[ i ] < -LATENCY_THRESHOLD )
+		{
+			//The block ends now, step back to when this frame was captured
+			Uint64 back = (Uint64)( frames - i / channels ) * SDL_GetPerformanceFrequency() / gReceivedRecordingSpec.freq;
+			gImpulseDetectTicks = now - back;
+			return;
+		}
+	}
 }
 
-int LTexture::getWidth()
+void latencyPlayback( Uint8* stream, int len )
 {
-	return mWidth;
-}
+	Uint64 now = SDL_GetPerformanceCounter();
+	memset( stream, 0, len );
 
-int LTexture::getHeight()
-{
-	return mHeight;
+	//Put a short full scale burst at the top of the block
+	if( SDL_AtomicCAS( &gImpulseRequested, 1, 0 ) )
+	{
+		int channels = gReceivedPlaybackSpec.channels;
+		Uint32 frames = SDL_min( (Uint32)( len / ( channels * sizeof( float ) ) ), (Uint32)32 );
+		float* out = (float*)stream;
+		for( Uint32 i = 0; i < frames * channels; ++i )
+		{
+			out[ i ] = ( i / channels ) % 2 ? -0.9f : 0.9f;
+		}
+		gImpulseEmitTicks = now;
+	}
 }
 
-bool init()
+void audioRecordingCallback( void* userdata, Uint8* stream, int len )
 {
-	//Initialization flag
-	bool success = true;
+	//Meter what came in
+	gInputMeter.process( (const float*)stream, len / ( METER_CHANNELS * sizeof( float ) ) );
 
-	//Initialize SDL
-	if( SDL_Init( SDL_INIT_VIDEO | SDL_INIT_AUDIO ) < 0 )
+	//Dispatch on what the app is doing
+	int mode = SDL_AtomicGet( &gAudioMode );
+	if( mode == AUDIO_MODE_MONITOR )
 	{
-		printf( "SDL could not initialize! SDL Error: %s\n", SDL_GetError() );
-		success = false;
+		monitorCapture( stream, len );
+		return;
 	}
-	else
+	if( mode == AUDIO_MODE_LATENCY )
 	{
-		//Set texture filtering to linear
-		if( !SDL_SetHint( SDL_HINT_RENDER_SCALE_QUALITY, "1" ) )
-		{
-			printf( "Warning: Linear texture filtering not enabled!" );
-		}
-
-		//Create window
-		gWindow = SDL_CreateWindow( "SDL Tutorial", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, SCREEN_WIDTH, SCREEN_HEIGHT, SDL_WINDOW_SHOWN );
-		if( gWindow == NULL )
-		{
-			printf( "Window could not be created! SDL Error: %s\n", SDL_GetError() );
-			success = false;
-		}
-		else
-		{
-			//Create vsynced renderer for window
-			gRenderer = SDL_CreateRenderer( gWindow, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC );
-			if( gRenderer == NULL )
-			{
-				printf( "Renderer could not be created! SDL Error: %s\n", SDL_GetError() );
-				success = false;
-			}
-			else
-			{
-				//Initialize renderer color
-				SDL_SetRenderDrawColor( gRenderer, 0xFF, 0xFF, 0xFF, 0xFF );
+		latencyCapture( stream, len );
+		return;
+	}
 
-				//Initialize PNG loading
-				int imgFlags = IMG_INIT_PNG;
-				if( !( IMG_Init( imgFlags ) & imgFlags ) )
-				{
-					printf( "SDL_image could not initialize! SDL_image Error: %s\n", IMG_GetError() );
-					success = false;
-				}
+	//Convert to the storage format here so everything downstream moves less data
+	const float* samples = (const float*)stream;
+	Uint32 count = len / sizeof( float );
+	if( gCaptureConverter.getFormat() != SAMPLE_F32 )
+	{
+		gCaptureConverter.fromFloat( samples, gCaptureScratch, count );
+		stream = gCaptureScratch;
+		len = count * gCaptureConverter.getSampleBytes();
+	}
 
-				//Initialize SDL_ttf
-				if( TTF_Init() == -1 )
-				{
-					printf("SDL_ttf could not initialize! SDL_ttf Error: %s\n", TTF_GetError());
-					success = false;
-				}
-			}
+	//Hand audio to the writer thread, never wait on it. Whole blocks only,
+	//a partial write would split a frame and swap the channels after it
+	SDL_AtomicAdd( &gCapturedBlocks, 1 );
+	if( gVoiceActivated )
+	{
+		//Only speech reaches the writer, silence never costs disk or encoder time
+		if( !gVoiceGate.process( samples, stream, len, gCaptureRing ) )
+		{
+			SDL_AtomicAdd( &gDroppedBytes, len );
+			SDL_AtomicAdd( &gDroppedBlocks, 1 );
 		}
 	}
-
-	return success;
+	else if( gCaptureRing.writeAvailable() >= (Uint32)len )
+	{
+		gCaptureRing.write( stream, len );
+	}
+	else
+	{
+		SDL_AtomicAdd( &gDroppedBytes, len );
+		SDL_AtomicAdd( &gDroppedBlocks, 1 );
+	}
 }
 
-bool loadMedia()
+void fillPlayback( Uint8* stream, int len )
 {
-	//Loading success flag
-	bool success = true;
-
-	//Open the font
-	gFont = TTF_OpenFont( "msyh.ttc", 28 );
-	if( gFont == NULL )
+	//Dispatch on what the app is doing
+	int mode = SDL_AtomicGet( &gAudioMode );
+	if( mode == AUDIO_MODE_MONITOR )
 	{
-		printf( "Failed to load lazy font! SDL_ttf Error: %s\n", TTF_GetError() );
-		success = false;
+		monitorPlayback( stream, len );
+		return;
 	}
-	else
+	if( mode == AUDIO_MODE_LATENCY )
 	{
-		//Set starting prompt 
-		gPromptTexture.loadFromRenderedText( "Select your recording device:", gTextColor );
+		latencyPlayback( stream, len );
+		return;
+	}
 
-		//Get capture device count
-		gRecordingDeviceCount = SDL_GetNumAudioDevices( SDL_TRUE );
+	//Stored samples are expanded as they come out of the ring
+	if( gPlaybackConverter.getFormat() != SAMPLE_F32 )
+	{
+		Uint32 sampleBytes = gPlaybackConverter.getSampleBytes();
+		Uint32 frameBytes = gReceivedPlaybackSpec.channels * sampleBytes;
+		Uint32 wanted = len / sizeof( float ) * sampleBytes;
+		Uint32 available = gPlaybackRing.readAvailable();
+		Uint32 got = gPlaybackRing.read( gPlaybackScratch, SDL_min( wanted, available - available % frameBytes ) );
+		gPlaybackConverter.toFloat( gPlaybackScratch, (float*)stream, got / sampleBytes );
 
-		//No recording devices
-		if( gRecordingDeviceCount < 1 )
+		//Fill the rest with silence
+		Uint32 filled = got / sampleBytes * sizeof( float );
+		if( filled < (Uint32)len )
 		{
-			printf( "Unable to get audio capture device! SDL Error: %s\n", SDL_GetError() );
-			success = false;
-		}
-		//At least one device connected
-		else
-		{
-			//Cap recording device count
-			if( gRecordingDeviceCount > MAX_RECORDING_DEVICES )
+			memset( stream + filled, 0, len - filled );
+			if( !SDL_AtomicGet( &gPlaybackFileDone ) )
 			{
-				gRecordingDeviceCount = MAX_RECORDING_DEVICES;
+				SDL_AtomicAdd( &gDroppedBytes, wanted - got );
 			}
+		}
+		return;
+	}
 
-			//Render device names
-			std::stringstream promptText;
-			for( int i = 0; i < gRecordingDeviceCount; ++i )
-			{
-				//Get capture device name
-				promptText.str( "" );
-				promptText << i << ": " << SDL_GetAudioDeviceName( i, SDL_TRUE );
+	//Take whole frames the reader thread has ready
+	Uint32 frameBytes = gReceivedPlaybackSpec.channels * ( SDL_AUDIO_BITSIZE( gReceivedPlaybackSpec.format ) / 8 );
+	Uint32 available = gPlaybackRing.readAvailable();
+	Uint32 got = gPlaybackRing.read( stream, SDL_min( (Uint32)len, available - available % frameBytes ) );
 
-				//Set texture from name
-				gDeviceTextures[ i ].loadFromRenderedText( promptText.str().c_str(), gTextColor );
-			}
+	//Fill the rest with silence
+	if( got < (Uint32)len )
+	{
+		memset( stream + got, 0, len - got );
+		if( !SDL_AtomicGet( &gPlaybackFileDone ) )
+		{
+			SDL_AtomicAdd( &gDroppedBytes, len - got );
 		}
 	}
+}
 
-	return success;
+void audioPlaybackCallback( void* userdata, Uint8* stream, int len )
+{
+	fillPlayback( stream, len );
+
+	//Meter what goes out
+	gOutputMeter.process( (const float*)stream, len / ( METER_CHANNELS * sizeof( float ) ) );
 }
 
-void close()
+int main( int argc, char* args[] )
 {
-	//Free textures
-	gPromptTexture.free();
-	for( int i = 0; i < MAX_RECORDING_DEVICES; ++i )
+	//Pick the storage format
+	if( !parseArguments( argc, args ) )
 	{
-		gDeviceTextures[ i ].free();
+		printf( "Usage: %s [--encode flac|opus] [--encoder-stall ms] [--format f32|s16|s24] [--dither] [--vad] [--headless seconds [--source sine|bursts|file.wav] [--speed x]] [--bench-meter] [--bench-convert]\n", args[ 0 ] );
+		return 1;
 	}
 
-	//Free global font
-	TTF_CloseFont( gFont );
-	gFont = NULL;
-
-	//Destroy window	
-	SDL_DestroyRenderer( gRenderer );
-	SDL_DestroyWindow( gWindow );
-	gWindow = NULL;
-	gRenderer = NULL;
-
-	//Free playback audio
-	if( gRecordingBuffer != NULL )
+	//Measure metering cost and quit
+	if( gBenchmarkMeters )
 	{
-		delete[] gRecordingBuffer;
-		gRecordingBuffer = NULL;
+		benchmarkMeters();
+		return 0;
 	}
 
-	//Quit SDL subsystems
-	TTF_Quit();
-	IMG_Quit();
-	SDL_Quit();
-}
+	//Measure conversion throughput and quit
+	if( gBenchmarkConversion )
+	{
+		benchmarkConversion();
+		return 0;
+	}
 
-void audioRecordingCallback( void* userdata, Uint8* stream, int len )
-{
-	//Copy audio from stream
-	memcpy( &gRecordingBuffer[ gBufferBytePosition ], stream, len );
+	//Have the writer's chunks ready and resident
+	gChunkPool.reserve( POOL_RESERVE_CHUNKS );
 
-	//Move along buffer
-	gBufferBytePosition += len;
-}
+	//Publish stats for scraping if asked to
+	startStats();
 
-void audioPlaybackCallback( void* userdata, Uint8* stream, int len )
-{
-	//Copy audio to stream
-	memcpy( stream, &gRecordingBuffer[ gBufferBytePosition ], len );
+	//Record from the synthetic source and quit, no window needed
+	if( gHeadlessSeconds > 0 )
+	{
+#if LIBAVFORMAT_VERSION_INT < AV_VERSION_INT( 58, 9, 100 )
+		av_register_all();
+#endif
+		return runHeadless();
+	}
 
-	//Move along buffer
-	gBufferBytePosition += len;
-}
+#if LIBAVFORMAT_VERSION_INT < AV_VERSION_INT( 58, 9, 100 )
+	//Register all formats and codecs
+	av_register_all();
+#endif
 
-int main( int argc, char* args[] )
-{
 	//Start up SDL and create window
 	if( !init() )
 	{
@@ -463,9 +4701,16 @@ int main( int argc, char* args[] )
 			//Set the default recording state
 			RecordingState currentState = SELECTING_DEVICE;
 
-			//Audio device IDs
-			SDL_AudioDeviceID recordingDeviceId = 0;
-			SDL_AudioDeviceID playbackDeviceId = 0;
+			//Whether there is a recording to play back
+			bool hasRecording = false;
+
+			//When the current state was entered, for the running clock
+			RecordingState lastState = currentState;
+			Uint32 stateStartTicks = SDL_GetTicks();
+
+			//Prompt for the stopped and recorded states
+			const char* idlePrompt = "1: record, 3: monitor, 4: latency, 5: all devices.";
+			const char* recordedPrompt = "1: play, 2: record, 3: monitor, 4: latency, 5: all.";
 
 			//While application is running
 			while( !quit )
@@ -497,72 +4742,19 @@ int main( int argc, char* args[] )
 									//Index is valid
 									if( index < gRecordingDeviceCount )
 									{
-										//Default audio spec
-										SDL_AudioSpec desiredRecordingSpec;
-										SDL_zero(desiredRecordingSpec);
-										desiredRecordingSpec.freq = 44100;
-										desiredRecordingSpec.format = AUDIO_F32;
-										desiredRecordingSpec.channels = 2;
-										desiredRecordingSpec.samples = 4096;
-										desiredRecordingSpec.callback = audioRecordingCallback;
-
-										//Open recording device
-										recordingDeviceId = SDL_OpenAudioDevice( SDL_GetAudioDeviceName( index, SDL_TRUE ), SDL_TRUE, &desiredRecordingSpec, &gReceivedRecordingSpec, SDL_AUDIO_ALLOW_FORMAT_CHANGE );
-										
 										//Device failed to open
-										if( recordingDeviceId == 0 )
+										if( !openAudioDevices( index, RECORDING_BUFFER_SAMPLES ) )
 										{
 											//Report error
-											printf( "Failed to open recording device! SDL Error: %s", SDL_GetError() );
-											gPromptTexture.loadFromRenderedText( "Failed to open recording device!", gTextColor );
+											gPromptText = "Failed to open audio devices!";
 											currentState = ERROR;
 										}
 										//Device opened successfully
 										else
 										{
-											//Default audio spec
-											SDL_AudioSpec desiredPlaybackSpec;
-											SDL_zero(desiredPlaybackSpec);
-											desiredPlaybackSpec.freq = 44100;
-											desiredPlaybackSpec.format = AUDIO_F32;
-											desiredPlaybackSpec.channels = 2;
-											desiredPlaybackSpec.samples = 4096;
-											desiredPlaybackSpec.callback = audioPlaybackCallback;
-
-											//Open playback device
-											playbackDeviceId = SDL_OpenAudioDevice( NULL, SDL_FALSE, &desiredPlaybackSpec, &gReceivedPlaybackSpec, SDL_AUDIO_ALLOW_FORMAT_CHANGE );
-
-											//Device failed to open
-											if( playbackDeviceId == 0 )
-											{
-												//Report error
-												printf( "Failed to open playback device! SDL Error: %s", SDL_GetError() );
-												gPromptTexture.loadFromRenderedText( "Failed to open playback device!", gTextColor );
-												currentState = ERROR;
-											}
-											//Device opened successfully
-											else
-											{
-												//Calculate per sample bytes
-												int bytesPerSample = gReceivedRecordingSpec.channels * ( SDL_AUDIO_BITSIZE( gReceivedRecordingSpec.format ) / 8 );
-
-												//Calculate bytes per second
-												int bytesPerSecond = gReceivedRecordingSpec.freq * bytesPerSample;
-
-												//Calculate buffer size
-												gBufferByteSize = RECORDING_BUFFER_SECONDS * bytesPerSecond;
-
-												//Calculate max buffer use
-												gBufferByteMaxPosition = MAX_RECORDING_SECONDS * bytesPerSecond;
-
-												//Allocate and initialize byte buffer
-												gRecordingBuffer = new Uint8[ gBufferByteSize ];
-												memset( gRecordingBuffer, 0, gBufferByteSize );
-
-												//Go on to next state
-												gPromptTexture.loadFromRenderedText("Press 1 to record for 5 seconds.", gTextColor);
-												currentState = STOPPED;
-											}
+											//Go on to next state
+											gPromptText = idlePrompt;
+											currentState = STOPPED;
 										}
 									}
 								}
@@ -571,124 +4763,224 @@ int main( int argc, char* args[] )
 
 						//User getting ready to record
 						case STOPPED:
+						//User has finished recording
+						case RECORDED:
 
 							//On key press
 							if( e.type == SDL_KEYDOWN )
 							{
-								//Start recording
-								if( e.key.keysym.sym == SDLK_1 )
+								//Start playback
+								if( e.key.keysym.sym == SDLK_1 && hasRecording && startPlaybackReader() )
 								{
-									//Go back to beginning of buffer
-									gBufferBytePosition = 0;
+									//Start playback
+									SDL_PauseAudioDevice( gPlaybackDeviceId, SDL_FALSE );
 
+									//Go on to next state
+									gPromptText = "Playing...";
+									currentState = PLAYBACK;
+								}
+								//Start recording, or record again
+								else if( ( e.key.keysym.sym == SDLK_1 || e.key.keysym.sym == SDLK_2 ) && startCaptureWriter() )
+								{
 									//Start recording
-									SDL_PauseAudioDevice( recordingDeviceId, SDL_FALSE );
+									SDL_PauseAudioDevice( gRecordingDeviceId, SDL_FALSE );
 
 									//Go on to next state
-									gPromptTexture.loadFromRenderedText( "Recording...", gTextColor );
+									gPromptText = "Recording... Press 1 to stop.";
 									currentState = RECORDING;
 								}
+								//Listen to the input live
+								else if( e.key.keysym.sym == SDLK_3 && startMonitoring() )
+								{
+									gPromptText = "Monitoring... Press 3 to stop.";
+									currentState = MONITORING;
+								}
+								//Measure round trip latency per buffer size
+								else if( e.key.keysym.sym == SDLK_4 && startLatencyTest() )
+								{
+									gPromptText = "Measuring loopback latency...";
+									currentState = MEASURING_LATENCY;
+								}
+								//Record every device at once
+								else if( e.key.keysym.sym == SDLK_5 && startMultitrackCapture() )
+								{
+									gPromptText = "Recording all devices... Press 5 to stop.";
+									currentState = MULTITRACK_RECORDING;
+								}
+
+								//A mode that failed to start can leave the devices closed
+								if( currentState != MULTITRACK_RECORDING && gRecordingDeviceId == 0 )
+								{
+									gPromptText = "Failed to open audio devices!";
+									currentState = ERROR;
+								}
 							}
-							break;	
+							break;
 
-						//User has finished recording
-						case RECORDED:
+						//User is recording
+						case RECORDING:
 
 							//On key press
-							if( e.type == SDL_KEYDOWN )
+							if( e.type == SDL_KEYDOWN && e.key.keysym.sym == SDLK_1 )
 							{
-								//Start playback
-								if( e.key.keysym.sym == SDLK_1 )
+								//Stop recording audio
+								SDL_PauseAudioDevice( gRecordingDeviceId, SDL_TRUE );
+
+								//Let the writer drain the ring and finish the file
+								stopCaptureWriter();
+								printf( "Recorded %.1f seconds, dropped %d of %d blocks ( %d bytes )\n",
+									(double)gRecordedBytes / ( gReceivedRecordingSpec.freq * gReceivedRecordingSpec.channels * gCaptureConverter.getSampleBytes() ),
+									SDL_AtomicGet( &gDroppedBlocks ), SDL_AtomicGet( &gCapturedBlocks ), SDL_AtomicGet( &gDroppedBytes ) );
+								printf( "%s is %.1f KB, %.1fx smaller than raw\n", gRecordingFile, gRecordingFileBytes / 1024.0,
+									gRecordingFileBytes > 0 ? (double)gRecordedBytes / gRecordingFileBytes : 0.0 );
+								printf( "Writer went through the take with %d pooled %d KB chunks\n",
+									gChunkPool.getChunkCount(), DISK_CHUNK_BYTES / 1024 );
+								if( gVoiceActivated )
 								{
-									//Go back to beginning of buffer
-									gBufferBytePosition = 0;
+									printf( "Voice gate kept %d of %d blocks in %d segments\n",
+										SDL_AtomicGet( &gVoiceBlocks ), SDL_AtomicGet( &gCapturedBlocks ), SDL_AtomicGet( &gVoiceSegments ) );
+								}
 
-									//Start playback
-									SDL_PauseAudioDevice( playbackDeviceId, SDL_FALSE );
+								//Go on to next state
+								hasRecording = true;
+								gPromptText = recordedPrompt;
+								currentState = RECORDED;
+							}
+							break;
 
-									//Go on to next state
-									gPromptTexture.loadFromRenderedText( "Playing...", gTextColor );
-									currentState = PLAYBACK;
+						//User is listening to the input
+						case MONITORING:
+
+							//On key press
+							if( e.type == SDL_KEYDOWN && e.key.keysym.sym == SDLK_3 )
+							{
+								//Devices failed to reopen for recording
+								if( !stopMonitoring() )
+								{
+									gPromptText = "Failed to open audio devices!";
+									currentState = ERROR;
 								}
-								//Record again
-								if( e.key.keysym.sym == SDLK_2 )
+								else
 								{
-									//Reset the buffer
-									gBufferBytePosition = 0;
-									memset( gRecordingBuffer, 0, gBufferByteSize );
+									gPromptText = hasRecording ? recordedPrompt : idlePrompt;
+									currentState = hasRecording ? RECORDED : STOPPED;
+								}
+							}
+							break;
 
-									//Start recording
-									SDL_PauseAudioDevice( recordingDeviceId, SDL_FALSE );
+						//User is recording every device
+						case MULTITRACK_RECORDING:
 
-									//Go on to next state
-									gPromptTexture.loadFromRenderedText( "Recording...", gTextColor );
-									currentState = RECORDING;
+							//On key press
+							if( e.type == SDL_KEYDOWN && e.key.keysym.sym == SDLK_5 )
+							{
+								stopMultitrackCapture();
+
+								//Back to the selected device
+								if( !openAudioDevices( gRecordingDeviceIndex, RECORDING_BUFFER_SAMPLES ) )
+								{
+									gPromptText = "Failed to open audio devices!";
+									currentState = ERROR;
+								}
+								else
+								{
+									gPromptText = hasRecording ? recordedPrompt : idlePrompt;
+									currentState = hasRecording ? RECORDED : STOPPED;
 								}
 							}
 							break;
+
+						default:
+							break;
 					}
 				}
 
-				//Updating recording
-				if( currentState == RECORDING )
+				//Updating latency test
+				if( currentState == MEASURING_LATENCY && !updateLatencyTest() )
 				{
-					//Lock callback
-					SDL_LockAudioDevice( recordingDeviceId );
-
-					//Finished recording
-					if( gBufferBytePosition > gBufferByteMaxPosition )
+					//Devices failed to reopen for recording
+					if( gRecordingDeviceId == 0 )
 					{
-						//Stop recording audio
-						SDL_PauseAudioDevice( recordingDeviceId, SDL_TRUE );
-
-						//Go on to next state
-						gPromptTexture.loadFromRenderedText( "Press 1 to play back. Press 2 to record again.", gTextColor );
-						currentState = RECORDED;
+						gPromptText = "Failed to open audio devices!";
+						currentState = ERROR;
+					}
+					else
+					{
+						gPromptText = hasRecording ? recordedPrompt : idlePrompt;
+						currentState = hasRecording ? RECORDED : STOPPED;
 					}
-
-					//Unlock callback
-					SDL_UnlockAudioDevice( recordingDeviceId );
 				}
+
 				//Updating playback
-				else if( currentState == PLAYBACK )
+				if( currentState == PLAYBACK )
 				{
-					//Lock callback
-					SDL_LockAudioDevice( playbackDeviceId );
-
-					//Finished playback
-					if( gBufferBytePosition > gBufferByteMaxPosition )
+					//Finished playback once the file is read and the ring has drained
+					if( SDL_AtomicGet( &gPlaybackFileDone ) && gPlaybackRing.readAvailable() == 0 )
 					{
 						//Stop playing audio
-						SDL_PauseAudioDevice( playbackDeviceId, SDL_TRUE );
+						SDL_PauseAudioDevice( gPlaybackDeviceId, SDL_TRUE );
+						stopPlaybackReader();
 
 						//Go on to next state
-						gPromptTexture.loadFromRenderedText( "Press 1 to play back. Press 2 to record again.", gTextColor );
+						gPromptText = recordedPrompt;
 						currentState = RECORDED;
 					}
+				}
 
-					//Unlock callback
-					SDL_UnlockAudioDevice( playbackDeviceId );
+				//Restart the clock on state changes
+				if( currentState != lastState )
+				{
+					lastState = currentState;
+					stateStartTicks = SDL_GetTicks();
 				}
 
 				//Clear screen
 				SDL_SetRenderDrawColor( gRenderer, 0xFF, 0xFF, 0xFF, 0xFF );
 				SDL_RenderClear( gRenderer );
 
+				Uint64 textStart = SDL_GetPerformanceCounter();
+
 				//Render prompt centered at the top of the screen
-				gPromptTexture.render( ( SCREEN_WIDTH - gPromptTexture.getWidth() ) / 2, 0 );
+				gTextAtlas.render( gPromptText, ( SCREEN_WIDTH - gTextAtlas.measure( gPromptText ) ) / 2, 0, gTextColor );
 
 				//User is selecting 
 				if( currentState == SELECTING_DEVICE )
 				{
 					//Render device names
-					int yOffset = gPromptTexture.getHeight() * 2;
+					int yOffset = gTextAtlas.getLineHeight() * 2;
 					for( int i = 0; i < gRecordingDeviceCount; ++i )
 					{
-						gDeviceTextures[ i ].render( 0, yOffset );
-						yOffset += gDeviceTextures[ i ].getHeight() + 1;
+						gTextAtlas.render( gDeviceNames[ i ], 0, yOffset, gTextColor );
+						yOffset += gTextAtlas.getLineHeight() + 1;
+					}
+				}
+				//Devices are open
+				else
+				{
+					//Running time while recording or playing
+					if( currentState == RECORDING || currentState == MULTITRACK_RECORDING || currentState == PLAYBACK )
+					{
+						char clock[ 32 ];
+						Uint32 elapsed = SDL_GetTicks() - stateStartTicks;
+						snprintf( clock, sizeof( clock ), "%02u:%02u.%u", elapsed / 60000, elapsed / 1000 % 60, elapsed / 100 % 10 );
+						gTextAtlas.render( clock, ( SCREEN_WIDTH - gTextAtlas.measure( clock ) ) / 2, gTextAtlas.getLineHeight() * 2, gTextColor );
+					}
+
+					//Whether the voice gate is letting audio through
+					if( currentState == RECORDING && gVoiceActivated )
+					{
+						const char* gate = gVoiceGate.isOpen() ? "Voice" : "Listening";
+						gTextAtlas.render( gate, ( SCREEN_WIDTH - gTextAtlas.measure( gate ) ) / 2, gTextAtlas.getLineHeight() * 3, gTextColor );
 					}
+
+					renderMeters();
 				}
 
+				//Draw all queued text in one batch
+				gTextAtlas.flush();
+				gTextTicks += SDL_GetPerformanceCounter() - textStart;
+				++gTextFrames;
+
 				//Update screen
 				SDL_RenderPresent( gRenderer );
 			}
@@ -6,6 +6,13 @@
 #include <assert.h>
 #include <vector>
 #include <time.h>
+#include <string>
+
+#include "audioengine.h"
+#include "callbackprofiler.h"
+#include "latencyprofiler.h"
+#include "audiosink.h"
+#include "peakpyramid.h"
 
 extern "C"
 {
@@ -19,200 +26,93 @@ extern "C"
 #define SDL_AUDIO_BUFFER_SIZE 4096
 const int AMPLITUDE = 28000;
 const int SAMPLE_RATE = 44100;
-#define MAX_AUDIO_FRAME_SIZE 192000
-SDL_Texture* tex;
 SDL_Renderer* renderer;
+callbackProfiler profiler;
+latencyProfiler latency;
 
-int audio_decode_frame_private(AVCodecContext *aCodecCtx, AVPacket* packet, uint8_t *audio_buf, int buf_size);
-
-class SamplesQueue{
-public:
-	std::vector<std::vector<short> > samples;
-  int sampleIndex;
-
-	SamplesQueue()
-	{
-    sampleIndex = 0;
-	}
-
-	int put_packet(AVCodecContext *aCodecCtx, AVPacket *packet)
-	{
-		if(av_dup_packet(packet) < 0) {
-    	return -1;
-	  }	    
-
-	  uint8_t audio_buf[(MAX_AUDIO_FRAME_SIZE * 3) / 2];
-		unsigned int audio_buf_size = 0;
-  	unsigned int audio_buf_index = 0;
-  	audio_buf_size = audio_decode_frame_private(aCodecCtx, packet, audio_buf, sizeof(audio_buf));
-
-  	short* samples_data = (short*)audio_buf;
-  	int samples_len = audio_buf_size / 2;
-  	//samples.insert(samples.end(), samples_data, samples_data+samples_len);
-    samples.emplace_back(samples_data, samples_data+samples_len);
-
-    //SDL_Log("push packet len %d\n", samples_len);
-
-	  return 0;
-	}
-
-	int get_sample(uint8_t* buf, int size)
-	{
-    if (sampleIndex >= samples.size())
-    {
-      return 0;
-    }
-
-		std::vector<short> sample_data = samples[sampleIndex++];
-    int len = sample_data.size()*sizeof(short);
-    memcpy(buf, sample_data.data(), len);
-
-		return len;
-	}
-
-	void render(short* samples_data, int samples_len)
-	{
-		static int x = 0;
-		static int y = 0;
-		const int H = 200;
-
-		SDL_SetRenderTarget(renderer, tex);
-		SDL_SetRenderDrawColor( renderer, 0x00, 0xFF, 0xFF, 0xFF );
-	  for (int i = 0; i < samples_len; i++)
-	  {
-	  	short one_sample = samples_data[i];
-	  	
-	  	int sampleH = ((float)one_sample / 32768.0f)*H;
-	  	//SDL_Log("render sampleH %d one_sample %d\n", sampleH, one_sample);
-	  	if (sampleH > 0) 
-	  	{		  	
-				SDL_Rect fillRect = { x++, y+(H - sampleH)/2, 1, sampleH};  
-		  	SDL_RenderFillRect( renderer, &fillRect );		
-	  	}
-	
-	  	if (x >= 480)
-	  	{
-	  		x = 0;
-	  		y += H;
-	  	}
-	  }
-
-		SDL_SetRenderTarget(renderer, NULL);		
-	}
-};
-
-AVFrame wanted_frame;
-SamplesQueue samplesq;
+AudioDecoder decoder;
+SampleQueue samplesq;
 int quit = 0;
 
-int audio_decode_frame_private(AVCodecContext *aCodecCtx, AVPacket* packet, uint8_t *audio_buf, int buf_size)
-{
-
-  SwrContext *swr_ctx = NULL;
-  int        	convert_all = 0;
-  int 				audio_buf_index = 0;
-
-  // TO delete av_frame_free(&frame);
-	AVFrame* frame = av_frame_alloc();
-  int pkt_size = packet->size;
-  while(pkt_size > 0)
-  {
-  	int got_frame = 0;
-  	int decode_len = avcodec_decode_audio4(aCodecCtx, frame, &got_frame, packet);
-  	if (decode_len < 0) //解码出错
-  	{
-  		assert(0);
-  		return -1;
-  	}
-
-  	if (got_frame)
-  	{
-  		if (frame->channels > 0 && frame->channel_layout == 0)
-      {
-        //获取默认布局，默认应该了stereo吧？
-        frame->channel_layout = av_get_default_channel_layout(frame->channels);
-      }
-      else if (frame->channels == 0 && frame->channel_layout > 0)
-      {
-        frame->channels = av_get_channel_layout_nb_channels(frame->channel_layout);
-      }
-
-      if (swr_ctx != NULL)
-      {
-        swr_free(&swr_ctx);
-        swr_ctx = NULL;
-      }
-
-      swr_ctx = swr_alloc_set_opts(NULL, wanted_frame.channel_layout,
-						                      (AVSampleFormat)wanted_frame.format,
-						                      wanted_frame.sample_rate, frame->channel_layout,
-						                      (AVSampleFormat)frame->format, frame->sample_rate, 0, NULL);
-
-      //初始化
-      if (swr_ctx == NULL || swr_init(swr_ctx) < 0)
-      {
-      	assert(0);
-      	break;
-      }
-
-      int convert_len = swr_convert(swr_ctx, 
-                                &audio_buf + audio_buf_index,
-                                MAX_AUDIO_FRAME_SIZE,
-                                (const uint8_t **)frame->data, 
-                                frame->nb_samples);
-
-      pkt_size -= decode_len;
-      audio_buf_index += convert_len;
-      convert_all += convert_len;
-  	}
-  }
-
-  swr_free(&swr_ctx);
-  av_frame_free(&frame);
+// whole-file overview, built from its own copy of the decoded samples alongside the decode
+PeakPyramid overview;
+SampleQueue overviewq;
+// what the window shows: the frame at its left edge and frames per pixel
+double view_start = 0;
+double view_scale = 1;
 
-  return wanted_frame.channels * convert_all * av_get_bytes_per_sample((AVSampleFormat)wanted_frame.format);
+static int build_overview(void *data)
+{
+	static uint8_t buf[AUDIO_ENGINE_BUFFER_SIZE];
+	bool underrun;
+	int len;
+	while ((len = overviewq.get(buf, sizeof(buf), &underrun)) > 0)
+		overview.add((Sint16*)buf, len / 2);
+	return 0;
 }
 
-void audio_callback_new(void *user_data, Uint8 *stream, int len)
+// zooms by factor keeping the frame under pixel x where it is
+static void zoom_overview(double factor, int x, int width)
 {
-	static uint8_t audio_buf[(MAX_AUDIO_FRAME_SIZE * 3) / 2];
-  static unsigned int audio_buf_size = 0;
-  static unsigned int audio_buf_index = 0;
-
-	SDL_memset(stream, 0, len);
-
-	while(len > 0) {
-  	if(audio_buf_index >= audio_buf_size) {
-  		//samplesq.get_sample(audio_buf, sizeof(audio_buf));
-      /* We have already sent all our data; get more */
-      int audio_size = samplesq.get_sample(audio_buf, sizeof(audio_buf)); //audio_decode_frame(aCodecCtx, audio_buf, sizeof(audio_buf));
-      if(audio_size < 0) {      	
-				/* If error, output silence */
-				audio_buf_size = 1024; // arbitrary?
-				memset(audio_buf, 0, audio_buf_size);
-        return;
-      } else {
-				audio_buf_size = audio_size;
-      }
-      audio_buf_index = 0;
-    }
-    int len1 = audio_buf_size - audio_buf_index;
-    if(len1 > len)
-      len1 = len;
-		
-		SDL_MixAudioFormat(stream, (uint8_t *)audio_buf + audio_buf_index, AUDIO_S16SYS, len, SDL_MIX_MAXVOLUME);	
-
-    len -= len1;
-    stream += len1;
-    audio_buf_index += len1;
+	double anchor = view_start + x * view_scale;
+	// from a frame per pixel out to the whole file across the window
+	double widest = SDL_max((double)overview.getFrames() / width, 1.0);
+	view_scale = SDL_min(SDL_max(view_scale * factor, 1.0), widest);
+	view_start = SDL_max(anchor - x * view_scale, 0.0);
+}
 
-  }
+// one peak and one RMS rect per pixel column, O(width) whatever the zoom and the length of the file
+static void draw_overview(int width, int height, Uint64 played)
+{
+	static std::vector<PeakEntry> columns;
+	static std::vector<SDL_Rect> peaks, levels;
+	columns.resize(width);
+	overview.query(view_start, view_scale, width, &columns[0]);
+	peaks.clear();
+	levels.clear();
+	for (int x = 0; x < width; x++) {
+		const PeakEntry& column = columns[x];
+		if (column.min > column.max)
+			continue;
+		int top = (32767 - column.max) * (height - 1) / 65535;
+		int bottom = (32767 - column.min) * (height - 1) / 65535;
+		int rms = column.rms * (height - 1) / 65535;
+		SDL_Rect peak = { x, top, 1, bottom - top + 1 };
+		SDL_Rect level = { x, height / 2 - rms, 1, 2 * rms + 1 };
+		peaks.push_back(peak);
+		levels.push_back(level);
+	}
+	SDL_SetRenderDrawColor(renderer, 160, 160, 255, 255);
+	if (!peaks.empty())
+		SDL_RenderFillRects(renderer, &peaks[0], peaks.size());
+	SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
+	if (!levels.empty())
+		SDL_RenderFillRects(renderer, &levels[0], levels.size());
+
+	// the playhead, when it is in view
+	double x = (played - view_start) / view_scale;
+	if (x >= 0 && x < width) {
+		SDL_SetRenderDrawColor(renderer, 255, 255, 0, 255);
+		SDL_RenderDrawLine(renderer, (int)x, 0, (int)x, height - 1);
+	}
 }
 
 int main(int argc, char *argv[])
 {
-	if (argc < 2) {
-		fprintf(stderr, "Usage: testaudio <file>\n");
+	const char *path = NULL;
+	const char *sink_name = "sdl";
+	bool audio_only = false;
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--audio-only"))
+			audio_only = true;
+		else if (!strcmp(argv[i], "--sink") && i + 1 < argc)
+			sink_name = argv[++i];
+		else
+			path = argv[i];
+	}
+	AudioSink *sink = audioSinkCreate(sink_name);
+	if (!path || !sink) {
+		fprintf(stderr, "Usage: testffaudio [--audio-only] [--sink sdl|null|wav:<path>] <file>\n");
 		exit(1);
 	}
 
@@ -220,139 +120,205 @@ int main(int argc, char *argv[])
 	// Register all formats and codecs
 	av_register_all();
 
-	if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_TIMER)) {
+	// only the sdl sink needs an audio device, --audio-only skips the window
+	Uint32 sdl_flags = SDL_INIT_EVENTS | SDL_INIT_TIMER;
+	if (!audio_only)
+		sdl_flags |= SDL_INIT_VIDEO;
+	if (sink->isRealtime())
+		sdl_flags |= SDL_INIT_AUDIO;
+	if (SDL_Init(sdl_flags)) {
 			SDL_Log("Could not initialize SDL - %s\n", SDL_GetError());
 			exit(1);
 	}
 
-	SDL_Window 			*window;
-	// Make a screen to put our video
-	window = SDL_CreateWindow(
-					"testaudio",
-					SDL_WINDOWPOS_UNDEFINED,
-					SDL_WINDOWPOS_UNDEFINED,
-					640,
-					480,
-					0
-			);
+	SDL_Window 			*window = NULL;
+	if (!audio_only)
+	{
+		// Make a screen to put our video
+		window = SDL_CreateWindow(
+						"testaudio",
+						SDL_WINDOWPOS_UNDEFINED,
+						SDL_WINDOWPOS_UNDEFINED,
+						640,
+						480,
+						0
+				);
+
+		renderer = SDL_CreateRenderer(window, -1, 0);
+	}
 
-	renderer = SDL_CreateRenderer(window, -1, 0);
+	AVPacket 				packet;
+	static uint8_t audio_buf[AUDIO_ENGINE_BUFFER_SIZE];
 
-	tex = SDL_CreateTexture(renderer,SDL_PIXELFORMAT_RGBA8888,SDL_TEXTUREACCESS_TARGET,640,480);
+  // Open the file and its first audio stream
+	if (!decoder.open(path))
+			return -1;
 
-	AVFormatContext *pFormatCtx = NULL;
-	AVPacket 				packet;
-	int             audioStream = 0;
-	AVCodecContext  *aCodecCtx = NULL;
-  AVCodec         *aCodec = NULL;
-  
-  // Open video file
-	if (avformat_open_input(&pFormatCtx, argv[1], NULL, NULL) != 0)
-			return -1; // Couldn't open file
-
-	// Retrieve stream information
-	if (avformat_find_stream_info(pFormatCtx, NULL) < 0)
-			return -1; // Couldn't find stream information
-
-	// Dump information about file onto standard error
-	av_dump_format(pFormatCtx, 0, argv[1], 0);
-
-	audioStream=-1;
-	for(int i=0; i<pFormatCtx->nb_streams; i++) {
-		if(pFormatCtx->streams[i]->codec->codec_type==AVMEDIA_TYPE_AUDIO && audioStream < 0) {
-			audioStream = i;
-		}
-	}
-	if(audioStream==-1)
-		return -1;
-
-	// Get a pointer to the codec context for the video stream
-	aCodecCtx = pFormatCtx->streams[audioStream]->codec;
-	// Find the decoder for the video stream
-	aCodec = avcodec_find_decoder(aCodecCtx->codec_id);
-	if (aCodec == NULL) {
-			fprintf(stderr, "Unsupported codec!\n");
-			return -1; // Codec not found
-	}
+  AudioMixer mixer(&samplesq, AUDIO_S16SYS);
+  mixer.setProfiler(&profiler);
+  latencyProfilerInit(&latency, "testffaudio");
+  mixer.setLatencyProfiler(&latency);
 
   SDL_AudioSpec want;
-  want.freq = aCodecCtx->sample_rate; // number of samples per second
+  SDL_zero(want);
+  want.freq = decoder.getSampleRate(); // number of samples per second
   want.format = AUDIO_S16SYS; // sample type (here: signed short i.e. 16 bit)
-  want.channels = aCodecCtx->channels; // only one channel
+  want.channels = decoder.getChannels();
   want.silence = 0;
   want.samples = SDL_AUDIO_BUFFER_SIZE; // buffer-size
-  want.callback = audio_callback_new; // function SDL calls periodically to refill the buffer
-  want.userdata = aCodecCtx; // counter, keeping track of current sample number
+  want.callback = AudioMixer::callback; // function SDL calls periodically to refill the buffer
+  want.userdata = &mixer;
+  callbackProfilerWrap(&profiler, "testffaudio", &want);
 
   SDL_AudioSpec have;
-	SDL_AudioDeviceID dev;
-  if((dev = SDL_OpenAudioDevice(NULL, 0, &want, &have, SDL_AUDIO_ALLOW_ANY_CHANGE)) != 0)
-		SDL_LogError(SDL_LOG_CATEGORY_AUDIO, "Failed to open audio: %s", SDL_GetError());
+  if(!sink->open(&want, &have))
+		exit(1);
   if(want.format != have.format) SDL_LogError(SDL_LOG_CATEGORY_AUDIO, "Failed to get the desired AudioSpec");
 
   SDL_Log("want freq %d sample %d, have freq %d sample %d\n", want.freq, want.samples, have.freq, have.samples);
+  callbackProfilerStart(&profiler, &have);
+  latencyProfilerStart(&latency, &have);
 
 	//设置参数，供解码时候用, swr_alloc_set_opts的in部分参数
-  wanted_frame.format         = AV_SAMPLE_FMT_S16;
-  wanted_frame.sample_rate    = have.freq;
-  wanted_frame.channel_layout = av_get_default_channel_layout(have.channels);
-  wanted_frame.channels       = have.channels;
+  decoder.setOutput(have.freq, have.channels, AV_SAMPLE_FMT_S16);
+
+  // a file seen before has its overview in a sidecar next to it, anything else is scanned as it decodes
+  std::string sidecar = std::string(path) + ".peaks";
+  Uint64 overview_ticks = SDL_GetPerformanceCounter();
+  SDL_Thread *overview_thread = NULL;
+  bool overview_loaded = overview.load(sidecar.c_str(), path, have.freq, have.channels);
+  if (overview_loaded) {
+    SDL_Log("overview: loaded %s in %.2f ms\n", sidecar.c_str(),
+      (SDL_GetPerformanceCounter() - overview_ticks) * 1000.0 / SDL_GetPerformanceFrequency());
+  } else {
+    overview.reset(have.freq, have.channels);
+    overview_thread = SDL_CreateThread(build_overview, "overview", NULL);
+  }
 
-	avcodec_open2(aCodecCtx, aCodec, NULL);
-	
   int countFrame = 0;
+  Uint64 start_ticks = SDL_GetPerformanceCounter();
   SDL_Log("start read frame %d\n", SDL_GetTicks());
-	while (av_read_frame(pFormatCtx, &packet) >= 0) 
+	while (decoder.readPacket(&packet)) 
   {
     if (++countFrame % 1000 == 0)
     {
       SDL_Log("framecount %d\n", countFrame);
     }
-    if(packet.stream_index == audioStream) 
+    int audio_size = decoder.decode(&packet, audio_buf, sizeof(audio_buf));
+    if (audio_size > 0)
     {
-      samplesq.put_packet(aCodecCtx, &packet);
-    }
-    else
-    {
-      av_free_packet(&packet);
+      samplesq.put((Sint16*)audio_buf, audio_size / 2, &decoder.getLatencyTag());
+      if (overview_thread)
+        overviewq.put((Sint16*)audio_buf, audio_size / 2);
     }
+    av_free_packet(&packet);
   }
+  // everything is decoded before playback starts
+  samplesq.finish();
 
   SDL_Log("finish read frame %d\n", SDL_GetTicks());
+
+  if (overview_thread)
+  {
+    Uint64 decoded_ticks = SDL_GetPerformanceCounter();
+    overviewq.finish();
+    SDL_WaitThread(overview_thread, NULL);
+    overview.finish();
+    SDL_Log("overview: built alongside the decode, done %.2f ms after it\n",
+      (SDL_GetPerformanceCounter() - decoded_ticks) * 1000.0 / SDL_GetPerformanceFrequency());
+    if (!overview.save(sidecar.c_str(), path))
+      SDL_Log("overview: could not write %s\n", sidecar.c_str());
+  }
+  SDL_Log("overview: %llu frames, %d levels, %llu entries\n", (unsigned long long)overview.getFrames(),
+    overview.getLevelCount(), (unsigned long long)overview.getEntryCount());
+
+  // start with the whole file across the window
+  int view_width = 0, view_height = 0;
+  if (renderer)
+  {
+    SDL_GetRendererOutputSize(renderer, &view_width, &view_height);
+    view_scale = SDL_max((double)overview.getFrames() / view_width, 1.0);
+  }
   
-  SDL_PauseAudioDevice(dev, 0);; // start playing sound
+  sink->pause(false); // start playing sound
 
   while(!quit) 
   {
   	SDL_Event event;
   	while(SDL_PollEvent(&event))
   	{
-  		SDL_PollEvent(&event);
 			switch (event.type) {
 			case SDL_QUIT:			
 				SDL_Log("quit tick %d\n", SDL_GetTicks());
 				quit = 1;
 				
+				break;
+			case SDL_MOUSEWHEEL:
+				{
+					// one power-of-two level per notch, about the pointer
+					int x;
+					SDL_GetMouseState(&x, NULL);
+					zoom_overview(event.wheel.y > 0 ? 0.5 : 2, x, view_width);
+				}
+				break;
+			case SDL_KEYDOWN:
+				switch (event.key.keysym.sym) {
+				case SDLK_UP:
+					zoom_overview(0.5, view_width / 2, view_width);
+					break;
+				case SDLK_DOWN:
+					zoom_overview(2, view_width / 2, view_width);
+					break;
+				case SDLK_LEFT:
+					view_start = SDL_max(view_start - view_width / 4 * view_scale, 0.0);
+					break;
+				case SDLK_RIGHT:
+					view_start = SDL_min(view_start + view_width / 4 * view_scale, (double)overview.getFrames());
+					break;
+				}
 				break;
 			}
   	}
   	
-  	SDL_SetRenderDrawColor(renderer, 0, 0, 255, 255);
-		SDL_RenderClear(renderer);
+  	if (renderer)
+  	{
+	  	SDL_SetRenderDrawColor(renderer, 0, 0, 255, 255);
+			SDL_RenderClear(renderer);
 
-		SDL_RenderCopy(renderer, tex, NULL, NULL);
+			draw_overview(view_width, view_height, sink->getFramesPulled());
 
-    SDL_RenderPresent(renderer);
+	    SDL_RenderPresent(renderer);
+	  }
+
+    callbackProfilerPoll(&profiler);
+    latencyProfilerPoll(&latency);
 
-		SDL_Delay(10);
+		// the null and wav sinks play flat out and are done once everything is played
+		if (sink->isRealtime())
+			SDL_Delay(10);
+		else if (samplesq.isDrained())
+			quit = 1;
   }
 
 	SDL_Log("app quit tick %d\n", SDL_GetTicks());
 
-	SDL_PauseAudioDevice(dev, 1); // stop playing sound
-  SDL_CloseAudioDevice(dev);
-  SDL_DestroyRenderer(renderer);
-	SDL_DestroyWindow(window);
+	double elapsed = (double)(SDL_GetPerformanceCounter() - start_ticks) / SDL_GetPerformanceFrequency();
+	const AudioResampler& output = decoder.getResampler();
+	Uint64 frames = samplesq.getSamplesPut() / output.getChannels();
+	SDL_Log("pipeline: %llu frames in %.3f s through the %s sink, %.0f frames/s, %.1fx realtime\n",
+		(unsigned long long)frames, elapsed, sink->getName(), frames / elapsed, frames / elapsed / output.getRate());
+
+	sink->pause(true); // stop playing sound
+	callbackProfilerDump(&profiler);
+	latencyProfilerDump(&latency);
+  sink->close();
+  delete sink;
+  decoder.close();
+  if (renderer)
+  {
+	  SDL_DestroyRenderer(renderer);
+		SDL_DestroyWindow(window);
+	}
 	SDL_Quit();
   return 0;
 }
\ No newline at end of file
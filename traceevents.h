@@ -0,0 +1,186 @@
+#ifndef TRACEEVENTS_H
+#define TRACEEVENTS_H
+
+/*
+ * Scoped trace points written as Chrome trace event JSON, which
+ * chrome://tracing and ui.perfetto.dev both open.
+ *
+ *     traceInit(getenv("TRACE_FILE"));   // NULL leaves tracing off
+ *     ...
+ *     { TRACE_SCOPE("decode"); ... }
+ *     traceCounter("queued", n);
+ *     ...
+ *     traceWrite();
+ *
+ * Each thread claims one of a fixed set of buffers the first time it traces
+ * and after that only writes into its own ring, so the hot path takes no
+ * locks and never allocates. A full ring overwrites its oldest events, the
+ * file gets the newest TRACE_BUFFER_EVENTS of every thread. Write the file
+ * once the traced threads have stopped or been paused.
+ */
+
+#include <SDL.h>
+#include <stdio.h>
+#include <atomic>
+
+#define TRACE_MAX_THREADS 8
+#define TRACE_BUFFER_EVENTS (1 << 15)
+
+struct TraceEvent
+{
+    const char* name;
+    Uint64 start;
+    Uint64 duration;
+    Sint64 value;
+    char phase;
+};
+
+struct TraceBuffer
+{
+    const char* threadName;
+    // events written so far, the ring index is count % TRACE_BUFFER_EVENTS
+    std::atomic<Uint32> count;
+    TraceEvent events[TRACE_BUFFER_EVENTS];
+};
+
+struct TraceState
+{
+    const char* path;
+    TraceBuffer* buffers;
+    std::atomic<Uint32> claimed;
+    Uint64 origin;
+};
+
+inline TraceState& traceState()
+{
+    static TraceState state;
+    return state;
+}
+
+// sets up the buffers, tracing stays off when path is NULL
+inline void traceInit(const char* path)
+{
+    TraceState& state = traceState();
+    state.path = path;
+    state.claimed.store(0);
+    state.origin = SDL_GetPerformanceCounter();
+    state.buffers = path ? new TraceBuffer[TRACE_MAX_THREADS] : NULL;
+    for (int i = 0; state.buffers && i < TRACE_MAX_THREADS; i++) {
+        state.buffers[i].threadName = NULL;
+        state.buffers[i].count.store(0);
+    }
+}
+
+// this thread's buffer, NULL when tracing is off or every buffer is taken
+inline TraceBuffer* traceThreadBuffer()
+{
+    static thread_local TraceBuffer* buffer = NULL;
+    static thread_local bool claimed = false;
+    TraceState& state = traceState();
+    if (!claimed && state.buffers) {
+        Uint32 index = state.claimed.fetch_add(1);
+        buffer = index < TRACE_MAX_THREADS ? &state.buffers[index] : NULL;
+        claimed = true;
+    }
+    return buffer;
+}
+
+inline void traceSetThreadName(const char* name)
+{
+    TraceBuffer* buffer = traceThreadBuffer();
+    if (buffer)
+        buffer->threadName = name;
+}
+
+inline void traceEmit(TraceBuffer* buffer, const char* name, char phase, Uint64 start, Uint64 duration, Sint64 value)
+{
+    Uint32 count = buffer->count.load(std::memory_order_relaxed);
+    TraceEvent& event = buffer->events[count % TRACE_BUFFER_EVENTS];
+    event.name = name;
+    event.phase = phase;
+    event.start = start;
+    event.duration = duration;
+    event.value = value;
+    buffer->count.store(count + 1, std::memory_order_release);
+}
+
+// a value plotted over time, like a queue depth
+inline void traceCounter(const char* name, Sint64 value)
+{
+    TraceBuffer* buffer = traceThreadBuffer();
+    if (buffer)
+        traceEmit(buffer, name, 'C', SDL_GetPerformanceCounter(), 0, value);
+}
+
+// one complete event from construction to destruction, name must outlive the trace
+class TraceScope
+{
+private:
+    TraceBuffer* buffer;
+    const char* name;
+    Uint64 start;
+public:
+    TraceScope(const char* scopeName)
+    {
+        buffer = traceThreadBuffer();
+        name = scopeName;
+        start = buffer ? SDL_GetPerformanceCounter() : 0;
+    }
+    ~TraceScope()
+    {
+        if (buffer)
+            traceEmit(buffer, name, 'X', start, SDL_GetPerformanceCounter() - start, 0);
+    }
+};
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(traceScope, __LINE__)(name)
+
+// writes every buffer to the path given to traceInit, returns the events written
+inline Uint32 traceWrite()
+{
+    TraceState& state = traceState();
+    if (!state.buffers)
+        return 0;
+    FILE* file = fopen(state.path, "w");
+    if (!file) {
+        printf("Unable to write trace to %s\n", state.path);
+        return 0;
+    }
+
+    double usPerTick = 1000000.0 / SDL_GetPerformanceFrequency();
+    Uint32 threads = SDL_min(state.claimed.load(), (Uint32)TRACE_MAX_THREADS);
+    Uint32 written = 0;
+    const char* separator = "";
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    for (Uint32 t = 0; t < threads; t++) {
+        TraceBuffer& buffer = state.buffers[t];
+        Uint32 count = buffer.count.load(std::memory_order_acquire);
+        Uint32 first = count > TRACE_BUFFER_EVENTS ? count - TRACE_BUFFER_EVENTS : 0;
+        if (buffer.threadName) {
+            fprintf(file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+                separator, t + 1, buffer.threadName);
+            separator = ",";
+        }
+        for (Uint32 i = first; i < count; i++) {
+            TraceEvent& event = buffer.events[i % TRACE_BUFFER_EVENTS];
+            double ts = (Sint64)(event.start - state.origin) * usPerTick;
+            if (event.phase == 'X') {
+                fprintf(file, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+                    separator, event.name, t + 1, ts, event.duration * usPerTick);
+            } else {
+                fprintf(file, "%s\n{\"name\":\"%s\",\"ph\":\"C\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"args\":{\"value\":%lld}}",
+                    separator, event.name, t + 1, ts, (long long)event.value);
+            }
+            separator = ",";
+            written++;
+        }
+    }
+    fprintf(file, "\n]}\n");
+    fclose(file);
+    printf("Wrote %u trace events from %u threads to %s\n", written, threads, state.path);
+    return written;
+}
+
+#endif